@@ -0,0 +1,24 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATOM_H
+#define ATOM_H
+
+void Orb_atom_init(void);
+
+#endif /* ATOM_H */
@@ -215,10 +215,87 @@ static inline void Orb_init(int argc, char* argv[]) {
 	Orb_post_gc_init(argc, argv);
 }
 
-/*starts a new thread, invoking the given function*/
+/*starts a new thread, invoking the given function.
+Returns a thread object with the methods 'finished, which
+returns t once the function has returned, and 'result, which
+returns its return value (nil while it is still running).
+*/
 Orb_t Orb_new_thread(Orb_t);
+/*starts a new "threadlet", a thread with a small guarded
+stack taken from a reusable pool of stacks.  Threadlets are
+cheap enough to have tens of thousands running at once, but
+deep non-tail recursion in cfunc's may overflow their stacks.
+Returns a thread object like Orb_new_thread().
+*/
+Orb_t Orb_new_threadlet(Orb_t);
+/*stack size given to Orb_priv_new_thread_ex() and
+Orb_thread_pool_stack_size() to request threadlet stacks
+*/
+#define Orb_THREADLET_STACK ((size_t) -1)
+#define Orb_THREADLET_DEFAULT_STACK_SIZE (64 * 1024)
+/*sets the stack size of threadlets and returns the size
+actually used.  Passing 0 just queries the size.  The size
+can only be changed before the first threadlet is started.
+*/
+size_t Orb_threadlet_stack_size(size_t);
 
+/*creates an atom, a shared mutable reference to an
+immutable value.  Atoms have get, reset, swap,
+compare-and-set, and retries methods.  The function given
+to swap may be called more than once if the atom is
+contended, so it must not have side effects.
+*/
 Orb_t Orb_new_atom(Orb_t);
+/*creates a transactional variable.  Outside a transaction,
+its value can be read with its get method.
+*/
+Orb_t Orb_new_tvar(Orb_t);
+/*calls f with a transaction object, whose read and write
+methods access tvars.  The reads and writes of f appear to
+happen atomically.  f may be called more than once if other
+transactions conflict with it, so it must not have side
+effects other than writes to tvars.  Returns the return
+value of the call that commits.
+*/
+Orb_t Orb_atomically(Orb_t f);
+/*creates a multi-producer, multi-consumer channel.  A
+capacity of 0 creates an unbounded channel; otherwise sends
+block while the channel holds capacity values (rounded up
+to a power of 2, and at least 2).  Channels have send, try-send, send-all,
+recv, try-recv, recv-many, and close methods, and send-for
+and recv-for, which give up after a number of milliseconds.
+*/
+Orb_t Orb_new_channel(size_t capacity);
+/*creates a versioned object, for shared state that is read
+much more often than written.  Reads (get, version and
+snapshot methods) are a single atomic load.  Writes (set,
+update and set-if-version methods) are serialized, so the
+function given to update is called exactly once.
+*/
+Orb_t Orb_new_versioned(Orb_t);
+/*creates a concurrent hash map, with get, put, update,
+remove, len and snapshot methods.  Keys are compared by
+identity if hash and eq are both Orb_NIL; otherwise
+(hash k) must return an integer, and (eq a b) must be true
+for keys that are the same.
+*/
+Orb_t Orb_new_hash_map(Orb_t hash, Orb_t eq);
+/*creates a countdown latch, with count-down, wait and count
+methods.  Waiting threads help run thread pool tasks until
+count-down has been called count times.
+*/
+Orb_t Orb_new_latch(size_t count);
+/*creates a cyclic barrier for the given number of parties.
+Its wait method blocks until all parties are waiting, and
+returns the number of the cycle completed.
+*/
+Orb_t Orb_new_barrier(size_t parties);
+/*creates a phaser, a barrier whose parties can register and
+deregister.  Phasers have register, arrive,
+arrive-and-deregister, arrive-and-wait, wait-advance and
+phase methods.
+*/
+Orb_t Orb_new_phaser(size_t parties);
 Orb_t Orb_new_sema(size_t);
 
 /*yields the processor time slice*/
@@ -368,14 +445,325 @@ Orb_EACH(i, seq) {
 /*
  * Thread Pool
  */
-void Orb_thread_pool_add(Orb_t);
+/*queues a function for execution by the pool.  Functions
+queued by pool tasks always succeed.  Otherwise, if the
+pool's queues are full, the overflow policy decides what
+happens; returns 0 if the function was rejected.
+Functions queued by pool tasks get the priority class of
+the queuing task, others get Orb_PRIO_NORMAL.
+*/
+int Orb_thread_pool_add(Orb_t);
+/*priority classes for Orb_thread_pool_add_prio().  Workers
+run tasks of higher classes first, but now and then look
+at the lower classes first, so that they are not starved.
+*/
+#define Orb_PRIO_HIGH		0
+#define Orb_PRIO_NORMAL		1
+#define Orb_PRIO_LOW		2
+#define Orb_PRIO_CLASSES	3
+/*like Orb_thread_pool_add(), with the given priority class*/
+int Orb_thread_pool_add_prio(Orb_t, int);
+/*queues n functions at once, waking up to n idle workers.
+This is much cheaper than queuing them one at a time.
+Returns the number of functions queued, which is less than
+n only under Orb_POOL_REJECT.
+*/
+size_t Orb_thread_pool_add_n(Orb_t const*, size_t n);
+size_t Orb_thread_pool_add_prio_n(Orb_t const*, size_t n, int);
+/*overflow policies for Orb_thread_pool_overflow()*/
+/*wait until there is space in the queue (the default)*/
+#define Orb_POOL_BLOCK		0
+/*run the function in the submitting thread*/
+#define Orb_POOL_RUN_INLINE	1
+/*make Orb_thread_pool_add() return 0*/
+#define Orb_POOL_REJECT		2
+void Orb_thread_pool_overflow(int);
+/*sets the number of tasks that each queue for tasks from
+outside the pool can hold (there is one queue per priority
+class, and per node with Orb_POOL_NUMA).  Only has an effect if called
+before the first Orb_thread_pool_add().
+*/
+#define Orb_POOL_DEFAULT_QUEUE_CAPACITY 4096
+void Orb_thread_pool_queue_capacity(size_t);
+/*sets the most times an idle worker polls the queues before
+it goes to sleep, so that tasks queued in quick succession
+start without waking a sleeping worker.  Workers poll for
+less when polling keeps finding nothing.  0 disables
+polling; by default workers only poll if the pool has more
+than one processor.  Only has an effect if called before the
+first Orb_thread_pool_add().
+*/
+void Orb_thread_pool_spin(size_t);
+/*returns the approximate number of tasks waiting to be
+run
+*/
+size_t Orb_thread_pool_queue_depth(void);
+/*returns non-0 if a task queued by the calling thread now
+is likely to be picked up by an otherwise idle worker: the
+caller is not a pool worker, or some worker is idle, or the
+calling worker's own deque is nearly empty, so thieves would
+find nothing else.  When it returns 0, Orb_defer() keeps
+the task on the worker's own deque without waking anyone,
+and Orb_defer_hint() and Orb_defer_n() run functions
+inline.
+*/
+int Orb_thread_pool_hungry(void);
+/*sets the stack size of thread-pool workers started
+after this call: 0 for the system default,
+Orb_THREADLET_STACK for threadlet stacks, or a size in
+bytes.  Call before the first Orb_thread_pool_add() to
+affect all workers.
+*/
+void Orb_thread_pool_stack_size(size_t);
+/*worker placement flags for Orb_thread_pool_placement()*/
+/*pin each worker to one of the CPUs we are allowed to run on*/
+#define Orb_POOL_PIN	1
+/*group workers by NUMA node, with one task queue per node,
+and queue tasks on the node of the submitting thread
+*/
+#define Orb_POOL_NUMA	2
+/*sets worker placement for the pool.  Only has an effect
+if called before the first Orb_thread_pool_add().
+*/
+void Orb_thread_pool_placement(int);
+/*sets the number of workers in the pool.  If the pool is
+already running, starts new workers or retires idle ones
+(workers finish their current task before retiring).
+Passing 0 selects the default, which is the value of the
+ORB_THREAD_POOL_SIZE environment variable if set, or else
+the number of processors available to the process, taking
+CPU affinity and cgroup CPU quotas into account.
+*/
+void Orb_thread_pool_resize(size_t);
+/*returns the number of workers the pool is trying to have*/
+size_t Orb_thread_pool_size(void);
+/*pool tasks that are about to block on something other
+than Orb synchronization objects (which already do this)
+should call Orb_thread_pool_blocking_begin() first, and
+Orb_thread_pool_blocking_end() after.  The pool starts a
+spare worker (or reuses one that retired recently) while the
+task is blocked, so that the pool does not deadlock or run
+below capacity.  Calls may nest,
+and do nothing outside pool workers.
+*/
+void Orb_thread_pool_blocking_begin(void);
+void Orb_thread_pool_blocking_end(void);
+/*waits until all queued tasks, and the tasks they queue,
+have finished, running tasks in the calling thread
+meanwhile.  Called from a pool task, it only runs tasks
+until none are queued.
+*/
+void Orb_thread_pool_drain(void);
+/*drains the pool and stops all its workers, returning once
+their threads have exited.  The pool is started again, with
+the same size, by the next queued task.  Must not be called
+from a pool task, or while other threads are queuing tasks.
+*/
+void Orb_thread_pool_shutdown(void);
+/*hooks for forking: call Orb_thread_pool_fork_prepare()
+just before fork(), which shuts down the pool so that no
+worker holds a lock across the fork, and then
+Orb_thread_pool_fork_parent() or _child() in the parent and
+child respectively, which restart the pool if it was
+running.  The timer thread is stopped and restarted the same
+way, and pending timers fire in both processes.  Suitable
+for pthread_atfork().
+*/
+void Orb_thread_pool_fork_prepare(void);
+void Orb_thread_pool_fork_parent(void);
+void Orb_thread_pool_fork_child(void);
+/*pool statistics.  Counts are totals since the pool was
+started; they are kept by each worker and summed when
+read, so they are approximate while the pool is busy.
+*/
+#define Orb_POOL_HISTOGRAM_BUCKETS 32
+struct Orb_pool_stats_s {
+	/*current state*/
+	size_t workers;		/*running workers*/
+	size_t idle;		/*workers waiting for tasks*/
+	size_t blocked;		/*workers blocked in tasks*/
+	size_t queued;		/*see Orb_thread_pool_queue_depth()*/
+	size_t submit_waiters;	/*threads waiting for queue space*/
+	/*tasks*/
+	size_t submitted;	/*queued from outside the pool*/
+	size_t spawned;		/*queued by pool tasks*/
+	size_t run;
+	size_t stolen;		/*taken from other workers*/
+	size_t rejected;	/*under Orb_POOL_REJECT*/
+	size_t ran_inline;	/*under Orb_POOL_RUN_INLINE*/
+	size_t submit_waits;	/*submissions that waited for space*/
+	/*contention*/
+	size_t cas_failures;	/*steals and pops lost to others*/
+	size_t parks;		/*times a worker went to sleep*/
+	size_t spin_hits;	/*tasks found by idle workers polling*/
+	/*only measured while Orb_thread_pool_measure_time(1)*/
+	uint64_t busy_ns;	/*running tasks*/
+	uint64_t idle_ns;	/*asleep*/
+	/*run_time[i] tasks took 2^i to 2^(i+1) nanoseconds*/
+	size_t run_time[Orb_POOL_HISTOGRAM_BUCKETS];
+};
+typedef struct Orb_pool_stats_s Orb_pool_stats;
+void Orb_thread_pool_stats(Orb_pool_stats*);
+/*fills in the task and time counts of up to max workers,
+returning the number filled in.  Workers started after
+others retired continue their counts.
+*/
+size_t Orb_thread_pool_worker_stats(Orb_pool_stats*, size_t max);
+/*timing costs two clock reads per task, so it is off by
+default
+*/
+void Orb_thread_pool_measure_time(int);
+/*returns the statistics as an Orb object, with a field for
+each of the above (times in microseconds, 'run-time as a
+sequence), plus 'per-worker, a sequence of objects with
+the per-worker fields.  The fields are plain values, so use
+Orb_deref() to read them.
+*/
+Orb_t Orb_thread_pool_snapshot(void);
+/*executors are separate pools, each with its own workers,
+queues and settings, so that e.g. blocking I/O tasks do not
+hold up compute tasks.  The Orb_thread_pool_* functions act
+on the default executor.  A new executor starts nworkers
+workers (0 for the default size) when its first task is
+queued; work stealing only happens within an executor.
+Executor objects have the methods 'add, 'defer, 'resize,
+'size, 'drain and 'shutdown, and a 'name field.
+*/
+Orb_t Orb_new_executor(char const* name, size_t nworkers);
+Orb_t Orb_default_executor(void);
+/*like the Orb_thread_pool_* functions, on the given executor*/
+int Orb_executor_add(Orb_t ex, Orb_t f);
+int Orb_executor_add_prio(Orb_t ex, Orb_t f, int);
+void Orb_executor_resize(Orb_t ex, size_t);
+size_t Orb_executor_size(Orb_t ex);
+void Orb_executor_drain(Orb_t ex);
+void Orb_executor_shutdown(Orb_t ex);
+void Orb_executor_stats(Orb_t ex, Orb_pool_stats*);
+/*like the Orb_thread_pool_* settings, on the given
+executor.  Settings that only have an effect before the
+first Orb_thread_pool_add() apply once the executor's pool is
+next started, e.g. before its first task or after a shutdown.
+*/
+void Orb_executor_stack_size(Orb_t ex, size_t);
+void Orb_executor_placement(Orb_t ex, int);
+void Orb_executor_queue_capacity(Orb_t ex, size_t);
+void Orb_executor_overflow(Orb_t ex, int);
+void Orb_executor_spin(Orb_t ex, size_t);
+/*
+ * Timers
+ */
+/*queues f on the thread pool once delay nanoseconds have
+passed, and then every period nanoseconds if period is not
+0.  Returns a timer object, which has a 'cancel method.
+Timers are serviced by a single thread, with a resolution of
+Orb_TIMER_TICK_NS.  If the pool's queues are full, that
+thread waits like any other submitter under Orb_POOL_BLOCK.
+*/
+#define Orb_TIMER_TICK_NS 1000000
+/*nanoseconds since some fixed point in the past.  Deadlines
+given to the *_wait_until functions are on this clock.
+*/
+uint64_t Orb_monotonic_ns(void);
+Orb_t Orb_timer_add(Orb_t f, uint64_t delay, uint64_t period);
+/*stops a timer.  Returns non-0 if a one-shot timer had not
+fired yet, or a periodic timer had not already been
+cancelled.
+*/
+int Orb_timer_cancel(Orb_t);
 /*
  * Defer / futures / singletons
  */
 /*defer the given function for execution, possibly
-on another thread.
+on another thread.  If no worker is likely to pick it up
+soon (see Orb_thread_pool_hungry()), a pool task only puts
+the function on its worker's own deque, without waking
+another worker: calling the defer then runs it right away,
+and it can still be stolen if the worker blocks.
 */
 Orb_t Orb_defer(Orb_t);
+/*like Orb_defer(), given an estimate of how long the
+function takes, in nanoseconds.  Functions estimated to take
+less than the minimum grain (Orb_DEFER_MIN_GRAIN unless set
+with Orb_defer_min_grain()) are run right away, since
+queuing them would cost more than they save.
+*/
+#define Orb_DEFER_MIN_GRAIN 10000
+Orb_t Orb_defer_hint(Orb_t, uint64_t cost);
+void Orb_defer_min_grain(uint64_t);
+/*like Orb_defer(), queuing the function with the given
+priority class (Orb_PRIO_*)
+*/
+Orb_t Orb_defer_prio(Orb_t, int);
+/*like Orb_defer(), queuing the function on the given
+executor
+*/
+Orb_t Orb_defer_on(Orb_t ex, Orb_t f);
+/*defers each of the n functions in fs, storing the defers
+in dfs, which may be the same array as fs.  Queues them on
+the pool in batches, or runs a batch right away when no
+worker is likely to take it (see Orb_thread_pool_hungry()).
+*/
+void Orb_defer_n(Orb_t* dfs, Orb_t const* fs, size_t n);
+/*like Orb_defer(), but only queues the function once delay
+nanoseconds have passed.  Calling the defer earlier still
+runs it right away in the caller.  Once the defer starts or
+is cancelled, its timer is cancelled too.
+*/
+Orb_t Orb_defer_after(Orb_t, uint64_t delay);
+/*Defers created while a defer runs are its children.
+Cancelling a defer keeps it from ever running if it has not
+started (calling it throws 'cancel instead), or makes
+Orb_cancelled() return non-0 within it if it is running, and
+cancels its children either way.  An error thrown by a
+defer's function also cancels its children.  Returns non-0
+if the defer had not started.
+*/
+int Orb_defer_cancel(Orb_t);
+/*waits until the defer has finished or errored, so that
+calling it will not block, or until Orb_monotonic_ns()
+reaches the deadline.  Returns 0 if the deadline passed
+first.  Unlike calling the defer, this never runs it on the
+calling thread, and never throws its error.
+*/
+int Orb_defer_wait_until(Orb_t df, uint64_t deadline);
+/*like Orb_defer_wait_until(), with a deadline ns
+nanoseconds from now.  Defer objects also have a 'wait-for
+method, which takes milliseconds and returns Orb_TRUE or
+Orb_NIL.
+*/
+int Orb_defer_wait_for(Orb_t df, uint64_t ns);
+/*non-0 if the defer running on the calling thread has been
+cancelled.  Long-running functions should check this now
+and then.
+*/
+int Orb_cancelled(void);
+/*throws 'cancel if Orb_cancelled()*/
+void Orb_check_cancelled(void);
+/*the defer@ form: calls f, making the defers created while
+it runs its children, so that if f throws, they are
+cancelled.
+*/
+Orb_t Orb_defer_at(Orb_t f);
+/*queues k (called with no arguments) on the pool once the
+defer has finished or errored, right away if it already
+has.  Defer objects also have an 'on-done method.
+*/
+void Orb_defer_on_done(Orb_t df, Orb_t k);
+/*returns a defer of f applied to the value of df, which is
+queued once df finishes.  If df throws, so does the new
+defer.  Defer objects also have a 'then method.
+*/
+Orb_t Orb_defer_then(Orb_t df, Orb_t f);
+/*returns a defer of the sequence of values of a sequence of
+defers, queued once they have all finished.  Calling it
+throws the error of the first defer (in sequence order)
+that threw.
+*/
+Orb_t Orb_defer_all(Orb_t dfs);
+/*returns a defer of the value (or error) of whichever of a
+non-empty sequence of defers finishes first
+*/
+Orb_t Orb_defer_any(Orb_t dfs);
 /*create an object which, when executed, will execute
 the given function exactly once and cache its result.
 */
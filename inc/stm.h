@@ -0,0 +1,55 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STM_H
+#define STM_H
+
+#include"liborb.h"
+#include"thread-support.h"
+
+/*software transactional memory over cells
+
+Orb_t move_item(Orb_stm_t tx, void* clos) {
+	Orb_cell_t* cells = clos;
+	Orb_t from = Orb_stm_read(tx, cells[0]);
+	Orb_t to = Orb_stm_read(tx, cells[1]);
+	Orb_stm_write(tx, cells[0], pop(from));
+	Orb_stm_write(tx, cells[1], push(to, first(from)));
+	return Orb_NIL;
+}
+...
+Orb_stm_atomically(&move_item, cells);
+
+The function may be run several times, so its only side
+effects should be through Orb_stm_write().  Cells that are
+accessed in transactions must only be modified in
+transactions; Orb_cell_set() and Orb_cell_cas() on them
+break the atomicity of transactions.
+*/
+struct Orb_stm_s;
+typedef struct Orb_stm_s* Orb_stm_t;
+
+typedef Orb_t Orb_stm_f(Orb_stm_t, void*);
+
+Orb_t Orb_stm_atomically(Orb_stm_f* f, void* clos);
+Orb_t Orb_stm_read(Orb_stm_t, Orb_cell_t);
+void Orb_stm_write(Orb_stm_t, Orb_cell_t, Orb_t);
+
+void Orb_stm_init(void);
+
+#endif /* STM_H */
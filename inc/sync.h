@@ -0,0 +1,70 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SYNC_H
+#define SYNC_H
+
+#include<stddef.h>
+
+/*countdown latches: waiters block until count_down has
+been called count times.  Waiters help run thread pool
+tasks, and sleep only when the pool has nothing for them
+to do.
+*/
+struct Orb_latch_s;
+typedef struct Orb_latch_s* Orb_latch_t;
+
+Orb_latch_t Orb_latch_init(size_t count);
+void Orb_latch_count_down(Orb_latch_t);
+void Orb_latch_wait(Orb_latch_t);
+size_t Orb_latch_count(Orb_latch_t);
+
+/*cyclic barriers: each of the parties blocks in
+Orb_barrier_wait until all have called it, after which
+the barrier can be reused.  Returns the number of the
+cycle that was completed.
+*/
+struct Orb_barrier_s;
+typedef struct Orb_barrier_s* Orb_barrier_t;
+
+Orb_barrier_t Orb_barrier_init(size_t parties);
+size_t Orb_barrier_wait(Orb_barrier_t);
+
+/*phasers: barriers whose parties can register and
+deregister, and which can be arrived at without waiting.
+Each function returns the phase that the call arrived at
+or registered in.
+*/
+struct Orb_phaser_s;
+typedef struct Orb_phaser_s* Orb_phaser_t;
+
+Orb_phaser_t Orb_phaser_init(size_t parties);
+size_t Orb_phaser_register(Orb_phaser_t);
+size_t Orb_phaser_arrive(Orb_phaser_t);
+size_t Orb_phaser_arrive_and_deregister(Orb_phaser_t);
+size_t Orb_phaser_arrive_and_wait(Orb_phaser_t);
+/*waits until the phaser is no longer in the given phase,
+and returns the new phase.
+*/
+size_t Orb_phaser_wait_advance(Orb_phaser_t, size_t phase);
+size_t Orb_phaser_phase(Orb_phaser_t);
+
+void Orb_sync_init(void);
+
+#endif /* SYNC_H */
+
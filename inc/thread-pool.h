@@ -21,5 +21,24 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 
 void Orb_thread_pool_init(void);
 
+/*runs at most one queued task in the calling thread,
+returning non-0 if a task was run.  Threads that would
+otherwise block waiting for pool tasks to finish can call
+this to help instead.
+*/
+int Orb_thread_pool_help(void);
+/*if the calling thread is a worker of the default pool,
+pushes f onto its own deque without waking any other worker,
+and returns non-0.  Thieves can still take it.
+*/
+int Orb_thread_pool_add_local(Orb_t f);
+/*sets functions to call around every task the pool runs,
+whichever thread runs it.  enter() returns the calling
+thread's context, which leave() restores once the task is
+done.  Defers use these so that tasks never run as part of
+the defer that the thread happens to be running.
+*/
+void Orb_thread_pool_task_hooks(void* (*enter)(void), void (*leave)(void*));
+
 #endif /* THREAD_POOL_H */
 
@@ -35,6 +35,19 @@ Orb_sema_t Orb_sema_init(unsigned int);
 unsigned int Orb_sema_get(Orb_sema_t);
 void Orb_sema_wait(Orb_sema_t);
 void Orb_sema_post(Orb_sema_t);
+/*like Orb_sema_wait(), but gives up once Orb_monotonic_ns()
+reaches the deadline.  Returns 0 if it gave up.
+*/
+int Orb_sema_wait_until(Orb_sema_t, uint64_t deadline);
+/*like Orb_sema_wait_until(), with a deadline ns nanoseconds
+from now
+*/
+int Orb_sema_wait_for(Orb_sema_t, uint64_t ns);
+/*sets functions to call before and after a thread actually
+goes to sleep in Orb_sema_wait().  The thread pool uses
+these to compensate for workers that block.
+*/
+void Orb_blocking_hooks(void (*begin)(void), void (*end)(void));
 
 #include"liborb.h"
 
@@ -53,15 +66,167 @@ cas succeeded.
 static inline int Orb_cell_cas(Orb_cell_t c, Orb_t o, Orb_t n) {
 	return o == Orb_cell_cas_get(c, o, n);
 }
+/*atomically add to a cell containing an Orb integer,
+returning the new value as a C int.
+*/
+int Orb_cell_add(Orb_cell_t, int delta);
+/*allocates n cells in a single block, each initialized to
+init.  Unlike cells from Orb_cell_init(), cells in an array
+are not cleared when finalized.
+*/
+Orb_cell_t Orb_cell_array_init(size_t n, Orb_t init);
+/*returns the i'th cell of an array of cells*/
+Orb_cell_t Orb_cell_array_ref(Orb_cell_t, size_t i);
+
+/*tickets are counters that are stored in cells as if they
+were Orb integers, but which are allowed to wrap around
+*/
+typedef size_t Orb_ticket_t;
+static inline Orb_t Orb_t_from_ticket(Orb_ticket_t t) {
+	return (Orb_t) (t << 2);
+}
+static inline Orb_ticket_t Orb_ticket_from_t(Orb_t x) {
+	return ((Orb_ticket_t) x) >> 2;
+}
+/*signed difference of two tickets, taking into account
+wraparound
+*/
+static inline intptr_t Orb_ticket_diff(Orb_ticket_t a, Orb_ticket_t b) {
+	return ((intptr_t) ((a - b) << 2)) >> 2;
+}
+/*atomically add to a cell containing a ticket, returning
+the new ticket.  Unlike Orb_cell_add(), this wraps around
+instead of overflowing, so use it for counters that grow
+forever.
+*/
+Orb_ticket_t Orb_cell_ticket_add(Orb_cell_t, Orb_ticket_t delta);
+
+/*wait queues: a waiter registers with Orb_waitq_prepare(),
+then rechecks its condition, and either sleeps with
+Orb_waitq_wait() or gives up with Orb_waitq_cancel().
+Notifiers make the condition true before calling
+Orb_waitq_notify(), which wakes up at most n waiters and
+returns how many it woke.
+*/
+struct Orb_waitq_s;
+typedef struct Orb_waitq_s* Orb_waitq_t;
+
+Orb_waitq_t Orb_waitq_init(void);
+void Orb_waitq_prepare(Orb_waitq_t);
+void Orb_waitq_wait(Orb_waitq_t);
+void Orb_waitq_cancel(Orb_waitq_t);
+/*like Orb_waitq_wait(), but gives up once Orb_monotonic_ns()
+reaches the deadline.  Returns 0 if it gave up, in which case
+the waiter is no longer registered, and non-0 if it was
+notified, even if that raced with the deadline.
+*/
+int Orb_waitq_wait_until(Orb_waitq_t, uint64_t deadline);
+size_t Orb_waitq_notify(Orb_waitq_t, size_t n);
+/*approximate number of registered waiters*/
+size_t Orb_waitq_waiters(Orb_waitq_t);
+static inline void Orb_waitq_notify_all(Orb_waitq_t q) {
+	Orb_waitq_notify(q, (size_t) -1);
+}
+
+/*bounded lock-free multi-producer multi-consumer rings.
+The capacity is rounded up to a power of 2, and is at
+least 2.  Push and pop do not allocate, and return 0 if the
+ring is full or empty respectively.
+*/
+struct Orb_ring_s;
+typedef struct Orb_ring_s* Orb_ring_t;
+
+Orb_ring_t Orb_ring_init(size_t capacity);
+int Orb_ring_push(Orb_ring_t, Orb_t);
+/*pushes up to n values, claiming their slots together.
+Returns the number pushed, which is less than n only if the
+ring filled up.
+*/
+size_t Orb_ring_push_n(Orb_ring_t, Orb_t const*, size_t n);
+int Orb_ring_pop(Orb_ring_t, Orb_t*);
+/*approximate number of values in the ring*/
+size_t Orb_ring_size(Orb_ring_t);
+size_t Orb_ring_capacity(Orb_ring_t);
+/*number of values ever pushed, modulo the ticket range*/
+size_t Orb_ring_pushed(Orb_ring_t);
+
+/*exponential backoff for contended CAS loops
+Orb_backoff b;
+Orb_backoff_init(&b);
+while(!Orb_cell_cas(c, o, n)) {
+	Orb_backoff_wait(&b);
+	o = Orb_cell_get(c); n = compute(o);
+}
+*/
+struct Orb_backoff_s {
+	size_t spins;
+};
+typedef struct Orb_backoff_s Orb_backoff;
+
+static inline void Orb_backoff_init(Orb_backoff* b) {
+	b->spins = 1;
+}
+void Orb_backoff_wait(Orb_backoff*);
+
+/*hint to the processor that we are in a spin loop*/
+static inline void Orb_cpu_relax(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	__asm__ __volatile__("pause" ::: "memory");
+#elif defined(__GNUC__)
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
 
 /*new threads*/
 struct Orb_thread_s;
 typedef struct Orb_thread_s* Orb_thread_t;
 Orb_thread_t Orb_priv_new_thread(Orb_t);
+/*stacksize is either 0 for the system default, Orb_THREADLET_STACK
+for a pooled threadlet stack, or a size in bytes.
+*/
+Orb_thread_t Orb_priv_new_thread_ex(Orb_t, size_t stacksize);
+/*like Orb_priv_new_thread_ex(), but the thread must be
+joined with Orb_priv_thread_join(), which returns once the
+thread has exited and recycles its stack.
+*/
+Orb_thread_t Orb_priv_new_joinable_thread(Orb_t, size_t stacksize);
+void Orb_priv_thread_join(Orb_thread_t);
+/*non-0 once the thread's function has returned*/
+int Orb_priv_thread_finished(Orb_thread_t);
+/*call in the child after fork(), to forget the threadlets
+of the parent
+*/
+void Orb_thread_support_fork_child(void);
+/*number of threadlet stacks currently mapped, whether in
+use, waiting to be joined, or free
+*/
+size_t Orb_priv_threadlet_stacks(void);
 
 /*general*/
 void Orb_thread_support_init(void);
+/*builds the base of thread objects; called once the object
+system is up
+*/
+void Orb_thread_objects_init(void);
 size_t Orb_num_processors(void);
+/*nanoseconds since some fixed point in the past*/
+uint64_t Orb_monotonic_ns(void);
+
+/*CPU placement and NUMA topology*/
+/*number of NUMA nodes that have CPUs; always at least 1*/
+size_t Orb_numa_num_nodes(void);
+/*node of the given CPU, numbered from 0*/
+size_t Orb_numa_node_of_cpu(size_t cpu);
+/*CPU the calling thread is currently running on*/
+size_t Orb_current_cpu(void);
+/*fills in the CPUs this process may run on, returning
+the number of CPUs filled in (at most max).
+*/
+size_t Orb_usable_cpus(size_t* cpus, size_t max);
+/*restricts the calling thread to the given CPU.
+Returns 0 on success.
+*/
+int Orb_pin_thread_to_cpu(size_t cpu);
 
 #endif /* THREAD_SUPPORT_H */
 
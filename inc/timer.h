@@ -0,0 +1,32 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TIMER_H
+#define TIMER_H
+
+void Orb_timer_init(void);
+/*stop the timer thread before fork(), and start it again
+afterwards in the parent and child if it was running.
+Called by the thread pool's fork hooks.
+*/
+void Orb_timer_fork_prepare(void);
+void Orb_timer_fork_parent(void);
+void Orb_timer_fork_child(void);
+
+#endif /* TIMER_H */
+
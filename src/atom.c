@@ -0,0 +1,166 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"atom.h"
+
+/*
+atoms have the following interface:
+(def atom-base
+  (obj!extend
+    'get (method:fn (self) current-value)
+    'reset (method:fn (self v) (set current-value v) v)
+    'swap
+    (method:fn (self f)
+      ; f must be pure: it may be called more than once
+      ; if other threads modify the atom concurrently
+      (set current-value (f current-value)))
+    'compare-and-set
+    (method:fn (self old new)
+      (if (is current-value old)
+          (do (set current-value new) t)
+          nil))
+    'retries (method:fn (self) number-of-failed-cas)))
+*/
+
+struct atom_s {
+	Orb_cell_t value;
+	/*number of failed CAS attempts, as an Orb integer*/
+	Orb_cell_t retries;
+};
+typedef struct atom_s atom;
+typedef atom* atom_t;
+
+static Orb_t hfield1;
+static Orb_t atom_base;
+
+static atom_t get_atom(Orb_t this) {
+	Orb_t oa = Orb_deref(this, hfield1);
+	return Orb_t_as_pointer(oa);
+}
+
+/*method function for get*/
+static Orb_t get_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to get"
+		);
+	}
+	atom_t a = get_atom(argv[1]);
+	return Orb_cell_get(a->value);
+}
+/*method function for reset*/
+static Orb_t reset_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to reset"
+		);
+	}
+	atom_t a = get_atom(argv[1]);
+	Orb_t nv = argv[2];
+	Orb_cell_set(a->value, nv);
+	return nv;
+}
+/*method function for swap*/
+static Orb_t swap_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to swap"
+		);
+	}
+	atom_t a = get_atom(argv[1]);
+	Orb_t f = argv[2];
+
+	Orb_backoff b;
+	Orb_backoff_init(&b);
+
+	Orb_t ov = Orb_cell_get(a->value);
+	for(;;) {
+		Orb_t nv = Orb_call1(f, ov);
+		Orb_t read = Orb_cell_cas_get(a->value, ov, nv);
+		if(read == ov) return nv;
+		/*contended: back off before recomputing*/
+		Orb_cell_add(a->retries, 1);
+		Orb_backoff_wait(&b);
+		ov = Orb_cell_get(a->value);
+	}
+}
+/*method function for compare-and-set*/
+static Orb_t cas_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to compare-and-set"
+		);
+	}
+	atom_t a = get_atom(argv[1]);
+	if(Orb_cell_cas(a->value, argv[2], argv[3])) {
+		return Orb_TRUE;
+	} else {
+		return Orb_NIL;
+	}
+}
+/*method function for retries*/
+static Orb_t retries_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to retries"
+		);
+	}
+	atom_t a = get_atom(argv[1]);
+	return Orb_cell_get(a->retries);
+}
+
+void Orb_atom_init(void) {
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&atom_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("get",
+			Orb_method(Orb_t_from_cfunc(&get_cfunc))
+		);
+		Orb_B_FIELD_cc("reset",
+			Orb_method(Orb_t_from_cfunc(&reset_cfunc))
+		);
+		Orb_B_FIELD_cc("swap",
+			Orb_method(Orb_t_from_cfunc(&swap_cfunc))
+		);
+		Orb_B_FIELD_cc("compare-and-set",
+			Orb_method(Orb_t_from_cfunc(&cas_cfunc))
+		);
+		Orb_B_FIELD_cc("retries",
+			Orb_method(Orb_t_from_cfunc(&retries_cfunc))
+		);
+	} atom_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_new_atom(Orb_t init) {
+	atom_t a = Orb_gc_malloc(sizeof(atom));
+	a->value = Orb_cell_init(init);
+	a->retries = Orb_cell_init(Orb_t_from_integer(0));
+
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(atom_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(a));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
@@ -0,0 +1,476 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"channel.h"
+
+/*
+channels have the following interface:
+(def channel-base
+  (obj!extend
+    ; blocks while a bounded channel is full
+    'send (method:fn (self v) ...)
+    ; returns t if sent, nil if the channel is full
+    'try-send (method:fn (self v) ...)
+    ; like send, but returns nil if the channel is still
+    ; full after ms milliseconds, and t if sent
+    'send-for (method:fn (self v ms) ...)
+    ; sends each element of the seq in order
+    'send-all (method:fn (self s) ...)
+    ; blocks while the channel is empty
+    'recv (method:fn (self) ...)
+    ; returns default (or nil) if the channel is empty
+    'try-recv (method:fn (self (o default)) ...)
+    ; like recv, but returns default (or nil) if the
+    ; channel is still empty after ms milliseconds
+    'recv-for (method:fn (self ms (o default)) ...)
+    ; blocks until at least one value is available, then
+    ; returns a seq of at most n values
+    'recv-many (method:fn (self n) ...)
+    ; wakes up all waiters.  Sends to a closed channel
+    ; throw, as do receives from a closed channel once
+    ; it is empty.
+    'close (method:fn (self) ...)))
+*/
+
+/*
+ * Unbounded channels
+ */
+/*Unbounded channels are linked lists of fixed-size segments.
+Senders and receivers claim slots in a segment by atomically
+incrementing its indices.  A receiver that reaches a slot
+before its sender marks it as taken, making the sender try
+again with another slot.
+*/
+#define SEG_SIZE 32
+
+static Orb_t empty_slot_v;
+static Orb_t taken_slot_v;
+#define EMPTY_SLOT Orb_t_from_pointer(&empty_slot_v)
+#define TAKEN_SLOT Orb_t_from_pointer(&taken_slot_v)
+
+struct seg_s {
+	Orb_cell_t enqidx;
+	Orb_cell_t deqidx;
+	Orb_cell_t next;
+	Orb_cell_t items;
+};
+typedef struct seg_s seg;
+
+static seg* seg_new(void) {
+	seg* s = Orb_gc_malloc(sizeof(seg));
+	s->enqidx = Orb_cell_init(Orb_t_from_integer(0));
+	s->deqidx = Orb_cell_init(Orb_t_from_integer(0));
+	s->next = Orb_cell_init(Orb_NIL);
+	s->items = Orb_cell_array_init(SEG_SIZE, EMPTY_SLOT);
+	return s;
+}
+
+struct list_s {
+	Orb_cell_t head;
+	Orb_cell_t tail;
+};
+typedef struct list_s list;
+
+static void list_init(list* l) {
+	Orb_t s = Orb_t_from_pointer(seg_new());
+	l->head = Orb_cell_init(s);
+	l->tail = Orb_cell_init(s);
+}
+static void list_push(list* l, Orb_t v) {
+	for(;;) {
+		Orb_t otail = Orb_cell_get(l->tail);
+		seg* tail = Orb_t_as_pointer(otail);
+		size_t idx = Orb_cell_add(tail->enqidx, 1) - 1;
+		if(idx < SEG_SIZE) {
+			Orb_cell_t item = Orb_cell_array_ref(tail->items, idx);
+			if(Orb_cell_cas(item, EMPTY_SLOT, v)) return;
+			continue;
+		}
+		/*segment is full*/
+		if(otail != Orb_cell_get(l->tail)) continue;
+		Orb_t onext = Orb_cell_get(tail->next);
+		if(onext == Orb_NIL) {
+			seg* n = seg_new();
+			Orb_cell_set(n->enqidx, Orb_t_from_integer(1));
+			Orb_cell_set(Orb_cell_array_ref(n->items, 0), v);
+			onext = Orb_t_from_pointer(n);
+			if(Orb_cell_cas(tail->next, Orb_NIL, onext)) {
+				Orb_cell_cas(l->tail, otail, onext);
+				return;
+			}
+		} else {
+			Orb_cell_cas(l->tail, otail, onext);
+		}
+	}
+}
+/*returns 0 if empty*/
+static int list_pop(list* l, Orb_t* pv) {
+	for(;;) {
+		Orb_t ohead = Orb_cell_get(l->head);
+		seg* head = Orb_t_as_pointer(ohead);
+		size_t deqidx = Orb_t_as_integer(Orb_cell_get(head->deqidx));
+		size_t enqidx = Orb_t_as_integer(Orb_cell_get(head->enqidx));
+		if(deqidx >= enqidx && Orb_cell_get(head->next) == Orb_NIL) {
+			return 0;
+		}
+		size_t idx = Orb_cell_add(head->deqidx, 1) - 1;
+		if(idx < SEG_SIZE) {
+			Orb_cell_t item = Orb_cell_array_ref(head->items, idx);
+			Orb_t v = Orb_cell_cas_get(item, EMPTY_SLOT, TAKEN_SLOT);
+			if(v == EMPTY_SLOT) continue;
+			/*let the GC have it*/
+			Orb_cell_set(item, TAKEN_SLOT);
+			*pv = v;
+			return 1;
+		}
+		/*segment is exhausted*/
+		Orb_t onext = Orb_cell_get(head->next);
+		if(onext == Orb_NIL) return 0;
+		Orb_cell_cas(l->head, ohead, onext);
+	}
+}
+
+/*
+ * Channels
+ */
+struct channel_s {
+	int bounded;
+	union {
+		Orb_ring_t r;
+		list l;
+	};
+	Orb_waitq_t recvq;
+	Orb_waitq_t sendq;
+	Orb_cell_t closed;
+};
+typedef struct channel_s channel;
+typedef channel* channel_t;
+
+static Orb_t hfield1;
+static Orb_t channel_base;
+
+static channel_t get_channel(Orb_t this) {
+	Orb_t oc = Orb_deref(this, hfield1);
+	return Orb_t_as_pointer(oc);
+}
+
+static int is_closed(channel_t c) {
+	return Orb_cell_get(c->closed) != Orb_NIL;
+}
+static void throw_closed(void) {
+	Orb_THROW_cc("channel", "Channel is closed");
+}
+
+/*returns 0 if full*/
+static int chan_push(channel_t c, Orb_t v) {
+	if(c->bounded) {
+		return Orb_ring_push(c->r, v);
+	} else {
+		list_push(&c->l, v);
+		return 1;
+	}
+}
+/*returns 0 if empty*/
+static int chan_pop(channel_t c, Orb_t* pv) {
+	if(c->bounded) {
+		return Orb_ring_pop(c->r, pv);
+	} else {
+		return list_pop(&c->l, pv);
+	}
+}
+
+static int chan_try_send(channel_t c, Orb_t v) {
+	if(is_closed(c)) throw_closed();
+	if(!chan_push(c, v)) return 0;
+	Orb_waitq_notify(c->recvq, 1);
+	return 1;
+}
+/*deadline of untimed waits*/
+#define NO_DEADLINE ((uint64_t) -1)
+
+/*returns 0 if the deadline passed, in which case we are no
+longer registered with the wait queue
+*/
+static int waitq_wait(Orb_waitq_t q, uint64_t deadline) {
+	if(deadline == NO_DEADLINE) {
+		Orb_waitq_wait(q);
+		return 1;
+	}
+	return Orb_waitq_wait_until(q, deadline);
+}
+
+/*returns 0 if the channel was still full at the deadline*/
+static int chan_send_until(channel_t c, Orb_t v, uint64_t deadline) {
+	for(;;) {
+		if(chan_try_send(c, v)) return 1;
+		Orb_waitq_prepare(c->sendq);
+		if(is_closed(c)) {
+			Orb_waitq_cancel(c->sendq);
+			throw_closed();
+		}
+		if(chan_push(c, v)) {
+			Orb_waitq_cancel(c->sendq);
+			Orb_waitq_notify(c->recvq, 1);
+			return 1;
+		}
+		if(!waitq_wait(c->sendq, deadline)) {
+			return chan_try_send(c, v);
+		}
+	}
+}
+static void chan_send(channel_t c, Orb_t v) {
+	chan_send_until(c, v, NO_DEADLINE);
+}
+static int chan_try_recv(channel_t c, Orb_t* pv) {
+	if(!chan_pop(c, pv)) return 0;
+	if(c->bounded) Orb_waitq_notify(c->sendq, 1);
+	return 1;
+}
+/*returns 0 if the channel was still empty at the deadline*/
+static int chan_recv_until(channel_t c, Orb_t* pv, uint64_t deadline) {
+	for(;;) {
+		if(chan_try_recv(c, pv)) return 1;
+		Orb_waitq_prepare(c->recvq);
+		if(chan_try_recv(c, pv)) {
+			Orb_waitq_cancel(c->recvq);
+			return 1;
+		}
+		if(is_closed(c)) {
+			Orb_waitq_cancel(c->recvq);
+			/*values sent before closing can still be
+			received
+			*/
+			if(chan_try_recv(c, pv)) return 1;
+			throw_closed();
+		}
+		if(!waitq_wait(c->recvq, deadline)) {
+			return chan_try_recv(c, pv);
+		}
+	}
+}
+static Orb_t chan_recv(channel_t c) {
+	Orb_t rv;
+	chan_recv_until(c, &rv, NO_DEADLINE);
+	return rv;
+}
+/*returns the deadline ms milliseconds from now, given as an
+Orb integer.  Orb integers are too small to hold more than
+about half a second in nanoseconds.
+*/
+static uint64_t deadline_after(Orb_t ms, char const* type_msg) {
+	if(!Orb_t_is_integer(ms) || Orb_t_as_integer(ms) < 0) {
+		Orb_THROW_cc("type", type_msg);
+	}
+	return Orb_monotonic_ns() + (uint64_t) Orb_t_as_integer(ms) * 1000000;
+}
+
+/*method function for send*/
+static Orb_t send_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to send"
+		);
+	}
+	chan_send(get_channel(argv[1]), argv[2]);
+	return argv[2];
+}
+/*method function for try-send*/
+static Orb_t try_send_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to try-send"
+		);
+	}
+	if(chan_try_send(get_channel(argv[1]), argv[2])) {
+		return Orb_TRUE;
+	} else {
+		return Orb_NIL;
+	}
+}
+/*method function for send-for*/
+static Orb_t send_for_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to send-for"
+		);
+	}
+	uint64_t deadline = deadline_after(argv[3],
+		"Expected a non-negative integer in send-for"
+	);
+	if(chan_send_until(get_channel(argv[1]), argv[2], deadline)) {
+		return Orb_TRUE;
+	} else {
+		return Orb_NIL;
+	}
+}
+/*method function for send-all*/
+static Orb_t send_all_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to send-all"
+		);
+	}
+	channel_t c = get_channel(argv[1]);
+	if(is_closed(c)) throw_closed();
+	/*wake up receivers once for the whole batch, unless
+	we have to wait for space
+	*/
+	size_t n = 0;
+	Orb_EACH(v, argv[2]) {
+		if(chan_push(c, v)) {
+			++n;
+		} else {
+			Orb_waitq_notify(c->recvq, n);
+			n = 0;
+			chan_send(c, v);
+		}
+	} Orb_ENDEACH;
+	Orb_waitq_notify(c->recvq, n);
+	return Orb_NIL;
+}
+/*method function for recv*/
+static Orb_t recv_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to recv"
+		);
+	}
+	return chan_recv(get_channel(argv[1]));
+}
+/*method function for try-recv*/
+static Orb_t try_recv_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2 && *pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to try-recv"
+		);
+	}
+	Orb_t rv;
+	if(chan_try_recv(get_channel(argv[1]), &rv)) return rv;
+	return (*pargc == 3) ? argv[2] : Orb_NIL;
+}
+/*method function for recv-for*/
+static Orb_t recv_for_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3 && *pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to recv-for"
+		);
+	}
+	uint64_t deadline = deadline_after(argv[2],
+		"Expected a non-negative integer in recv-for"
+	);
+	Orb_t rv;
+	if(chan_recv_until(get_channel(argv[1]), &rv, deadline)) return rv;
+	return (*pargc == 4) ? argv[3] : Orb_NIL;
+}
+/*method function for recv-many*/
+static Orb_t recv_many_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to recv-many"
+		);
+	}
+	channel_t c = get_channel(argv[1]);
+	if(!Orb_t_is_integer(argv[2]) || Orb_t_as_integer(argv[2]) < 1) {
+		Orb_THROW_cc("type",
+			"Expected a positive integer in recv-many"
+		);
+	}
+	size_t max = Orb_t_as_integer(argv[2]);
+	Orb_t* arr = Orb_gc_malloc(max * sizeof(Orb_t));
+	size_t n = 1;
+	arr[0] = chan_recv(c);
+	while(n < max && chan_pop(c, &arr[n])) ++n;
+	if(c->bounded) Orb_waitq_notify(c->sendq, n - 1);
+	Orb_t rv = Orb_seq(arr, n);
+	Orb_gc_free(arr);
+	return rv;
+}
+/*method function for close*/
+static Orb_t close_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to close"
+		);
+	}
+	channel_t c = get_channel(argv[1]);
+	Orb_cell_set(c->closed, Orb_TRUE);
+	Orb_waitq_notify_all(c->recvq);
+	Orb_waitq_notify_all(c->sendq);
+	return Orb_NIL;
+}
+
+void Orb_channel_init(void) {
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&channel_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("send",
+			Orb_method(Orb_t_from_cfunc(&send_cfunc))
+		);
+		Orb_B_FIELD_cc("try-send",
+			Orb_method(Orb_t_from_cfunc(&try_send_cfunc))
+		);
+		Orb_B_FIELD_cc("send-for",
+			Orb_method(Orb_t_from_cfunc(&send_for_cfunc))
+		);
+		Orb_B_FIELD_cc("send-all",
+			Orb_method(Orb_t_from_cfunc(&send_all_cfunc))
+		);
+		Orb_B_FIELD_cc("recv",
+			Orb_method(Orb_t_from_cfunc(&recv_cfunc))
+		);
+		Orb_B_FIELD_cc("try-recv",
+			Orb_method(Orb_t_from_cfunc(&try_recv_cfunc))
+		);
+		Orb_B_FIELD_cc("recv-for",
+			Orb_method(Orb_t_from_cfunc(&recv_for_cfunc))
+		);
+		Orb_B_FIELD_cc("recv-many",
+			Orb_method(Orb_t_from_cfunc(&recv_many_cfunc))
+		);
+		Orb_B_FIELD_cc("close",
+			Orb_method(Orb_t_from_cfunc(&close_cfunc))
+		);
+	} channel_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_new_channel(size_t capacity) {
+	channel_t c = Orb_gc_malloc(sizeof(channel));
+	if(capacity == 0) {
+		c->bounded = 0;
+		list_init(&c->l);
+	} else {
+		c->bounded = 1;
+		c->r = Orb_ring_init(capacity);
+	}
+	c->recvq = Orb_waitq_init();
+	c->sendq = Orb_waitq_init();
+	c->closed = Orb_cell_init(Orb_NIL);
+
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(channel_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(c));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
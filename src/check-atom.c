@@ -0,0 +1,108 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+Orb_t increment_cf1(Orb_t x) {
+	return Orb_t_from_integer(Orb_t_as_integer(x) + 1);
+}
+
+Orb_t a;
+Orb_t swap;
+Orb_t increment;
+
+/*changes the atom behind swap's back the first time it
+runs, so that swap has to retry once
+*/
+int interfered;
+Orb_t interfering_cf1(Orb_t x) {
+	if(!interfered) {
+		interfered = 1;
+		Orb_call1(Orb_ref_cc(a, "reset"), Orb_t_from_integer(10));
+	}
+	return Orb_t_from_integer(Orb_t_as_integer(x) + 1);
+}
+
+Orb_t task_cf0(void) {
+	Orb_call1(swap, increment);
+	return Orb_NIL;
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	a = Orb_new_atom(Orb_t_from_integer(0));
+	Orb_t get = Orb_ref_cc(a, "get");
+	Orb_t reset = Orb_ref_cc(a, "reset");
+	Orb_t cas = Orb_ref_cc(a, "compare-and-set");
+	swap = Orb_ref_cc(a, "swap");
+	increment = Orb_CELfree(Orb_t_from_cf1(&increment_cf1));
+
+	/*single-threaded behavior*/
+	assert(Orb_call0(get) == Orb_t_from_integer(0));
+	assert(Orb_call1(swap, increment) == Orb_t_from_integer(1));
+	assert(Orb_call0(get) == Orb_t_from_integer(1));
+	assert(!Orb_bool(Orb_call2(cas,
+		Orb_t_from_integer(0), Orb_t_from_integer(42)
+	)));
+	assert(Orb_call0(get) == Orb_t_from_integer(1));
+	assert(Orb_bool(Orb_call2(cas,
+		Orb_t_from_integer(1), Orb_t_from_integer(42)
+	)));
+	assert(Orb_call0(get) == Orb_t_from_integer(42));
+	assert(Orb_call1(reset, Orb_t_from_integer(0)) == Orb_t_from_integer(0));
+	assert(Orb_call0(get) == Orb_t_from_integer(0));
+
+	/*a failed compare-and-set is counted as a retry*/
+	Orb_t retries_before = Orb_call0(Orb_ref_cc(a, "retries"));
+	interfered = 0;
+	assert(Orb_call1(swap, Orb_t_from_cf1(&interfering_cf1))
+		== Orb_t_from_integer(11)
+	);
+	assert(Orb_t_as_integer(Orb_call0(Orb_ref_cc(a, "retries"))) >=
+		Orb_t_as_integer(retries_before) + 1
+	);
+	Orb_call1(reset, Orb_t_from_integer(0));
+
+	/*contended behavior*/
+	Orb_t task = Orb_CELfree(Orb_t_from_cf0(&task_cf0));
+	size_t i;
+	for(i = 0; i < 100; ++i) {
+		Orb_thread_pool_add(task);
+	}
+
+	size_t tries = 0;
+	while(Orb_call0(get) != Orb_t_from_integer(100)) {
+		Orb_yield();
+		++tries;
+		if(tries > 10000000) {
+			fprintf(stderr, "Timed out!\n");
+			exit(2);
+		}
+	}
+
+	Orb_t retries = Orb_call0(Orb_ref_cc(a, "retries"));
+	assert(Orb_t_is_integer(retries));
+
+	exit(0);
+}
@@ -0,0 +1,120 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#define PRODUCERS 10
+#define ITEMS 100
+
+Orb_t ch;
+
+Orb_t producer_cf0(void) {
+	Orb_t send = Orb_ref_cc(ch, "send");
+	size_t i;
+	for(i = 1; i <= ITEMS; ++i) {
+		Orb_call1(send, Orb_t_from_integer(i));
+	}
+	return Orb_NIL;
+}
+
+void check_channel(size_t capacity) {
+	ch = Orb_new_channel(capacity);
+	Orb_t try_send = Orb_ref_cc(ch, "try-send");
+	Orb_t try_recv = Orb_ref_cc(ch, "try-recv");
+	Orb_t recv = Orb_ref_cc(ch, "recv");
+	Orb_t recv_many = Orb_ref_cc(ch, "recv-many");
+
+	/*single-threaded behavior*/
+	assert(Orb_call0(try_recv) == Orb_NIL);
+	assert(Orb_call1(try_recv, Orb_t_from_integer(42))
+		== Orb_t_from_integer(42)
+	);
+	size_t i;
+	for(i = 0; i < 100; ++i) {
+		if(!Orb_bool(Orb_call1(try_send, Orb_t_from_integer(i)))) break;
+	}
+	if(capacity) {
+		assert(i == capacity);
+		assert(Orb_call2(Orb_ref_cc(ch, "send-for"),
+			Orb_t_from_integer(i), Orb_t_from_integer(1)
+		) == Orb_NIL);
+	} else {
+		assert(i == 100);
+	}
+	size_t j;
+	for(j = 0; j < i; ++j) {
+		assert(Orb_call0(recv) == Orb_t_from_integer(j));
+	}
+	assert(Orb_call0(try_recv) == Orb_NIL);
+	Orb_t recv_for = Orb_ref_cc(ch, "recv-for");
+	assert(Orb_call2(recv_for,
+		Orb_t_from_integer(1), Orb_t_from_integer(42)
+	) == Orb_t_from_integer(42));
+	Orb_call1(try_send, Orb_t_from_integer(7));
+	assert(Orb_call1(recv_for, Orb_t_from_integer(1))
+		== Orb_t_from_integer(7)
+	);
+
+	Orb_t arr[2] = {
+		Orb_t_from_integer(1),
+		Orb_t_from_integer(2)
+	};
+	Orb_call1(Orb_ref_cc(ch, "send-all"), Orb_seq(arr, 2));
+	Orb_t s = Orb_call1(recv_many, Orb_t_from_integer(10));
+	assert(Orb_len(s) == 2);
+	assert(Orb_nth(s, 1) == Orb_t_from_integer(2));
+
+	/*contended behavior*/
+	Orb_t producer = Orb_CELfree(Orb_t_from_cf0(&producer_cf0));
+	for(i = 0; i < PRODUCERS; ++i) {
+		Orb_thread_pool_add(producer);
+	}
+	size_t sum = 0;
+	for(i = 0; i < PRODUCERS * ITEMS; ++i) {
+		sum += Orb_t_as_integer(Orb_call0(recv));
+	}
+	assert(sum == PRODUCERS * (ITEMS * (ITEMS + 1) / 2));
+
+	/*closing*/
+	Orb_call1(Orb_ref_cc(ch, "send"), Orb_t_from_integer(1));
+	Orb_call0(Orb_ref_cc(ch, "close"));
+	assert(Orb_call0(recv) == Orb_t_from_integer(1));
+	volatile int thrown = 0;
+	Orb_TRY {
+		Orb_call0(recv);
+	} Orb_CATCH(E) {
+		assert(Orb_E_TYPE(E) == Orb_symbol_cc("channel"));
+		thrown = 1;
+	} Orb_ENDTRY;
+	assert(thrown);
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	check_channel(0);
+	check_channel(4);
+	check_channel(2);
+
+	exit(0);
+}
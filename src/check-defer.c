@@ -45,6 +45,301 @@ Orb_t get_secret_cf0(void) {
 	return secret;
 }
 
+Orb_cell_t gate;
+Orb_cell_t entered;
+Orb_cell_t waited;
+Orb_t slow_df;
+
+/*keeps the defer running until the gate is opened*/
+Orb_t slow_secret_cf0(void) {
+	Orb_cell_set(entered, Orb_TRUE);
+	while(Orb_cell_get(gate) == Orb_NIL) Orb_yield();
+	return secret;
+}
+Orb_t waiter_cf0(void) {
+	assert(Orb_call0(slow_df) == secret);
+	Orb_cell_add(waited, 1);
+	return Orb_NIL;
+}
+
+#define WAITERS 4
+
+/*several threads wait for a defer that is running*/
+void check_waiters(void) {
+	gate = Orb_cell_init(Orb_NIL);
+	entered = Orb_cell_init(Orb_NIL);
+	waited = Orb_cell_init(Orb_t_from_integer(0));
+	slow_df = Orb_defer(Orb_t_from_cf0(&slow_secret_cf0));
+	while(Orb_cell_get(entered) == Orb_NIL) Orb_yield();
+	/*too late to cancel*/
+	assert(!Orb_defer_cancel(slow_df));
+
+	size_t i;
+	for(i = 0; i < WAITERS; ++i) {
+		Orb_priv_new_thread(Orb_t_from_cf0(&waiter_cf0));
+	}
+	for(i = 0; i < 1000; ++i) Orb_yield();
+	Orb_cell_set(gate, Orb_TRUE);
+	assert(Orb_call0(slow_df) == secret);
+
+	size_t retries = 0;
+	while(Orb_cell_get(waited) != Orb_t_from_integer(WAITERS)) {
+		assert(++retries < 10000000);
+		Orb_yield();
+	}
+}
+
+/*calls f, returning the type of the error it throws, or
+Orb_NIL if it returns
+*/
+Orb_t error_of(Orb_t f) {
+	Orb_t volatile rv = Orb_NIL;
+	Orb_TRY {
+		Orb_call0(f);
+	} Orb_CATCH(E) {
+		rv = Orb_E_TYPE(E);
+	} Orb_ENDTRY;
+	return rv;
+}
+
+/*runs until cancelled*/
+Orb_t until_cancelled_cf0(void) {
+	while(!Orb_cancelled()) Orb_yield();
+	Orb_check_cancelled();
+	return Orb_NIL;
+}
+
+Orb_t child_df;
+
+Orb_t parent_cf0(void) {
+	child_df = Orb_defer(Orb_t_from_cf0(&until_cancelled_cf0));
+	Orb_cell_set(entered, Orb_TRUE);
+	return until_cancelled_cf0();
+}
+
+Orb_t failing_scope_cf0(void) {
+	child_df = Orb_defer(Orb_t_from_cf0(&until_cancelled_cf0));
+	Orb_THROW_cc("oops", "failed in scope");
+	return Orb_NIL;
+}
+
+/*cancelling a running defer cancels the defers it created,
+and so does an error in a defer@ scope
+*/
+void check_cancel_tree(void) {
+	Orb_t cancel = Orb_symbol_cc("cancel");
+	entered = Orb_cell_init(Orb_NIL);
+	Orb_t df = Orb_defer(Orb_t_from_cf0(&parent_cf0));
+	while(Orb_cell_get(entered) == Orb_NIL) Orb_yield();
+	assert(!Orb_cancelled());
+	assert(!Orb_defer_cancel(df));
+	assert(error_of(df) == cancel);
+	assert(error_of(child_df) == cancel);
+
+	child_df = Orb_NIL;
+	Orb_t scope = Orb_t_from_cf0(&failing_scope_cf0);
+	Orb_t volatile thrown = Orb_NIL;
+	Orb_TRY {
+		Orb_defer_at(scope);
+	} Orb_CATCH(E) {
+		thrown = Orb_E_TYPE(E);
+	} Orb_ENDTRY;
+	assert(thrown == Orb_symbol_cc("oops"));
+	assert(error_of(child_df) == cancel);
+}
+
+Orb_t tiny;
+
+Orb_t adopt_cf0(void) {
+	child_df = Orb_defer(
+		Orb_CELfree(Orb_t_from_cf0(&until_cancelled_cf0))
+	);
+	return Orb_NIL;
+}
+Orb_t overflowing_scope_cf0(void) {
+	Orb_executor_add(tiny, Orb_t_from_cf0(&adopt_cf0));
+	Orb_THROW_cc("oops", "failed in scope");
+	return Orb_NIL;
+}
+
+/*a task that overflows into the submitting thread is not
+part of the defer running there
+*/
+void check_inline_tasks(void) {
+	tiny = Orb_new_executor("tiny", 1);
+	Orb_executor_queue_capacity(tiny, 2);
+	Orb_executor_overflow(tiny, Orb_POOL_RUN_INLINE);
+	gate = Orb_cell_init(Orb_NIL);
+	entered = Orb_cell_init(Orb_NIL);
+	Orb_executor_add(tiny, Orb_CELfree(Orb_t_from_cf0(&slow_secret_cf0)));
+	while(Orb_cell_get(entered) == Orb_NIL) Orb_yield();
+	Orb_executor_add(tiny, Orb_t_from_cf0(&get_secret_cf0));
+	Orb_executor_add(tiny, Orb_t_from_cf0(&get_secret_cf0));
+
+	child_df = Orb_NIL;
+	Orb_t volatile thrown = Orb_NIL;
+	Orb_TRY {
+		Orb_defer_at(Orb_t_from_cf0(&overflowing_scope_cf0));
+	} Orb_CATCH(E) {
+		thrown = Orb_E_TYPE(E);
+	} Orb_ENDTRY;
+	assert(thrown == Orb_symbol_cc("oops"));
+	assert(child_df != Orb_NIL);
+	assert(!Orb_defer_wait_for(child_df, 20000000));
+	assert(!Orb_defer_cancel(child_df));
+	assert(error_of(child_df) == Orb_symbol_cc("cancel"));
+
+	Orb_cell_set(gate, Orb_TRUE);
+	Orb_executor_shutdown(tiny);
+}
+
+Orb_t is_secret_cf1(Orb_t x) {
+	return x == secret ? Orb_TRUE : Orb_NIL;
+}
+Orb_t failing_cf0(void) {
+	Orb_THROW_cc("oops", "failed");
+	return Orb_NIL;
+}
+
+/*continuations and combinators*/
+void check_continuations(void) {
+	Orb_t get_secret = Orb_t_from_cf0(&get_secret_cf0);
+	Orb_t df = Orb_defer(get_secret);
+	Orb_t then = Orb_defer_then(df, Orb_t_from_cf1(&is_secret_cf1));
+	assert(Orb_call0(then) == Orb_TRUE);
+	then = Orb_call1(Orb_ref_cc(df, "then"), Orb_t_from_cf1(&is_secret_cf1));
+	assert(Orb_call0(then) == Orb_TRUE);
+	then = Orb_defer_then(Orb_defer(Orb_t_from_cf0(&failing_cf0)),
+		Orb_t_from_cf1(&is_secret_cf1)
+	);
+	assert(error_of(then) == Orb_symbol_cc("oops"));
+
+	/*one on a running defer, one on a finished one*/
+	Orb_cell_set(common, Orb_t_from_integer(0));
+	Orb_t incr = Orb_t_from_cf0(&increment_common_cf0);
+	Orb_defer_on_done(Orb_defer(get_secret), incr);
+	Orb_defer_on_done(df, incr);
+	size_t retries = 0;
+	while(Orb_cell_get(common) != Orb_t_from_integer(2)) {
+		assert(++retries < 10000000);
+		Orb_yield();
+	}
+
+	Orb_t dfs[10];
+	size_t i;
+	for(i = 0; i < 10; ++i) dfs[i] = get_secret;
+	Orb_defer_n(dfs, dfs, 10);
+	Orb_t all = Orb_call0(Orb_defer_all(Orb_seq(dfs, 10)));
+	assert(Orb_len(all) == 10);
+	for(i = 0; i < 10; ++i) {
+		assert(Orb_nth_o(all, Orb_t_from_integer(i)) == secret);
+	}
+	Orb_t none = Orb_call0(Orb_defer_all(Orb_seq(dfs, 0)));
+	assert(none == Orb_seq(dfs, 0));
+
+	/*the slow defer does not hold up the fast one.  It must
+	not hold the CEL while it waits, or the fast one could not
+	run.
+	*/
+	gate = Orb_cell_init(Orb_NIL);
+	entered = Orb_cell_init(Orb_NIL);
+	dfs[0] = Orb_defer(Orb_CELfree(Orb_t_from_cf0(&slow_secret_cf0)));
+	while(Orb_cell_get(entered) == Orb_NIL) Orb_yield();
+	dfs[1] = Orb_defer(Orb_t_from_cf0(&failing_cf0));
+	Orb_t any = Orb_defer_any(Orb_seq(dfs, 2));
+	assert(error_of(any) == Orb_symbol_cc("oops"));
+	Orb_cell_set(gate, Orb_TRUE);
+	assert(Orb_call0(dfs[0]) == secret);
+	assert(error_of(any) == Orb_symbol_cc("oops"));
+}
+
+/*timed waits give up on a defer that is still running, and
+succeed once it finishes
+*/
+void check_timed_waits(void) {
+	gate = Orb_cell_init(Orb_NIL);
+	entered = Orb_cell_init(Orb_NIL);
+	Orb_t df = Orb_defer(Orb_CELfree(Orb_t_from_cf0(&slow_secret_cf0)));
+	while(Orb_cell_get(entered) == Orb_NIL) Orb_yield();
+	assert(!Orb_defer_wait_for(df, 1000000));
+	Orb_t wait_for = Orb_ref_cc(df, "wait-for");
+	uint64_t start = Orb_monotonic_ns();
+	assert(Orb_call1(wait_for, Orb_t_from_integer(20)) == Orb_NIL);
+	/*the timeout is in milliseconds*/
+	assert(Orb_monotonic_ns() - start >= 20000000);
+	Orb_cell_set(gate, Orb_TRUE);
+	assert(Orb_defer_wait_until(df, Orb_monotonic_ns() + 10000000000u));
+	assert(Orb_call1(wait_for, Orb_t_from_integer(0)) == Orb_TRUE);
+	assert(Orb_call0(df) == secret);
+
+	/*an errored defer is done too, and waiting does not throw*/
+	df = Orb_defer(Orb_t_from_cf0(&failing_cf0));
+	assert(Orb_defer_wait_for(df, 10000000000u));
+	assert(error_of(df) == Orb_symbol_cc("oops"));
+}
+
+Orb_t nothing_cf0(void) {
+	return Orb_NIL;
+}
+Orb_cell_t lazy_done;
+/*runs on the only worker, with tasks already in its deque*/
+Orb_t busy_worker_cf0(void) {
+	Orb_t nothing = Orb_t_from_cf0(&nothing_cf0);
+	Orb_thread_pool_add(nothing);
+	Orb_thread_pool_add(nothing);
+	assert(!Orb_thread_pool_hungry());
+	/*so the defer stays on our deque until it is called*/
+	Orb_cell_set(common, Orb_t_from_integer(0));
+	Orb_t df = Orb_defer(Orb_t_from_cf0(&increment_common_cf0));
+	assert(Orb_cell_get(common) == Orb_t_from_integer(0));
+	Orb_call0(df);
+	assert(Orb_cell_get(common) == Orb_t_from_integer(1));
+	/*but small functions are run right away*/
+	Orb_defer_hint(Orb_t_from_cf0(&increment_common_cf0), 0);
+	assert(Orb_cell_get(common) == Orb_t_from_integer(2));
+	Orb_cell_set(lazy_done, Orb_TRUE);
+	return Orb_NIL;
+}
+
+/*defers run inline when they are small, and stay local when
+nobody would take them
+*/
+void check_granularity(void) {
+	Orb_cell_set(common, Orb_t_from_integer(0));
+	Orb_defer_hint(Orb_t_from_cf0(&increment_common_cf0), 0);
+	assert(Orb_cell_get(common) == Orb_t_from_integer(1));
+
+	/*a polling worker, or one that has yet to retire, would
+	make the pool look hungry.  Settings like spinning only
+	apply once the pool is restarted.
+	*/
+	Orb_thread_pool_spin(0);
+	Orb_thread_pool_resize(1);
+	Orb_thread_pool_shutdown();
+	Orb_thread_pool_add(Orb_t_from_cf0(&nothing_cf0));
+	Orb_thread_pool_drain();
+	Orb_pool_stats st;
+	size_t retries = 0;
+	for(;;) {
+		Orb_thread_pool_stats(&st);
+		if(st.workers == 1) break;
+		assert(++retries < 10000000);
+		Orb_yield();
+	}
+
+	lazy_done = Orb_cell_init(Orb_NIL);
+	/*poll instead of calling it, so that we do not help
+	the worker by taking its tasks
+	*/
+	Orb_thread_pool_add(Orb_t_from_cf0(&busy_worker_cf0));
+	retries = 0;
+	while(Orb_cell_get(lazy_done) == Orb_NIL) {
+		assert(++retries < 10000000);
+		Orb_yield();
+	}
+	Orb_thread_pool_resize(0);
+}
+
 int main(void) {
 	size_t retries;
 
@@ -72,6 +367,22 @@ int main(void) {
 	assert(Orb_call0(df0) == Orb_call0(f0));
 	assert(Orb_call0(df0) == secret);
 
+	Orb_t dfs[40];
+	size_t i;
+	for(i = 0; i < 40; ++i) dfs[i] = f0;
+	Orb_defer_n(dfs, dfs, 40);
+	for(i = 0; i < 40; ++i) {
+		assert(dfs[i] != f0);
+		assert(Orb_call0(dfs[i]) == secret);
+	}
+
+	check_waiters();
+	check_cancel_tree();
+	check_inline_tasks();
+	check_continuations();
+	check_timed_waits();
+	check_granularity();
+
 	exit(0);
 }
 
@@ -0,0 +1,116 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#define TASKS 8
+#define KEYS 500
+
+Orb_t m;
+Orb_t latch;
+Orb_t next_task;
+
+Orb_t increment_cf1(Orb_t x) {
+	if(x == Orb_NIL) return Orb_t_from_integer(1);
+	return Orb_t_from_integer(Orb_t_as_integer(x) + 1);
+}
+/*poor hash, to force collisions*/
+Orb_t hash_cf1(Orb_t x) {
+	return Orb_t_from_integer(Orb_t_as_integer(x) % 7);
+}
+Orb_t eq_cf2(Orb_t a, Orb_t b) {
+	return (a == b) ? Orb_TRUE : Orb_NIL;
+}
+
+/*each task puts its own keys, and increments shared keys*/
+Orb_t task_cf0(void) {
+	int me = Orb_t_as_integer(Orb_call1(Orb_ref_cc(next_task, "swap"),
+		Orb_CELfree(Orb_t_from_cf1(&increment_cf1))
+	)) - 1;
+	Orb_t put = Orb_ref_cc(m, "put");
+	Orb_t update = Orb_ref_cc(m, "update");
+	Orb_t increment = Orb_CELfree(Orb_t_from_cf1(&increment_cf1));
+	int i;
+	for(i = 0; i < KEYS; ++i) {
+		Orb_call2(put,
+			Orb_t_from_integer(1000 + me * KEYS + i),
+			Orb_t_from_integer(me)
+		);
+		Orb_call2(update, Orb_t_from_integer(i % 10), increment);
+	}
+	Orb_call0(Orb_ref_cc(latch, "count-down"));
+	return Orb_NIL;
+}
+
+void check_map(Orb_t hash, Orb_t eq) {
+	m = Orb_new_hash_map(hash, eq);
+	Orb_t get = Orb_ref_cc(m, "get");
+	Orb_t len = Orb_ref_cc(m, "len");
+
+	/*single-threaded behavior*/
+	assert(Orb_call1(get, Orb_t_from_integer(1)) == Orb_NIL);
+	assert(Orb_call2(get, Orb_t_from_integer(1), Orb_TRUE) == Orb_TRUE);
+	Orb_call2(Orb_ref_cc(m, "put"), Orb_t_from_integer(1), Orb_t_from_integer(2));
+	assert(Orb_call1(get, Orb_t_from_integer(1)) == Orb_t_from_integer(2));
+	assert(Orb_call0(len) == Orb_t_from_integer(1));
+	assert(Orb_bool(Orb_call1(Orb_ref_cc(m, "remove"), Orb_t_from_integer(1))));
+	assert(!Orb_bool(Orb_call1(Orb_ref_cc(m, "remove"), Orb_t_from_integer(1))));
+	assert(Orb_call1(get, Orb_t_from_integer(1)) == Orb_NIL);
+	assert(Orb_call0(len) == Orb_t_from_integer(0));
+
+	/*contended behavior, including resizes*/
+	next_task = Orb_new_atom(Orb_t_from_integer(0));
+	latch = Orb_new_latch(TASKS);
+	Orb_t task = Orb_CELfree(Orb_t_from_cf0(&task_cf0));
+	int i;
+	for(i = 0; i < TASKS; ++i) {
+		Orb_thread_pool_add(task);
+	}
+	Orb_call0(Orb_ref_cc(latch, "wait"));
+
+	assert(Orb_call0(len) == Orb_t_from_integer(10 + TASKS * KEYS));
+	for(i = 0; i < TASKS * KEYS; ++i) {
+		assert(Orb_call1(get, Orb_t_from_integer(1000 + i))
+			== Orb_t_from_integer(i / KEYS)
+		);
+	}
+	for(i = 0; i < 10; ++i) {
+		assert(Orb_call1(get, Orb_t_from_integer(i))
+			== Orb_t_from_integer(TASKS * KEYS / 10)
+		);
+	}
+	Orb_t snap = Orb_call0(Orb_ref_cc(m, "snapshot"));
+	assert(Orb_len(snap) == 10 + TASKS * KEYS);
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	check_map(Orb_NIL, Orb_NIL);
+	check_map(
+		Orb_CELfree(Orb_t_from_cf1(&hash_cf1)),
+		Orb_CELfree(Orb_t_from_cf2(&eq_cf2))
+	);
+
+	exit(0);
+}
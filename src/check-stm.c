@@ -0,0 +1,129 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+Orb_t x;
+Orb_t y;
+Orb_t xfer;
+Orb_t saved_tx;
+int inconsistent = 0;
+
+/*moves one unit from x to y*/
+Orb_t xfer_cf1(Orb_t tx) {
+	Orb_t read = Orb_ref_cc(tx, "read");
+	Orb_t write = Orb_ref_cc(tx, "write");
+	Orb_t xv = Orb_call1(read, x);
+	Orb_t yv = Orb_call1(read, y);
+	if(Orb_t_as_integer(xv) + Orb_t_as_integer(yv) != 100) {
+		inconsistent = 1;
+	}
+	Orb_call2(write, x, Orb_t_from_integer(Orb_t_as_integer(xv) - 1));
+	Orb_call2(write, y, Orb_t_from_integer(Orb_t_as_integer(yv) + 1));
+	/*reads see our own writes*/
+	assert(Orb_call1(read, y) == Orb_t_from_integer(Orb_t_as_integer(yv) + 1));
+	saved_tx = tx;
+	return xv;
+}
+
+#define MANY 1000
+Orb_t many[MANY];
+
+/*writes, then reads back, many tvars*/
+Orb_t many_cf1(Orb_t tx) {
+	Orb_t read = Orb_ref_cc(tx, "read");
+	Orb_t write = Orb_ref_cc(tx, "write");
+	size_t i;
+	for(i = 0; i < MANY; ++i) {
+		Orb_t v = Orb_call1(read, many[i]);
+		Orb_call2(write, many[i],
+			Orb_t_from_integer(Orb_t_as_integer(v) + i)
+		);
+	}
+	for(i = 0; i < MANY; ++i) {
+		assert(Orb_call1(read, many[i]) == Orb_t_from_integer(1 + i));
+	}
+	return Orb_NIL;
+}
+
+Orb_t task_cf0(void) {
+	Orb_atomically(xfer);
+	return Orb_NIL;
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	x = Orb_new_tvar(Orb_t_from_integer(100));
+	y = Orb_new_tvar(Orb_t_from_integer(0));
+	Orb_t getx = Orb_ref_cc(x, "get");
+	Orb_t gety = Orb_ref_cc(y, "get");
+	xfer = Orb_CELfree(Orb_t_from_cf1(&xfer_cf1));
+	size_t i;
+
+	/*single-threaded behavior*/
+	assert(Orb_atomically(xfer) == Orb_t_from_integer(100));
+	assert(Orb_call0(getx) == Orb_t_from_integer(99));
+	assert(Orb_call0(gety) == Orb_t_from_integer(1));
+
+	/*transactions cannot be used after they end*/
+	volatile int thrown = 0;
+	Orb_TRY {
+		Orb_call1(Orb_ref_cc(saved_tx, "read"), x);
+	} Orb_CATCH(E) {
+		assert(Orb_E_TYPE(E) == Orb_symbol_cc("stm"));
+		thrown = 1;
+	} Orb_ENDTRY;
+	assert(thrown);
+
+	/*large transactions*/
+	for(i = 0; i < MANY; ++i) {
+		many[i] = Orb_new_tvar(Orb_t_from_integer(1));
+	}
+	Orb_atomically(Orb_CELfree(Orb_t_from_cf1(&many_cf1)));
+	for(i = 0; i < MANY; ++i) {
+		assert(Orb_call0(Orb_ref_cc(many[i], "get")) ==
+			Orb_t_from_integer(1 + i)
+		);
+	}
+
+	/*contended behavior*/
+	Orb_t task = Orb_CELfree(Orb_t_from_cf0(&task_cf0));
+	for(i = 0; i < 99; ++i) {
+		Orb_thread_pool_add(task);
+	}
+
+	size_t tries = 0;
+	while(Orb_call0(getx) != Orb_t_from_integer(0)) {
+		Orb_yield();
+		++tries;
+		if(tries > 10000000) {
+			fprintf(stderr, "Timed out!\n");
+			exit(2);
+		}
+	}
+	assert(Orb_call0(gety) == Orb_t_from_integer(100));
+	assert(!inconsistent);
+
+	exit(0);
+}
@@ -0,0 +1,118 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#define TASKS 8
+#define ROUNDS 10
+
+Orb_t latch;
+Orb_t barrier;
+Orb_t phaser;
+Orb_t counter;
+
+Orb_t increment_cf1(Orb_t x) {
+	return Orb_t_from_integer(Orb_t_as_integer(x) + 1);
+}
+
+Orb_t latch_task_cf0(void) {
+	Orb_call1(Orb_ref_cc(counter, "swap"),
+		Orb_CELfree(Orb_t_from_cf1(&increment_cf1))
+	);
+	Orb_call0(Orb_ref_cc(latch, "count-down"));
+	return Orb_NIL;
+}
+
+/*each round, every party increments the counter and then
+checks that all parties have done so
+*/
+Orb_t barrier_task_cf0(void) {
+	Orb_t wait = Orb_ref_cc(barrier, "wait");
+	Orb_t swap = Orb_ref_cc(counter, "swap");
+	Orb_t increment = Orb_CELfree(Orb_t_from_cf1(&increment_cf1));
+	size_t i;
+	for(i = 0; i < ROUNDS; ++i) {
+		Orb_call1(swap, increment);
+		Orb_call0(wait);
+		size_t c = Orb_t_as_integer(Orb_call0(Orb_ref_cc(counter, "get")));
+		assert(c >= (i + 1) * TASKS);
+		Orb_call0(wait);
+	}
+	Orb_call0(Orb_ref_cc(latch, "count-down"));
+	return Orb_NIL;
+}
+
+int main(void) {
+	Orb_init(0, 0);
+	size_t i;
+
+	/*latches*/
+	counter = Orb_new_atom(Orb_t_from_integer(0));
+	latch = Orb_new_latch(TASKS);
+	Orb_t task = Orb_CELfree(Orb_t_from_cf0(&latch_task_cf0));
+	for(i = 0; i < TASKS; ++i) {
+		Orb_thread_pool_add(task);
+	}
+	Orb_call0(Orb_ref_cc(latch, "wait"));
+	assert(Orb_call0(Orb_ref_cc(counter, "get")) == Orb_t_from_integer(TASKS));
+	assert(Orb_call0(Orb_ref_cc(latch, "count")) == Orb_t_from_integer(0));
+	/*extra count-downs do nothing*/
+	Orb_call0(Orb_ref_cc(latch, "count-down"));
+	Orb_call0(Orb_ref_cc(latch, "wait"));
+	Orb_call0(Orb_ref_cc(Orb_new_latch(0), "wait"));
+
+	/*barriers, with the parties on their own threads*/
+	counter = Orb_new_atom(Orb_t_from_integer(0));
+	barrier = Orb_new_barrier(TASKS);
+	latch = Orb_new_latch(TASKS);
+	task = Orb_CELfree(Orb_t_from_cf0(&barrier_task_cf0));
+	for(i = 0; i < TASKS; ++i) {
+		Orb_new_thread(task);
+	}
+	Orb_call0(Orb_ref_cc(latch, "wait"));
+	assert(Orb_call0(Orb_ref_cc(counter, "get"))
+		== Orb_t_from_integer(TASKS * ROUNDS)
+	);
+
+	/*phasers*/
+	phaser = Orb_new_phaser(1);
+	Orb_t arrive = Orb_ref_cc(phaser, "arrive");
+	Orb_t phase = Orb_ref_cc(phaser, "phase");
+	assert(Orb_call0(phase) == Orb_t_from_integer(0));
+	assert(Orb_call0(Orb_ref_cc(phaser, "register")) == Orb_t_from_integer(0));
+	assert(Orb_call0(arrive) == Orb_t_from_integer(0));
+	assert(Orb_call0(phase) == Orb_t_from_integer(0));
+	assert(Orb_call0(arrive) == Orb_t_from_integer(0));
+	assert(Orb_call0(phase) == Orb_t_from_integer(1));
+	assert(Orb_call1(Orb_ref_cc(phaser, "wait-advance"), Orb_t_from_integer(0))
+		== Orb_t_from_integer(1)
+	);
+	assert(Orb_call0(Orb_ref_cc(phaser, "arrive-and-deregister"))
+		== Orb_t_from_integer(1)
+	);
+	assert(Orb_call0(Orb_ref_cc(phaser, "arrive-and-wait"))
+		== Orb_t_from_integer(2)
+	);
+
+	exit(0);
+}
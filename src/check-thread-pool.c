@@ -22,6 +22,8 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 #include<assert.h>
 #include<stdio.h>
 #include<stdlib.h>
+#include<sys/wait.h>
+#include<unistd.h>
 
 #include"thread-support.h"
 
@@ -52,19 +54,22 @@ Orb_t test_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
 	return Orb_NIL;
 }
 
-int main(void) {
-	Orb_init(0, 0);
-
+/*queues 100 copies of f, one at a time or all at once*/
+void run_batch(Orb_t f, int at_once) {
 	struct test* tmp = Orb_gc_malloc(sizeof(struct test));
 	tmp->x = 100;
 	tmp->y = 0;
-	ctest = Orb_cell_init(Orb_t_from_pointer(tmp));
-
-	Orb_t f = Orb_t_from_cfunc(&test_cfunc);
+	Orb_cell_set(ctest, Orb_t_from_pointer(tmp));
 
 	size_t i;
-	for(i = 0; i < 100; ++i) {
-		Orb_thread_pool_add(f);
+	if(at_once) {
+		Orb_t fs[100];
+		for(i = 0; i < 100; ++i) fs[i] = f;
+		assert(Orb_thread_pool_add_n(fs, 100) == 100);
+	} else {
+		for(i = 0; i < 100; ++i) {
+			Orb_thread_pool_add(f);
+		}
 	}
 
 	size_t track_x;
@@ -84,7 +89,325 @@ int main(void) {
 	Orb_t otest = Orb_cell_get(ctest);
 	tmp = Orb_t_as_pointer(otest);
 	assert(tmp->x == 0 && tmp->y == 100);
+}
 
-	exit(0);
+Orb_cell_t gate;
+Orb_cell_t gate_entered;
+
+/*holds up the worker until the gate is opened.  This spins
+instead of waiting on a semaphore, since the pool would
+start another worker if this one blocked.
+*/
+Orb_t gate_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_cell_set(gate_entered, Orb_TRUE);
+	while(Orb_cell_get(gate) == Orb_NIL) Orb_yield();
+	return Orb_NIL;
 }
 
+/*fills the queue while the only worker is held up*/
+void check_overflow(Orb_t f) {
+	struct test* tmp = Orb_gc_malloc(sizeof(struct test));
+	tmp->x = 100;
+	tmp->y = 0;
+	Orb_cell_set(ctest, Orb_t_from_pointer(tmp));
+
+	gate = Orb_cell_init(Orb_NIL);
+	gate_entered = Orb_cell_init(Orb_NIL);
+	Orb_thread_pool_add(Orb_t_from_cfunc(&gate_cfunc));
+	while(Orb_cell_get(gate_entered) == Orb_NIL) Orb_yield();
+
+	Orb_thread_pool_overflow(Orb_POOL_REJECT);
+	size_t accepted = 0;
+	while(Orb_thread_pool_add(f)) ++accepted;
+	assert(accepted == 8);
+	assert(Orb_thread_pool_queue_depth() == 8);
+
+	/*overflowing tasks run right away*/
+	Orb_thread_pool_overflow(Orb_POOL_RUN_INLINE);
+	assert(Orb_thread_pool_add(f));
+	tmp = Orb_t_as_pointer(Orb_cell_get(ctest));
+	assert(tmp->y == 1);
+
+	Orb_thread_pool_overflow(Orb_POOL_BLOCK);
+	Orb_cell_set(gate, Orb_TRUE);
+	while(Orb_thread_pool_queue_depth() != 0) Orb_yield();
+	tmp = Orb_t_as_pointer(Orb_cell_get(ctest));
+	while(tmp->y != 9) {
+		Orb_yield();
+		tmp = Orb_t_as_pointer(Orb_cell_get(ctest));
+	}
+}
+
+Orb_cell_t ran;
+char order[8];
+
+Orb_t high_cf0(void) {
+	order[Orb_cell_add(ran, 1) - 1] = 'H';
+	return Orb_NIL;
+}
+Orb_t low_cf0(void) {
+	order[Orb_cell_add(ran, 1) - 1] = 'L';
+	return Orb_NIL;
+}
+
+/*queues low priority tasks, then high priority ones, while
+the only worker is held up.  Aging may let at most one low
+priority task in ahead of the high priority ones.
+*/
+void check_priority(void) {
+	ran = Orb_cell_init(Orb_t_from_integer(0));
+	gate = Orb_cell_init(Orb_NIL);
+	gate_entered = Orb_cell_init(Orb_NIL);
+	Orb_thread_pool_add(Orb_t_from_cfunc(&gate_cfunc));
+	while(Orb_cell_get(gate_entered) == Orb_NIL) Orb_yield();
+
+	size_t i;
+	for(i = 0; i < 4; ++i) {
+		Orb_thread_pool_add_prio(Orb_t_from_cf0(&low_cf0), Orb_PRIO_LOW);
+	}
+	for(i = 0; i < 4; ++i) {
+		Orb_defer_prio(Orb_t_from_cf0(&high_cf0), Orb_PRIO_HIGH);
+	}
+	Orb_cell_set(gate, Orb_TRUE);
+	while(Orb_cell_get(ran) != Orb_t_from_integer(8)) Orb_yield();
+
+	size_t high = 0;
+	for(i = 0; i < 4; ++i) {
+		if(order[i] == 'H') ++high;
+	}
+	assert(high >= 3);
+}
+
+Orb_sema_t handoff;
+
+Orb_t waiter_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_sema_wait(handoff);
+	Orb_cell_set(gate_entered, Orb_TRUE);
+	return Orb_NIL;
+}
+Orb_t poster_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_sema_post(handoff);
+	return Orb_NIL;
+}
+
+/*with a single worker, the poster can only run if the pool
+starts another worker while the waiter is blocked
+*/
+void check_compensation(void) {
+	handoff = Orb_sema_init(0);
+	gate_entered = Orb_cell_init(Orb_NIL);
+	Orb_thread_pool_add(Orb_t_from_cfunc(&waiter_cfunc));
+	Orb_thread_pool_add(Orb_t_from_cfunc(&poster_cfunc));
+	size_t tries = 0;
+	while(Orb_cell_get(gate_entered) == Orb_NIL) {
+		Orb_yield();
+		++tries;
+		if(tries > 10000000) {
+			fprintf(stderr, "Timed out!\n");
+			exit(2);
+		}
+	}
+}
+
+Orb_cell_t active;
+Orb_cell_t most_active;
+
+/*stays running until two other tasks are running with it,
+or a few seconds have passed.  A cfunc, since cf0's hold
+the CEL.
+*/
+Orb_t spread_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	int n = Orb_cell_add(active, 1);
+	Orb_t omost = Orb_cell_get(most_active);
+	while(Orb_t_as_integer(omost) < n) {
+		Orb_t read = Orb_cell_cas_get(most_active,
+			omost, Orb_t_from_integer(n)
+		);
+		if(read == omost) break;
+		omost = read;
+	}
+	uint64_t deadline = Orb_monotonic_ns() + 5000 * (uint64_t) 1000000;
+	while(Orb_t_as_integer(Orb_cell_get(active)) < 3 &&
+			Orb_monotonic_ns() < deadline) {
+		Orb_yield();
+	}
+	Orb_cell_add(active, -1);
+	return Orb_NIL;
+}
+Orb_t noop_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_cell_add(active, 1);
+	return Orb_NIL;
+}
+
+/*queues a burst of tasks just after a worker went idle, so
+that it is likely polling.  It only stands in for one
+wakeup, so the burst still spreads over the other workers.
+Needs at least 3 workers.
+*/
+void check_spread(void) {
+	active = Orb_cell_init(Orb_t_from_integer(0));
+	most_active = Orb_cell_init(Orb_t_from_integer(0));
+	Orb_thread_pool_add(Orb_t_from_cfunc(&noop_cfunc));
+	while(Orb_cell_get(active) == Orb_t_from_integer(0)) Orb_yield();
+	Orb_cell_set(active, Orb_t_from_integer(0));
+	size_t i;
+	for(i = 0; i < 8; ++i) Orb_thread_pool_add(Orb_t_from_cfunc(&spread_cfunc));
+	Orb_thread_pool_drain();
+	assert(Orb_t_as_integer(Orb_cell_get(most_active)) > 2);
+}
+
+/*counts a batch of tasks*/
+void check_stats(Orb_t f) {
+	Orb_pool_stats before, after;
+	Orb_thread_pool_measure_time(1);
+	Orb_thread_pool_stats(&before);
+	run_batch(f, 0);
+	Orb_thread_pool_stats(&after);
+	Orb_thread_pool_measure_time(0);
+
+	assert(after.workers >= 1);
+	assert(after.run - before.run >= 100);
+	size_t timed = 0;
+	size_t i;
+	for(i = 0; i < Orb_POOL_HISTOGRAM_BUCKETS; ++i) {
+		timed += after.run_time[i] - before.run_time[i];
+	}
+	assert(timed == after.run - before.run);
+	assert(after.submitted - before.submitted == 100);
+
+	Orb_t snap = Orb_thread_pool_snapshot();
+	assert(Orb_t_as_integer(Orb_deref_cc(snap, "run")) >= (int) after.run);
+	Orb_t per_worker = Orb_deref_cc(snap, "per-worker");
+	assert(Orb_len(per_worker) >= 1);
+	assert(Orb_len(Orb_deref_cc(snap, "run-time")) == Orb_POOL_HISTOGRAM_BUCKETS);
+}
+
+/*queues tasks and drains the pool without polling*/
+void check_drain(Orb_t f) {
+	struct test* tmp = Orb_gc_malloc(sizeof(struct test));
+	tmp->x = 100;
+	tmp->y = 0;
+	Orb_cell_set(ctest, Orb_t_from_pointer(tmp));
+	size_t i;
+	for(i = 0; i < 100; ++i) {
+		Orb_thread_pool_add(f);
+	}
+	Orb_thread_pool_drain();
+	assert(Orb_thread_pool_queue_depth() == 0);
+	tmp = Orb_t_as_pointer(Orb_cell_get(ctest));
+	assert(tmp->x == 0 && tmp->y == 100);
+}
+
+/*shuts the pool down around a fork, and uses it in both
+processes
+*/
+void check_fork(Orb_t f) {
+	Orb_thread_pool_fork_prepare();
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if(pid == 0) {
+		Orb_thread_pool_fork_child();
+		check_drain(f);
+		exit(0);
+	}
+	Orb_thread_pool_fork_parent();
+	check_drain(f);
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+Orb_t answer_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	return Orb_t_from_integer(42);
+}
+
+/*holds up the only worker of a separate executor, and
+checks that the default pool still runs tasks
+*/
+void check_executors(Orb_t f) {
+	Orb_t io = Orb_new_executor("io", 1);
+	assert(Orb_deref_cc(io, "name") == Orb_symbol_cc("io"));
+	assert(Orb_executor_size(io) == 1);
+	/*settings are per executor*/
+	Orb_executor_queue_capacity(io, 4);
+	Orb_executor_spin(io, 0);
+
+	gate = Orb_cell_init(Orb_NIL);
+	gate_entered = Orb_cell_init(Orb_NIL);
+	assert(Orb_executor_add(io, Orb_t_from_cfunc(&gate_cfunc)));
+	while(Orb_cell_get(gate_entered) == Orb_NIL) Orb_yield();
+
+	Orb_t answer = Orb_t_from_cfunc(&answer_cfunc);
+	Orb_executor_overflow(io, Orb_POOL_REJECT);
+	size_t accepted = 0;
+	while(Orb_executor_add(io, answer)) ++accepted;
+	assert(accepted == 4);
+	Orb_executor_overflow(io, Orb_POOL_BLOCK);
+
+	run_batch(f, 0);
+	run_batch(f, 1);
+
+	Orb_pool_stats st;
+	Orb_executor_stats(io, &st);
+	assert(st.workers == 1);
+	Orb_cell_set(gate, Orb_TRUE);
+
+	Orb_t df = Orb_defer_on(io, Orb_t_from_cfunc(&answer_cfunc));
+	assert(Orb_call0(df) == Orb_t_from_integer(42));
+	df = Orb_call1(Orb_ref_cc(io, "defer"), Orb_t_from_cfunc(&answer_cfunc));
+	assert(Orb_call0(df) == Orb_t_from_integer(42));
+
+	Orb_executor_shutdown(io);
+	Orb_executor_stats(io, &st);
+	assert(st.workers == 0);
+	assert(Orb_executor_size(io) == 1);
+}
+
+int main(void) {
+	Orb_init(0, 0);
+	/*run the workers on threadlet stacks*/
+	Orb_thread_pool_stack_size(Orb_THREADLET_STACK);
+	/*small enough that submitting a batch has to block*/
+	Orb_thread_pool_queue_capacity(8);
+	/*poll even on a single processor, so that the tests also
+	cover submitters skipping wakeups for polling workers
+	*/
+	Orb_thread_pool_spin(256);
+
+	ctest = Orb_cell_init(Orb_NIL);
+
+	Orb_t f = Orb_t_from_cfunc(&test_cfunc);
+
+	/*start with a single worker, so that it can be held up*/
+	Orb_thread_pool_resize(1);
+	check_overflow(f);
+	check_priority();
+	check_compensation();
+
+	Orb_thread_pool_resize(0);
+	run_batch(f, 0);
+	run_batch(f, 1);
+
+	/*resize the running pool up and down*/
+	Orb_thread_pool_resize(3);
+	assert(Orb_thread_pool_size() == 3);
+	run_batch(f, 0);
+	run_batch(f, 1);
+	check_spread();
+	Orb_thread_pool_resize(1);
+	assert(Orb_thread_pool_size() == 1);
+	run_batch(f, 0);
+	run_batch(f, 1);
+
+	check_executors(f);
+	check_stats(f);
+	check_drain(f);
+	/*restarts with the same size*/
+	Orb_thread_pool_resize(2);
+	Orb_thread_pool_shutdown();
+	assert(Orb_thread_pool_size() == 2);
+	check_drain(f);
+	check_fork(f);
+
+	exit(0);
+}
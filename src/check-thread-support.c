@@ -0,0 +1,81 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#include"thread-support.h"
+
+#define THREADLETS 200
+
+Orb_t answer_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	return Orb_t_from_integer(42);
+}
+
+/*waits until the thread finishes, failing after a few
+seconds
+*/
+void wait_finished(Orb_t t) {
+	Orb_t finished = Orb_ref_cc(t, "finished");
+	size_t tries = 0;
+	while(Orb_call0(finished) == Orb_NIL) {
+		Orb_yield();
+		++tries;
+		if(tries > 10000000) {
+			fprintf(stderr, "Timed out!\n");
+			exit(2);
+		}
+	}
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	Orb_t f = Orb_t_from_cfunc(&answer_cfunc);
+
+	/*thread objects report the result*/
+	Orb_t t = Orb_new_thread(f);
+	wait_finished(t);
+	assert(Orb_call0(Orb_ref_cc(t, "finished")) == Orb_TRUE);
+	assert(Orb_call0(Orb_ref_cc(t, "result")) == Orb_t_from_integer(42));
+
+	/*a burst of threadlets*/
+	Orb_t ts[THREADLETS];
+	size_t i;
+	for(i = 0; i < THREADLETS; ++i) ts[i] = Orb_new_threadlet(f);
+	for(i = 0; i < THREADLETS; ++i) {
+		wait_finished(ts[i]);
+		assert(Orb_call0(Orb_ref_cc(ts[i], "result"))
+			== Orb_t_from_integer(42)
+		);
+	}
+	size_t mapped = Orb_priv_threadlet_stacks();
+	assert(mapped >= 1 && mapped <= THREADLETS);
+
+	/*later threadlets reuse the stacks of finished ones*/
+	for(i = 0; i < 10; ++i) {
+		t = Orb_new_threadlet(f);
+		wait_finished(t);
+		assert(Orb_priv_threadlet_stacks() == mapped);
+	}
+
+	exit(0);
+}
@@ -0,0 +1,136 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
+#include"thread-support.h"
+
+#define MS 1000000
+
+Orb_cell_t count;
+
+Orb_t count_cf0(void) {
+	Orb_cell_add(count, 1);
+	return Orb_NIL;
+}
+
+/*waits until count reaches n, failing after a few seconds*/
+void wait_count(int n) {
+	uint64_t deadline = Orb_monotonic_ns() + 5000 * (uint64_t) MS;
+	while(Orb_t_as_integer(Orb_cell_get(count)) < n) {
+		if(Orb_monotonic_ns() > deadline) {
+			fprintf(stderr, "Timed out!\n");
+			exit(2);
+		}
+		Orb_yield();
+	}
+}
+void sleep_ms(uint64_t ms) {
+	uint64_t deadline = Orb_monotonic_ns() + ms * MS;
+	while(Orb_monotonic_ns() < deadline) Orb_yield();
+}
+
+Orb_t secret;
+
+Orb_t get_secret_cf0(void) {
+	return secret;
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	count = Orb_cell_init(Orb_t_from_integer(0));
+	secret = Orb_t_from_pointer(&secret);
+	Orb_t f = Orb_t_from_cf0(&count_cf0);
+
+	/*one-shot timers fire no earlier than asked, including
+	ones that have to be cascaded from higher levels
+	*/
+	uint64_t start = Orb_monotonic_ns();
+	Orb_timer_add(f, 20 * MS, 0);
+	wait_count(1);
+	assert(Orb_monotonic_ns() - start >= 20 * MS);
+	start = Orb_monotonic_ns();
+	Orb_timer_add(f, 150 * MS, 0);
+	wait_count(2);
+	assert(Orb_monotonic_ns() - start >= 150 * MS);
+
+	/*cancelled timers never fire*/
+	Orb_t t = Orb_timer_add(f, 30 * MS, 0);
+	Orb_t far = Orb_timer_add(f, 3600000 * (uint64_t) MS, 0);
+	assert(Orb_timer_cancel(t));
+	assert(!Orb_timer_cancel(t));
+	assert(Orb_call0(Orb_ref_cc(far, "cancel")) == Orb_TRUE);
+	sleep_ms(60);
+	assert(Orb_cell_get(count) == Orb_t_from_integer(2));
+
+	/*periodic timers fire until cancelled*/
+	t = Orb_timer_add(f, 0, 5 * MS);
+	wait_count(5);
+	assert(Orb_timer_cancel(t));
+	sleep_ms(10);
+	int stopped = Orb_t_as_integer(Orb_cell_get(count));
+	sleep_ms(30);
+	assert(Orb_t_as_integer(Orb_cell_get(count)) == stopped);
+
+	/*delayed defers*/
+	Orb_t g = Orb_t_from_cf0(&get_secret_cf0);
+	Orb_t df = Orb_defer_after(g, 10 * MS);
+	assert(Orb_call0(df) == secret);
+	df = Orb_defer_after(g, 3600000 * (uint64_t) MS);
+	assert(Orb_defer_cancel(df));
+	assert(!Orb_defer_cancel(df));
+	volatile int thrown = 0;
+	Orb_TRY {
+		Orb_call0(df);
+	} Orb_CATCH(E) {
+		assert(Orb_E_TYPE(E) == Orb_symbol_cc("cancel"));
+		thrown = 1;
+	} Orb_ENDTRY;
+	assert(thrown);
+
+	/*the timer thread is restarted on both sides of a fork,
+	and timers pending across it fire in both processes
+	*/
+	int before = Orb_t_as_integer(Orb_cell_get(count));
+	Orb_timer_add(f, 30 * MS, 0);
+	Orb_thread_pool_fork_prepare();
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if(pid == 0) {
+		Orb_thread_pool_fork_child();
+		wait_count(before + 1);
+		Orb_timer_add(f, 10 * MS, 0);
+		wait_count(before + 2);
+		exit(0);
+	}
+	Orb_thread_pool_fork_parent();
+	wait_count(before + 1);
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	exit(0);
+}
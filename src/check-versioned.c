@@ -0,0 +1,83 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include<liborb.h>
+
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#define WRITERS 10
+
+Orb_t v;
+Orb_t latch;
+size_t calls = 0;
+
+/*not atomic: relies on update excluding other writers*/
+Orb_t increment_cf1(Orb_t x) {
+	++calls;
+	return Orb_t_from_integer(Orb_t_as_integer(x) + 1);
+}
+
+Orb_t writer_cf0(void) {
+	Orb_call1(Orb_ref_cc(v, "update"),
+		Orb_CELfree(Orb_t_from_cf1(&increment_cf1))
+	);
+	Orb_call0(Orb_ref_cc(latch, "count-down"));
+	return Orb_NIL;
+}
+
+int main(void) {
+	Orb_init(0, 0);
+
+	v = Orb_new_versioned(Orb_t_from_integer(0));
+	Orb_t get = Orb_ref_cc(v, "get");
+	Orb_t version = Orb_ref_cc(v, "version");
+	Orb_t set_if_version = Orb_ref_cc(v, "set-if-version");
+
+	/*single-threaded behavior*/
+	assert(Orb_call0(get) == Orb_t_from_integer(0));
+	assert(Orb_call0(version) == Orb_t_from_integer(0));
+	Orb_call1(Orb_ref_cc(v, "set"), Orb_t_from_integer(42));
+	assert(Orb_call0(get) == Orb_t_from_integer(42));
+	assert(Orb_call0(version) == Orb_t_from_integer(1));
+	assert(!Orb_bool(Orb_call2(set_if_version,
+		Orb_t_from_integer(0), Orb_t_from_integer(1)
+	)));
+	assert(Orb_bool(Orb_call2(set_if_version,
+		Orb_t_from_integer(1), Orb_t_from_integer(0)
+	)));
+	Orb_t s = Orb_call0(Orb_ref_cc(v, "snapshot"));
+	assert(Orb_nth(s, 0) == Orb_t_from_integer(2));
+	assert(Orb_nth(s, 1) == Orb_t_from_integer(0));
+
+	/*contended behavior*/
+	latch = Orb_new_latch(WRITERS);
+	Orb_t writer = Orb_CELfree(Orb_t_from_cf0(&writer_cf0));
+	size_t i;
+	for(i = 0; i < WRITERS; ++i) {
+		Orb_thread_pool_add(writer);
+	}
+	Orb_call0(Orb_ref_cc(latch, "wait"));
+	assert(Orb_call0(get) == Orb_t_from_integer(WRITERS));
+	assert(Orb_call0(version) == Orb_t_from_integer(2 + WRITERS));
+	assert(calls == WRITERS);
+
+	exit(0);
+}
@@ -19,183 +19,340 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 
 #include"liborb.h"
 #include"thread-support.h"
+#include"thread-pool.h"
 #include"defer.h"
+#include"list.h"
 
 #include<assert.h>
 
 /*
- * Structures for current state of defer object
+ * State of a defer object
  */
-/*informational structures*/
+/*A defer is an array of cells: a state word, and slots for
+the function and its result.  The state word is one of the
+integers below.  Threads waiting for the defer are kept in a
+list of waiters, which is replaced by Orb_TRUE once the
+defer is done.  Waiters live on their own stacks and each
+sleeps on a semaphore private to its thread, so running a
+defer and waiting for it allocate nothing.
+
+A timed wait may give up before the defer finishes, leaving
+its node on the list, so its node and semaphore are allocated
+instead.  The post it misses then cannot wake a later wait.
+
+The slots are written only by the thread that moved the
+state from state_idle to state_running, and are read only
+after the state becomes state_finished or state_errored.
+
+Defers created while a defer runs are its children, and are
+kept in an intrusive list threaded through their own cells.
+Cancelling a defer cancels its children, and so does an
+error thrown by its function.
+
+Continuations are functions queued on the pool once the
+defer finishes or errors.  They are kept in a list, which is
+replaced by Orb_TRUE once they have been queued.
+*/
+enum {
+	state_idle,
+	state_running,
+	state_finished,
+	state_errored
+};
+#define CELL_STATE 0
+/*the function while idle, then the return value or the
+type of the error
+*/
+#define CELL_VALUE 1
+/*the value of the error*/
+#define CELL_ERROR_VALUE 2
+/*Orb_TRUE once cancellation was requested*/
+#define CELL_CANCELLED 3
+/*the cells of the newest child, or Orb_NIL*/
+#define CELL_CHILDREN 4
+/*the cells of the next older sibling, or Orb_NIL*/
+#define CELL_SIBLING 5
+/*a list_t of continuations, Orb_NIL, or Orb_TRUE*/
+#define CELL_CONTINUATIONS 6
+/*the most recent waiter, Orb_NIL, or Orb_TRUE*/
+#define CELL_WAITERS 7
+/*the timer of a delayed defer, or Orb_NIL*/
+#define CELL_TIMER 8
+#define NUM_CELLS 9
+
 struct waiter_s {
+	struct waiter_s* next;
 	Orb_sema_t sema;
-	size_t N;
 };
 typedef struct waiter_s waiter;
-struct errdata_s {
-	Orb_t type;
-	Orb_t value;
-};
-typedef struct errdata_s errdata;
-/*core structure*/
-struct defer_s {
-	enum {
-		state_idle,
-		state_running,
-		state_wait_on_running,
-		state_finished,
-		state_errored
-	} type;
-	union {
-		Orb_t f; /*function to run in state_idle*/
-		waiter waitlist; /*semaphore and number of
-				waiters in state_wait_on_running
-				*/
-		Orb_t rv; /*return value in state_finished*/
-		errdata error; /*error details in state_errored*/
-	};
-};
-typedef struct defer_s defer;
-typedef defer* defer_t;
+typedef waiter* waiter_t;
 
-/*given an Orb_cell_t, transition from
-state_running or state_wait_on_running to the
-given defer state.  Also wakes up any waiters
+/*the calling thread's semaphore for waiting on defers*/
+static Orb_tls_t thread_sema;
+/*the cells of the defer running on the calling thread*/
+static Orb_tls_t current_defer;
+static Orb_sema_t get_thread_sema(void) {
+	Orb_sema_t rv = Orb_tls_get(thread_sema);
+	if(!rv) {
+		rv = Orb_sema_init(0);
+		Orb_tls_set(thread_sema, rv);
+	}
+	return rv;
+}
+
+static Orb_t state_t(int state) {
+	return Orb_t_from_integer(state);
+}
+
+/*queue a continuation, running it here if the pool will
+not take it
 */
-static void post_run(Orb_cell_t c, defer_t d) {
-	Orb_t nstate = Orb_t_from_pointer(d);
-	Orb_t ostate = Orb_cell_get(c);
+static void schedule(Orb_t k) {
+	if(!Orb_thread_pool_add(k)) Orb_call0(k);
+}
+static void fire_continuations(Orb_cell_t cs) {
+	Orb_cell_t c = Orb_cell_array_ref(cs, CELL_CONTINUATIONS);
+	Orb_t ohead = Orb_cell_get(c);
 	for(;;) {
-		defer_t pstate = Orb_t_as_pointer(ostate);
-		assert(
-			pstate->type == state_running
-			|| pstate->type == state_wait_on_running
-		);
+		Orb_t read = Orb_cell_cas_get(c, ohead, Orb_TRUE);
+		if(read == ohead) break;
+		ohead = read;
+	}
+	if(ohead == Orb_NIL) return;
+	/*queue them in the order they were added*/
+	list_t l = Orb_t_as_pointer(ohead);
+	list_t rev = 0;
+	while(l) {
+		list_t next = l->next;
+		l->next = rev;
+		rev = l;
+		l = next;
+	}
+	for(; rev; rev = rev->next) schedule(rev->value);
+}
+/*call k once the defer has finished*/
+static void when_done(Orb_cell_t cs, Orb_t k) {
+	Orb_cell_t c = Orb_cell_array_ref(cs, CELL_CONTINUATIONS);
+	list_t l = list_cons(k, 0);
+	Orb_t ohead = Orb_cell_get(c);
+	for(;;) {
+		if(ohead == Orb_TRUE) {
+			/*already finished*/
+			Orb_gc_free(l);
+			schedule(k);
+			return;
+		}
+		l->next = ohead == Orb_NIL ? 0 : Orb_t_as_pointer(ohead);
+		Orb_t read = Orb_cell_cas_get(c, ohead, Orb_t_from_pointer(l));
+		if(read == ohead) return;
+		ohead = read;
+	}
+}
 
-		/*CAS*/
-		Orb_t read = Orb_cell_cas_get(c,
-			ostate, nstate
-		);
-		if(read == ostate) {
-			/*succeeded. wake up if any waiters*/
-			if(pstate->type == state_wait_on_running) {
-				size_t N = pstate->waitlist.N;
-				Orb_sema_t sema = pstate->waitlist.sema;
-
-				size_t i;
-				for(i = 0; i < N; ++i) {
-					Orb_sema_post(sema);
-				}
-			}
-			/*exit loop*/
-			break;
-		} else ostate = read;
+/*given the cells of a defer in state_running, transition
+to the given final state, and wake up any waiters
+*/
+static void finish(Orb_cell_t cs, int final) {
+	Orb_cell_t c = Orb_cell_array_ref(cs, CELL_STATE);
+	assert(Orb_cell_get(c) == state_t(state_running));
+	Orb_cell_set(c, state_t(final));
+	/*waiters that come after this see the final state*/
+	Orb_cell_t ws = Orb_cell_array_ref(cs, CELL_WAITERS);
+	Orb_t ohead = Orb_cell_get(ws);
+	for(;;) {
+		Orb_t read = Orb_cell_cas_get(ws, ohead, Orb_TRUE);
+		if(read == ohead) break;
+		ohead = read;
+	}
+	if(ohead != Orb_NIL) {
+		waiter_t w = Orb_t_as_pointer(ohead);
+		while(w) {
+			/*the waiter may return as soon as it is
+			posted, taking its node with it
+			*/
+			waiter_t next = w->next;
+			Orb_sema_post(w->sema);
+			w = next;
+		}
+	}
+	fire_continuations(cs);
+}
+/*add a waiter to be posted once the defer is done.
+Returns 0 if it is already done.
+*/
+static int add_waiter(Orb_cell_t cs, waiter_t w) {
+	Orb_cell_t ws = Orb_cell_array_ref(cs, CELL_WAITERS);
+	Orb_t ohead = Orb_cell_get(ws);
+	for(;;) {
+		if(ohead == Orb_TRUE) return 0;
+		w->next = ohead == Orb_NIL ? 0 : Orb_t_as_pointer(ohead);
+		Orb_t read = Orb_cell_cas_get(ws, ohead, Orb_t_from_pointer(w));
+		if(read == ohead) return 1;
+		ohead = read;
 	}
 }
+static int is_done(Orb_cell_t cs) {
+	Orb_t state = Orb_cell_get(Orb_cell_array_ref(cs, CELL_STATE));
+	return state == state_t(state_finished) ||
+		state == state_t(state_errored);
+}
 
-/*attempt to transition from an expected state_idle state to
-state_running, then run the function
-Returns the result of the Orb_cell_cas_get()
-	== ostate if ran, otherwise did not run
-Also provides the final state if ran
+/*attempt to transition from state_idle to state_running.
+Returns non-0 if the caller now owns the slots.
 */
-static Orb_t to_running(Orb_cell_t c, Orb_t ostate, defer_t pstate,
-			defer_t* pnstate) {
-	assert(pstate->type == state_idle);
-	assert(Orb_t_from_pointer(pstate) == ostate);
-
-	defer_t rstate = Orb_gc_malloc(sizeof(defer));
-	rstate->type = state_running;
-
-	Orb_t read = Orb_cell_cas_get(c, ostate, Orb_t_from_pointer(rstate));
-	if(read == ostate) {
-		defer_t nstate = Orb_gc_malloc(sizeof(defer));
-		Orb_TRY {
-			Orb_t rv = Orb_call0(pstate->f);
-			nstate->type = state_finished;
-			nstate->rv = rv;
-		} Orb_CATCH(E) {
-			Orb_t type = Orb_E_TYPE(E);
-			Orb_t value = Orb_E_VALUE(E);
-			nstate->type = state_errored;
-			nstate->error.type = type;
-			nstate->error.value = value;
-		} Orb_ENDTRY;
-		post_run(c, nstate);
-		*pnstate = nstate;
+static int claim(Orb_cell_t cs) {
+	if(!Orb_cell_cas(Orb_cell_array_ref(cs, CELL_STATE),
+			state_t(state_idle), state_t(state_running))) {
+		return 0;
 	}
-	return read;
+	/*a delayed defer no longer needs its timer*/
+	Orb_t timer = Orb_cell_get(Orb_cell_array_ref(cs, CELL_TIMER));
+	if(timer != Orb_NIL) Orb_timer_cancel(timer);
+	return 1;
 }
 
-/*core function for 'try-run method*/
-static void core_try_run(Orb_cell_t c) {
-	Orb_t ostate = Orb_cell_get(c);
+static int cancel(Orb_cell_t cs);
+
+static void cancel_children(Orb_cell_t cs) {
+	Orb_t ochild = Orb_cell_get(Orb_cell_array_ref(cs, CELL_CHILDREN));
+	while(ochild != Orb_NIL) {
+		Orb_cell_t child = Orb_t_as_pointer(ochild);
+		cancel(child);
+		ochild = Orb_cell_get(Orb_cell_array_ref(child, CELL_SIBLING));
+	}
+}
+/*cancel a defer: one that has not started never will, and
+one that is running is flagged for Orb_cancelled().  Either
+way its children are cancelled too.  Returns non-0 if it had
+not started.
+*/
+static int cancel(Orb_cell_t cs) {
+	if(claim(cs)) {
+		/*it never ran, so it has no children*/
+		Orb_cell_set(Orb_cell_array_ref(cs, CELL_VALUE),
+			Orb_symbol_cc("cancel")
+		);
+		Orb_cell_set(Orb_cell_array_ref(cs, CELL_ERROR_VALUE), Orb_NIL);
+		finish(cs, state_errored);
+		return 1;
+	}
+	if(Orb_cell_cas(Orb_cell_array_ref(cs, CELL_CANCELLED),
+			Orb_NIL, Orb_TRUE)) {
+		cancel_children(cs);
+	}
+	return 0;
+}
+
+/*make a new defer a child of the one running on this thread*/
+static void adopt(Orb_cell_t cs) {
+	Orb_cell_t parent = Orb_tls_get(current_defer);
+	if(!parent) return;
+	Orb_cell_t children = Orb_cell_array_ref(parent, CELL_CHILDREN);
+	Orb_t ochildren = Orb_cell_get(children);
 	for(;;) {
-		defer_t pstate = Orb_t_as_pointer(ostate);
-		if(pstate->type == state_idle) {
-			defer_t dont_care;
-			Orb_t read = to_running(c, ostate, pstate, &dont_care);
-			if(read == ostate) return;
-			else ostate = read;
-		}
+		Orb_cell_set(Orb_cell_array_ref(cs, CELL_SIBLING), ochildren);
+		Orb_t read = Orb_cell_cas_get(children,
+			ochildren, Orb_t_from_pointer(cs)
+		);
+		if(read == ochildren) break;
+		ochildren = read;
+	}
+	/*a parent cancelled before it saw us in its list*/
+	if(Orb_cell_get(Orb_cell_array_ref(parent, CELL_CANCELLED)) != Orb_NIL) {
+		cancel(cs);
 	}
 }
+
+/*run the function of a defer that the caller claimed*/
+static void run(Orb_cell_t cs) {
+	Orb_cell_t value = Orb_cell_array_ref(cs, CELL_VALUE);
+	Orb_t f = Orb_cell_get(value);
+	Orb_cell_t parent = Orb_tls_get(current_defer);
+	volatile int final = state_finished;
+	Orb_tls_set(current_defer, cs);
+	Orb_TRY {
+		Orb_cell_set(value, Orb_call0(f));
+	} Orb_CATCH(E) {
+		Orb_cell_set(value, Orb_E_TYPE(E));
+		Orb_cell_set(Orb_cell_array_ref(cs, CELL_ERROR_VALUE),
+			Orb_E_VALUE(E)
+		);
+		final = state_errored;
+	} Orb_ENDTRY;
+	Orb_tls_set(current_defer, parent);
+	/*an error abandons the children*/
+	if(final == state_errored) cancel_children(cs);
+	/*we can no longer be cancelled, so let go of them*/
+	Orb_cell_set(Orb_cell_array_ref(cs, CELL_CHILDREN), Orb_NIL);
+	finish(cs, final);
+}
+
+/*core function for 'try-run method*/
+static void core_try_run(Orb_cell_t cs) {
+	/*someone else has already run it, or is running it*/
+	if(!claim(cs)) return;
+	run(cs);
+}
+/*the pool runs every task outside of the defer running on
+the thread, since a task run by a thread that helps, or run
+inline on overflow, is not part of it: defers it creates are
+not our children, and cancelling us does not cancel it.
+*/
+static void* task_enter(void) {
+	Orb_cell_t cur = Orb_tls_get(current_defer);
+	Orb_tls_set(current_defer, 0);
+	return cur;
+}
+static void task_leave(void* cur) {
+	Orb_tls_set(current_defer, cur);
+}
 /*core function for **call** method*/
-static Orb_t core_call(Orb_cell_t c) {
+static Orb_t core_call(Orb_cell_t cs) {
+	Orb_cell_t c = Orb_cell_array_ref(cs, CELL_STATE);
 	Orb_t ostate = Orb_cell_get(c);
 	for(;;) {
-		defer_t pstate = Orb_t_as_pointer(ostate);
-		if(pstate->type == state_idle) {
-			defer_t result;
-			Orb_t read = to_running(c, ostate, pstate, &result);
-			if(read == ostate) ostate = Orb_t_from_pointer(result);
-			else ostate = read;
-		} else if(pstate->type == state_running) {
-			/*create semaphore and wait on it*/
-			Orb_sema_t sema = Orb_sema_init(0);
-
-			defer_t nstate = Orb_gc_malloc(sizeof(defer));
-			nstate->type = state_wait_on_running;
-			nstate->waitlist.sema = sema;
-			nstate->waitlist.N = 1;
-
-			Orb_t read = Orb_cell_cas_get(c,
-				ostate, Orb_t_from_pointer(nstate)
-			);
-			if(read == ostate) {
-				Orb_sema_wait(sema);
-			} else {
-				ostate = read;
-				Orb_gc_free(nstate);
-			}
-		} else if(pstate->type == state_wait_on_running) {
-			/*extract semaphore and wait on it*/
-			Orb_sema_t sema = pstate->waitlist.sema;
-			size_t N = pstate->waitlist.N;
-
-			defer_t nstate = Orb_gc_malloc(sizeof(defer));
-			nstate->type = state_wait_on_running;
-			nstate->waitlist.sema = sema;
-			nstate->waitlist.N = N + 1;
-
-			Orb_t read = Orb_cell_cas_get(c,
-				ostate, Orb_t_from_pointer(nstate)
+		if(ostate == state_t(state_finished)) {
+			return Orb_cell_get(Orb_cell_array_ref(cs, CELL_VALUE));
+		} else if(ostate == state_t(state_errored)) {
+			Orb_THROW(
+				Orb_cell_get(Orb_cell_array_ref(cs, CELL_VALUE)),
+				Orb_cell_get(Orb_cell_array_ref(cs, CELL_ERROR_VALUE))
 			);
-			if(read == ostate) {
-				Orb_sema_wait(sema);
-			} else {
-				ostate = read;
-				Orb_gc_free(nstate);
-			}
-		} else if(pstate->type == state_finished) {
-			return pstate->rv;
-		} else if(pstate->type == state_errored) {
-			Orb_THROW(pstate->error.type, pstate->error.value);
+		} else if(ostate == state_t(state_idle)) {
+			if(claim(cs)) run(cs);
+			ostate = Orb_cell_get(c);
+		} else if(Orb_thread_pool_help()) {
+			/*ran some other task while waiting for the one
+			running this defer
+			*/
+			ostate = Orb_cell_get(c);
+		} else {
+			/*nothing else to do: add ourselves to the
+			waiters and sleep
+			*/
+			waiter w;
+			w.sema = get_thread_sema();
+			if(add_waiter(cs, &w)) Orb_sema_wait(w.sema);
+			ostate = Orb_cell_get(c);
 		}
 	}
 }
 
+/*wait without running or helping, until the defer is done
+or the deadline passes.  Returns 0 if it is still not done.
+*/
+static int core_wait_until(Orb_cell_t cs, uint64_t deadline) {
+	if(is_done(cs)) return 1;
+	if(Orb_monotonic_ns() >= deadline) return 0;
+	waiter_t w = Orb_gc_malloc(sizeof(waiter));
+	w->sema = Orb_sema_init(0);
+	if(!add_waiter(cs, w)) return 1;
+	return Orb_sema_wait_until(w->sema, deadline) || is_done(cs);
+}
+
 static Orb_t hfield1;
+static Orb_t hfield2;
+static Orb_t hfield3;
 static Orb_t defer_base;
 
 /*method function for try-run*/
@@ -206,9 +363,9 @@ static Orb_t try_run_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
 		);
 	}
 	Orb_t this = argv[1];
-	Orb_t oc = Orb_deref(this, hfield1);
-	Orb_cell_t c = Orb_t_as_pointer(oc);
-	core_try_run(c);
+	Orb_t ocs = Orb_deref(this, hfield1);
+	Orb_cell_t cs = Orb_t_as_pointer(ocs);
+	core_try_run(cs);
 	return Orb_NIL;
 }
 /*method function for call*/
@@ -219,16 +376,145 @@ static Orb_t call_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
 		);
 	}
 	Orb_t this = argv[1];
-	Orb_t oc = Orb_deref(this, hfield1);
-	Orb_cell_t c = Orb_t_as_pointer(oc);
-	return core_call(c);
+	Orb_t ocs = Orb_deref(this, hfield1);
+	Orb_cell_t cs = Orb_t_as_pointer(ocs);
+	return core_call(cs);
+}
+
+/*method function for wait-for*/
+static Orb_t wait_for_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to wait-for"
+		);
+	}
+	if(!Orb_t_is_integer(argv[2]) || Orb_t_as_integer(argv[2]) < 0) {
+		Orb_THROW_cc("type",
+			"Expected a non-negative integer in wait-for"
+		);
+	}
+	/*milliseconds, since Orb integers are too small to hold
+	more than about half a second in nanoseconds
+	*/
+	uint64_t ns = (uint64_t) Orb_t_as_integer(argv[2]) * 1000000;
+	if(Orb_defer_wait_for(argv[1], ns)) {
+		return Orb_TRUE;
+	} else {
+		return Orb_NIL;
+	}
+}
+/*method function for then*/
+static Orb_t then_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to then"
+		);
+	}
+	return Orb_defer_then(argv[1], argv[2]);
+}
+/*method function for on-done*/
+static Orb_t on_done_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to on-done"
+		);
+	}
+	Orb_defer_on_done(argv[1], argv[2]);
+	return Orb_NIL;
+}
+
+static Orb_t o_then;
+static Orb_t o_all;
+static Orb_t o_all_count;
+static Orb_t o_any_settle;
+
+/*
+ * Continuations and combinators
+ */
+/*calls f on the value of df*/
+static Orb_t then_f_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_t self = argv[0];
+	Orb_t df = Orb_deref(self, hfield2);
+	Orb_t f = Orb_deref(self, hfield3);
+	return Orb_call1(f, Orb_call0(df));
+}
+/*number of elements of a sequence.  Orb_len() does not
+work on the empty sequence, whose 'len is virtual.
+*/
+static size_t seq_len(Orb_t s) {
+	Orb_t olen = Orb_len_o(s);
+	return Orb_t_is_integer(olen) ? Orb_t_as_integer(olen) : 0;
+}
+/*calls each defer in a sequence, in order*/
+static Orb_t all_f_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_t self = argv[0];
+	Orb_t dfs = Orb_deref(self, hfield2);
+	size_t n = seq_len(dfs);
+	Orb_t* vs = Orb_gc_malloc((n ? n : 1) * sizeof(Orb_t));
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		vs[i] = Orb_call0(Orb_nth_o(dfs, Orb_t_from_integer(i)));
+	}
+	Orb_t rv = Orb_seq(vs, n);
+	Orb_gc_free(vs);
+	return rv;
+}
+/*continuation for each defer of Orb_defer_all(): the last
+one to finish runs the combined defer
+*/
+static Orb_t all_count_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_t self = argv[0];
+	Orb_cell_t remaining = Orb_t_as_pointer(Orb_deref(self, hfield2));
+	if(Orb_cell_add(remaining, -1) == 0) {
+		Orb_call0(Orb_deref(self, hfield3));
+	}
+	return Orb_NIL;
+}
+/*continuation for each defer of Orb_defer_any(): the first
+one to finish settles the combined defer with its result
+*/
+static Orb_t any_settle_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	Orb_t self = argv[0];
+	Orb_t df = Orb_deref(self, hfield2);
+	Orb_cell_t cs = Orb_t_as_pointer(Orb_deref(self, hfield3));
+	/*the value slot is Orb_NOTFOUND until someone wins*/
+	Orb_cell_t value = Orb_cell_array_ref(cs, CELL_VALUE);
+	if(!Orb_cell_cas(value, Orb_NOTFOUND, Orb_NIL)) return Orb_NIL;
+	volatile int final = state_finished;
+	Orb_TRY {
+		Orb_cell_set(value, Orb_call0(df));
+	} Orb_CATCH(E) {
+		Orb_cell_set(value, Orb_E_TYPE(E));
+		Orb_cell_set(Orb_cell_array_ref(cs, CELL_ERROR_VALUE),
+			Orb_E_VALUE(E)
+		);
+		final = state_errored;
+	} Orb_ENDTRY;
+	Orb_cell_set(Orb_cell_array_ref(cs, CELL_CHILDREN), Orb_NIL);
+	finish(cs, final);
+	return Orb_NIL;
 }
 
 void Orb_defer_init(void) {
 	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&hfield2);
+	Orb_gc_defglobal(&hfield3);
 	Orb_gc_defglobal(&defer_base);
+	Orb_gc_defglobal(&o_then);
+	Orb_gc_defglobal(&o_all);
+	Orb_gc_defglobal(&o_all_count);
+	Orb_gc_defglobal(&o_any_settle);
 
 	hfield1 = Orb_t_from_pointer(&hfield1);
+	hfield2 = Orb_t_from_pointer(&hfield2);
+	hfield3 = Orb_t_from_pointer(&hfield3);
+	o_then = Orb_t_from_cfunc(&then_f_cfunc);
+	o_all = Orb_t_from_cfunc(&all_f_cfunc);
+	o_all_count = Orb_t_from_cfunc(&all_count_cfunc);
+	o_any_settle = Orb_t_from_cfunc(&any_settle_cfunc);
+	thread_sema = Orb_tls_init();
+	current_defer = Orb_tls_init();
+	Orb_thread_pool_task_hooks(&task_enter, &task_leave);
 	Orb_BUILDER {
 		Orb_B_PARENT(Orb_OBJECT);
 		Orb_B_FIELD_cc("try-run",
@@ -241,43 +527,216 @@ void Orb_defer_init(void) {
 				Orb_t_from_cfunc(&call_cfunc)
 			)
 		);
+		Orb_B_FIELD_cc("wait-for",
+			Orb_method(
+				Orb_t_from_cfunc(&wait_for_cfunc)
+			)
+		);
+		Orb_B_FIELD_cc("then",
+			Orb_method(
+				Orb_t_from_cfunc(&then_cfunc)
+			)
+		);
+		Orb_B_FIELD_cc("on-done",
+			Orb_method(
+				Orb_t_from_cfunc(&on_done_cfunc)
+			)
+		);
 	} defer_base = Orb_ENDBUILDER;
 }
-Orb_t Orb_runonce(Orb_t f) {
-	defer_t state = Orb_gc_malloc(sizeof(defer));
-	state->type = state_idle;
-	state->f = f;
-
-	Orb_cell_t c = Orb_cell_init(Orb_t_from_pointer(state));
+/*make a defer object in the given state*/
+static Orb_t new_defer(int state, Orb_t f, Orb_cell_t* pcs) {
+	Orb_cell_t cs = Orb_cell_array_init(NUM_CELLS, Orb_NIL);
+	Orb_cell_set(Orb_cell_array_ref(cs, CELL_STATE), state_t(state));
+	Orb_cell_set(Orb_cell_array_ref(cs, CELL_VALUE), f);
+	adopt(cs);
 
 	Orb_t rv;
 	Orb_BUILDER {
 		Orb_B_PARENT(defer_base);
-		Orb_B_FIELD(hfield1, Orb_t_from_pointer(c));
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(cs));
 	} rv = Orb_ENDBUILDER;
+	if(pcs) *pcs = cs;
+	return rv;
+}
+Orb_t Orb_runonce(Orb_t f) {
+	return new_defer(state_idle, f, 0);
+}
+/*
+ * Granularity control
+ */
+/*Waking a worker costs far more than calling a function,
+so Orb_defer() only wakes one when it is likely to take the
+task; otherwise the task stays on the calling worker's deque
+until the defer is called, or a thief takes it.  Only
+Orb_defer_hint() and Orb_defer_n() run functions right away,
+as the caller would have when calling the defer.
+*/
+static uint64_t min_grain = Orb_DEFER_MIN_GRAIN;
+
+void Orb_defer_min_grain(uint64_t ns) {
+	min_grain = ns;
+}
+/*a runonce that has already been run inline*/
+static Orb_t defer_inline(Orb_t f) {
+	Orb_cell_t cs;
+	Orb_t rv = new_defer(state_idle, f, &cs);
+	core_try_run(cs);
 	return rv;
 }
 Orb_t Orb_defer(Orb_t f) {
 	/*exactly like runonce, but add to thread-pool*/
 	Orb_t rv = Orb_runonce(f);
 	Orb_t tryrun = Orb_ref_cc(rv, "try-run");
-	Orb_thread_pool_add(tryrun);
+	/*never run it here: the function may have to run
+	concurrently with us, e.g. to feed a channel we read
+	*/
+	if(Orb_thread_pool_hungry() || !Orb_thread_pool_add_local(tryrun)) {
+		Orb_thread_pool_add(tryrun);
+	}
 	return rv;
 }
-
-/*TODO
-1.  Abort for defer objects, which should also abort
-    child defer's built in execution of those objects.
-    Errors that occur while performing a particular
-    defer object should automatically abort child
-    defer objects.
-
-2.  Consider instead use of a defer@ form:
-    (defer@ (@f   (one-expression)
-             @f1  (two-expression))
-      (something-that-might-error @f @f1))
-    '@f and '@f1 are otherwise ordinary defers.
-    If 'something-that-might-error throws, then defer@
-    automatically aborts @f and @f1.
+Orb_t Orb_defer_hint(Orb_t f, uint64_t cost) {
+	if(cost < min_grain) return defer_inline(f);
+	return Orb_defer(f);
+}
+Orb_t Orb_defer_prio(Orb_t f, int prio) {
+	Orb_t rv = Orb_runonce(f);
+	Orb_t tryrun = Orb_ref_cc(rv, "try-run");
+	Orb_thread_pool_add_prio(tryrun, prio);
+	return rv;
+}
+Orb_t Orb_defer_on(Orb_t ex, Orb_t f) {
+	Orb_t rv = Orb_runonce(f);
+	Orb_t tryrun = Orb_ref_cc(rv, "try-run");
+	Orb_executor_add(ex, tryrun);
+	return rv;
+}
+Orb_t Orb_defer_after(Orb_t f, uint64_t delay) {
+	Orb_cell_t cs;
+	Orb_t rv = new_defer(state_idle, f, &cs);
+	Orb_t timer = Orb_timer_add(Orb_ref_cc(rv, "try-run"), delay, 0);
+	Orb_cell_set(Orb_cell_array_ref(cs, CELL_TIMER), timer);
+	/*claimed before it could see the timer*/
+	if(Orb_cell_get(Orb_cell_array_ref(cs, CELL_STATE)) !=
+			state_t(state_idle)) {
+		Orb_timer_cancel(timer);
+	}
+	return rv;
+}
+int Orb_defer_cancel(Orb_t df) {
+	return cancel(Orb_t_as_pointer(Orb_deref(df, hfield1)));
+}
+int Orb_defer_wait_until(Orb_t df, uint64_t deadline) {
+	return core_wait_until(Orb_t_as_pointer(Orb_deref(df, hfield1)),
+		deadline
+	);
+}
+int Orb_defer_wait_for(Orb_t df, uint64_t ns) {
+	return Orb_defer_wait_until(df, Orb_monotonic_ns() + ns);
+}
+int Orb_cancelled(void) {
+	Orb_cell_t cs = Orb_tls_get(current_defer);
+	if(!cs) return 0;
+	return Orb_cell_get(Orb_cell_array_ref(cs, CELL_CANCELLED)) != Orb_NIL;
+}
+void Orb_check_cancelled(void) {
+	if(Orb_cancelled()) Orb_THROW(Orb_symbol_cc("cancel"), Orb_NIL);
+}
+Orb_t Orb_defer_at(Orb_t f) {
+	/*a defer run right here is the scope: an error thrown
+	by f cancels the defers created while it ran
+	*/
+	return Orb_call0(Orb_runonce(f));
+}
+/*number of tasks queued on the pool at a time by
+Orb_defer_n()
 */
+#define DEFER_BATCH 32
+void Orb_defer_n(Orb_t* dfs, Orb_t const* fs, size_t n) {
+	Orb_t tryruns[DEFER_BATCH];
+	size_t i = 0;
+	while(i < n) {
+		size_t k = n - i;
+		if(k > DEFER_BATCH) k = DEFER_BATCH;
+		size_t j;
+		if(!Orb_thread_pool_hungry()) {
+			for(j = 0; j < k; ++j) {
+				dfs[i + j] = defer_inline(fs[i + j]);
+			}
+			i += k;
+			continue;
+		}
+		for(j = 0; j < k; ++j) {
+			dfs[i + j] = Orb_runonce(fs[i + j]);
+			tryruns[j] = Orb_ref_cc(dfs[i + j], "try-run");
+		}
+		/*if any are rejected, callers will run them anyway*/
+		Orb_thread_pool_add_n(tryruns, k);
+		i += k;
+	}
+}
 
+void Orb_defer_on_done(Orb_t df, Orb_t k) {
+	when_done(Orb_t_as_pointer(Orb_deref(df, hfield1)), k);
+}
+Orb_t Orb_defer_then(Orb_t df, Orb_t f) {
+	Orb_t g;
+	Orb_BUILDER {
+		Orb_B_PARENT(o_then);
+		Orb_B_FIELD(hfield2, df);
+		Orb_B_FIELD(hfield3, f);
+	} g = Orb_ENDBUILDER;
+	Orb_t rv = Orb_runonce(g);
+	Orb_defer_on_done(df, Orb_ref_cc(rv, "try-run"));
+	return rv;
+}
+Orb_t Orb_defer_all(Orb_t dfs) {
+	Orb_t g;
+	Orb_BUILDER {
+		Orb_B_PARENT(o_all);
+		Orb_B_FIELD(hfield2, dfs);
+	} g = Orb_ENDBUILDER;
+	Orb_t rv = Orb_runonce(g);
+	Orb_t tryrun = Orb_ref_cc(rv, "try-run");
+	size_t n = seq_len(dfs);
+	if(n == 0) {
+		schedule(tryrun);
+		return rv;
+	}
+	Orb_cell_t remaining = Orb_cell_init(Orb_t_from_integer(n));
+	Orb_t k;
+	Orb_BUILDER {
+		Orb_B_PARENT(o_all_count);
+		Orb_B_FIELD(hfield2, Orb_t_from_pointer(remaining));
+		Orb_B_FIELD(hfield3, tryrun);
+	} k = Orb_ENDBUILDER;
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		Orb_defer_on_done(Orb_nth_o(dfs, Orb_t_from_integer(i)), k);
+	}
+	return rv;
+}
+Orb_t Orb_defer_any(Orb_t dfs) {
+	size_t n = seq_len(dfs);
+	if(n == 0) {
+		Orb_THROW_cc("apply",
+			"Orb_defer_any() needs at least one defer"
+		);
+	}
+	/*nobody runs it: it waits to be settled*/
+	Orb_cell_t cs;
+	Orb_t rv = new_defer(state_running, Orb_NOTFOUND, &cs);
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		Orb_t df = Orb_nth_o(dfs, Orb_t_from_integer(i));
+		Orb_t k;
+		Orb_BUILDER {
+			Orb_B_PARENT(o_any_settle);
+			Orb_B_FIELD(hfield2, df);
+			Orb_B_FIELD(hfield3, Orb_t_from_pointer(cs));
+		} k = Orb_ENDBUILDER;
+		Orb_defer_on_done(df, k);
+	}
+	return rv;
+}
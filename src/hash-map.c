@@ -0,0 +1,522 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"hash-map.h"
+
+#include<string.h>
+
+/*
+hash maps have the following interface:
+(def hash-map-base
+  (obj!extend
+    'get (method:fn (self k (o default)) ...)
+    'put (method:fn (self k v) ... v)
+    ; f is given the current value (or nil) and must be
+    ; pure: it may be called more than once if other
+    ; threads modify the same bucket concurrently
+    'update (method:fn (self k f) ...)
+    ; returns t if the key was present
+    'remove (method:fn (self k) ...)
+    'len (method:fn (self) ...)
+    ; returns a seq of (key value) seqs.  Each bucket is
+    ; read atomically, but the map as a whole is not.
+    'snapshot (method:fn (self) ...)))
+*/
+
+/*
+ * Structure
+ */
+/*Each bucket is a cell holding an immutable chain of
+entries, which writers replace by CAS.
+
+To resize, a new table of twice the size is linked from the
+current one.  Entries of bucket i of the old table go to
+buckets i and i + n of the new table, so a bucket can be
+migrated as a unit: its chain is frozen (so that nobody
+writes to it any more), then split into the two new buckets,
+which were uninitialized until then.  Writers go to the new
+table once it exists, and migrate any uninitialized bucket
+they need first.  Once all buckets are migrated, the new
+table becomes the current table.
+*/
+struct entry_s {
+	struct entry_s const* next;
+	size_t hash;
+	Orb_t key;
+	Orb_t value;
+};
+typedef struct entry_s entry;
+typedef entry const* entry_t;
+
+struct table_s {
+	size_t n; /*number of buckets, a power of 2*/
+	Orb_cell_t buckets;
+	Orb_cell_t next; /*Orb_NIL, or the table we are resizing to*/
+	Orb_cell_t prev; /*Orb_NIL, or the table we are resizing from*/
+};
+typedef struct table_s table;
+typedef table* table_t;
+
+#define N_COUNTERS 16
+#define INITIAL_BUCKETS 16
+
+struct hash_map_s {
+	Orb_cell_t current; /*table_t*/
+	Orb_cell_t counters; /*array of N_COUNTERS*/
+	Orb_t hash; /*Orb_NIL for identity*/
+	Orb_t eq;
+};
+typedef struct hash_map_s hash_map;
+typedef hash_map* hash_map_t;
+
+/*bucket states other than chains*/
+static Orb_t uninit_bucket_v;
+#define UNINIT_BUCKET Orb_t_from_pointer(&uninit_bucket_v)
+/*frozen buckets have an entry with this key at the head,
+followed by the frozen chain
+*/
+static Orb_t frozen_key_v;
+#define FROZEN_KEY Orb_t_from_pointer(&frozen_key_v)
+
+static inline entry_t as_chain(Orb_t b) {
+	return (b == Orb_NIL) ? 0 : Orb_t_as_pointer(b);
+}
+static inline Orb_t from_chain(entry_t e) {
+	return (e == 0) ? Orb_NIL : Orb_t_from_pointer((void*) e);
+}
+static inline int is_frozen(Orb_t b) {
+	return b != Orb_NIL && b != UNINIT_BUCKET &&
+		as_chain(b)->key == FROZEN_KEY;
+}
+
+static table_t table_new(size_t n, Orb_t init) {
+	table_t t = Orb_gc_malloc(sizeof(table));
+	t->n = n;
+	t->buckets = Orb_cell_array_init(n, init);
+	t->next = Orb_cell_init(Orb_NIL);
+	t->prev = Orb_cell_init(Orb_NIL);
+	return t;
+}
+static inline Orb_cell_t bucket(table_t t, size_t hash) {
+	return Orb_cell_array_ref(t->buckets, hash & (t->n - 1));
+}
+
+/*
+ * Hashing
+ */
+static size_t hash_of(hash_map_t m, Orb_t k) {
+	size_t h;
+	if(m->hash == Orb_NIL) {
+		h = (size_t) k;
+	} else {
+		Orb_t oh = Orb_call1(m->hash, k);
+		if(!Orb_t_is_integer(oh)) {
+			Orb_THROW_cc("type", "Hash function must return an integer");
+		}
+		h = (size_t) Orb_t_as_integer(oh);
+	}
+	/*mix, so that the low bits we index with depend on
+	all the bits
+	*/
+	h ^= h >> 16;
+	h *= (size_t) 0x45d9f3bUL;
+	h ^= h >> 16;
+	return h;
+}
+static int key_eq(hash_map_t m, entry_t e, size_t hash, Orb_t k) {
+	if(e->key == k) return 1;
+	if(m->eq == Orb_NIL || e->hash != hash) return 0;
+	return Orb_bool(Orb_call2(m->eq, e->key, k));
+}
+static entry_t chain_find(hash_map_t m, entry_t e, size_t hash, Orb_t k) {
+	for(; e; e = e->next) {
+		if(key_eq(m, e, hash, k)) return e;
+	}
+	return 0;
+}
+
+/*
+ * Migration
+ */
+/*migrate bucket i of t, which is being resized into nt*/
+static void migrate_bucket(table_t t, table_t nt, size_t i) {
+	Orb_cell_t b = Orb_cell_array_ref(t->buckets, i);
+	entry_t chain;
+	entry* frozen = 0;
+	Orb_t ob = Orb_cell_get(b);
+	for(;;) {
+		if(is_frozen(ob)) {
+			chain = as_chain(ob)->next;
+			break;
+		}
+		if(frozen == 0) {
+			frozen = Orb_gc_malloc(sizeof(entry));
+			frozen->key = FROZEN_KEY;
+			frozen->value = Orb_NIL;
+			frozen->hash = 0;
+		}
+		frozen->next = as_chain(ob);
+		Orb_t read = Orb_cell_cas_get(b, ob, from_chain(frozen));
+		if(read == ob) {
+			chain = frozen->next;
+			break;
+		}
+		ob = read;
+	}
+	/*split the frozen chain*/
+	Orb_cell_t lob = Orb_cell_array_ref(nt->buckets, i);
+	Orb_cell_t hib = Orb_cell_array_ref(nt->buckets, i + t->n);
+	if(Orb_cell_get(lob) != UNINIT_BUCKET &&
+			Orb_cell_get(hib) != UNINIT_BUCKET) {
+		return;
+	}
+	entry* lo = 0;
+	entry* hi = 0;
+	entry_t e;
+	for(e = chain; e; e = e->next) {
+		entry* ne = Orb_gc_malloc(sizeof(entry));
+		*ne = *e;
+		if(e->hash & t->n) {
+			ne->next = hi; hi = ne;
+		} else {
+			ne->next = lo; lo = ne;
+		}
+	}
+	Orb_cell_cas(lob, UNINIT_BUCKET, from_chain(lo));
+	Orb_cell_cas(hib, UNINIT_BUCKET, from_chain(hi));
+}
+/*make sure that bucket i of t, which is being resized to,
+is initialized
+*/
+static void ensure_bucket(table_t t, size_t i) {
+	Orb_t oprev = Orb_cell_get(t->prev);
+	if(oprev == Orb_NIL) return;
+	table_t pt = Orb_t_as_pointer(oprev);
+	migrate_bucket(pt, t, i & (pt->n - 1));
+}
+static void finish_resize(hash_map_t m, table_t t, table_t nt) {
+	size_t i;
+	for(i = 0; i < t->n; ++i) {
+		migrate_bucket(t, nt, i);
+	}
+	Orb_cell_cas(m->current, Orb_t_from_pointer(t), Orb_t_from_pointer(nt));
+	Orb_cell_set(nt->prev, Orb_NIL);
+}
+static size_t map_len(hash_map_t m) {
+	size_t i;
+	intptr_t sum = 0;
+	for(i = 0; i < N_COUNTERS; ++i) {
+		sum += Orb_t_as_integer(Orb_cell_get(
+			Orb_cell_array_ref(m->counters, i)
+		));
+	}
+	return (sum < 0) ? 0 : sum;
+}
+/*start resizing t if it is getting full*/
+static void maybe_resize(hash_map_t m, table_t t) {
+	if(Orb_cell_get(m->current) != Orb_t_from_pointer(t)) return;
+	if(Orb_cell_get(t->next) != Orb_NIL) return;
+	if(map_len(m) <= t->n - t->n / 4) return;
+	table_t nt = table_new(t->n * 2, UNINIT_BUCKET);
+	Orb_cell_set(nt->prev, Orb_t_from_pointer(t));
+	if(!Orb_cell_cas(t->next, Orb_NIL, Orb_t_from_pointer(nt))) return;
+	finish_resize(m, t, nt);
+}
+
+/*
+ * Operations
+ */
+static Orb_t map_get(hash_map_t m, Orb_t k, Orb_t dflt) {
+	size_t hash = hash_of(m, k);
+	table_t t = Orb_t_as_pointer(Orb_cell_get(m->current));
+	for(;;) {
+		Orb_t ob = Orb_cell_get(bucket(t, hash));
+		if(ob == UNINIT_BUCKET) {
+			ensure_bucket(t, hash & (t->n - 1));
+			continue;
+		}
+		if(is_frozen(ob)) {
+			t = Orb_t_as_pointer(Orb_cell_get(t->next));
+			continue;
+		}
+		entry_t e = chain_find(m, as_chain(ob), hash, k);
+		return e ? e->value : dflt;
+	}
+}
+
+/*returns chain with the entry for k (if any) replaced by
+an entry for v, or removed if v is Orb_NOTFOUND
+*/
+static entry_t chain_replace(entry_t chain, entry_t old, size_t hash, Orb_t k, Orb_t v) {
+	if(old == 0) {
+		/*new keys go in front*/
+		entry* ne = Orb_gc_malloc(sizeof(entry));
+		ne->next = chain;
+		ne->hash = hash;
+		ne->key = k;
+		ne->value = v;
+		return ne;
+	}
+	entry* rv;
+	entry** tail = &rv;
+	entry_t e;
+	for(e = chain; e && e != old; e = e->next) {
+		entry* ne = Orb_gc_malloc(sizeof(entry));
+		*ne = *e;
+		*tail = ne;
+		tail = (entry**) &ne->next;
+	}
+	entry_t rest = old->next;
+	if(v != Orb_NOTFOUND) {
+		entry* ne = Orb_gc_malloc(sizeof(entry));
+		ne->hash = hash;
+		ne->key = old->key;
+		ne->value = v;
+		*tail = ne;
+		tail = (entry**) &ne->next;
+	}
+	*tail = (entry*) rest;
+	return rv;
+}
+
+/*the table writers should use*/
+static table_t write_table(hash_map_t m) {
+	table_t t = Orb_t_as_pointer(Orb_cell_get(m->current));
+	Orb_t onext = Orb_cell_get(t->next);
+	return (onext == Orb_NIL) ? t : Orb_t_as_pointer(onext);
+}
+
+/*sets k to (f old) if f is not Orb_NIL, otherwise to v.
+A value of Orb_NOTFOUND removes k.  Returns the value set,
+and stores the old value (Orb_NOTFOUND if absent) in *pold.
+*/
+static Orb_t map_modify(hash_map_t m, Orb_t k, Orb_t f, Orb_t v, Orb_t* pold) {
+	size_t hash = hash_of(m, k);
+	table_t t = write_table(m);
+	Orb_backoff b;
+	Orb_backoff_init(&b);
+	for(;;) {
+		Orb_cell_t c = bucket(t, hash);
+		Orb_t ob = Orb_cell_get(c);
+		if(ob == UNINIT_BUCKET) {
+			ensure_bucket(t, hash & (t->n - 1));
+			continue;
+		}
+		if(is_frozen(ob)) {
+			t = write_table(m);
+			continue;
+		}
+		entry_t chain = as_chain(ob);
+		entry_t old = chain_find(m, chain, hash, k);
+		Orb_t oldv = old ? old->value : Orb_NOTFOUND;
+		Orb_t nv = v;
+		if(f != Orb_NIL) {
+			nv = Orb_call1(f, old ? old->value : Orb_NIL);
+		}
+		if(old == 0 && nv == Orb_NOTFOUND) {
+			*pold = oldv;
+			return nv;
+		}
+		entry_t nchain = chain_replace(chain, old, hash, k, nv);
+		if(Orb_cell_cas(c, ob, from_chain(nchain))) {
+			*pold = oldv;
+			int delta = (old == 0) - (nv == Orb_NOTFOUND);
+			if(delta != 0) {
+				Orb_cell_add(Orb_cell_array_ref(m->counters,
+					hash % N_COUNTERS), delta
+				);
+			}
+			/*only check the size on collisions*/
+			if(delta > 0 && chain != 0) maybe_resize(m, t);
+			return nv;
+		}
+		Orb_backoff_wait(&b);
+	}
+}
+
+/*reads bucket i of t, which writers are using.  Returns 0
+and sets *pfrozen if t is being resized.
+*/
+static entry_t read_bucket(table_t t, size_t i, int* pfrozen) {
+	for(;;) {
+		Orb_t ob = Orb_cell_get(Orb_cell_array_ref(t->buckets, i));
+		if(ob == UNINIT_BUCKET) {
+			ensure_bucket(t, i);
+			continue;
+		}
+		*pfrozen = is_frozen(ob);
+		if(*pfrozen) return 0;
+		return as_chain(ob);
+	}
+}
+
+/*
+ * Orb interface
+ */
+static Orb_t hfield1;
+static Orb_t hash_map_base;
+
+static hash_map_t get_map(Orb_t this) {
+	Orb_t om = Orb_deref(this, hfield1);
+	return Orb_t_as_pointer(om);
+}
+
+/*method function for get*/
+static Orb_t get_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3 && *pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to get"
+		);
+	}
+	Orb_t dflt = (*pargc == 4) ? argv[3] : Orb_NIL;
+	return map_get(get_map(argv[1]), argv[2], dflt);
+}
+/*method function for put*/
+static Orb_t put_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to put"
+		);
+	}
+	Orb_t old;
+	return map_modify(get_map(argv[1]), argv[2], Orb_NIL, argv[3], &old);
+}
+/*method function for update*/
+static Orb_t update_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to update"
+		);
+	}
+	Orb_t old;
+	return map_modify(get_map(argv[1]), argv[2], argv[3], Orb_NIL, &old);
+}
+/*method function for remove*/
+static Orb_t remove_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to remove"
+		);
+	}
+	Orb_t old;
+	map_modify(get_map(argv[1]), argv[2], Orb_NIL, Orb_NOTFOUND, &old);
+	return (old != Orb_NOTFOUND) ? Orb_TRUE : Orb_NIL;
+}
+/*method function for len*/
+static Orb_t len_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to len"
+		);
+	}
+	return Orb_t_from_integer(map_len(get_map(argv[1])));
+}
+/*method function for snapshot*/
+static Orb_t snapshot_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to snapshot"
+		);
+	}
+	hash_map_t m = get_map(argv[1]);
+	size_t cap = map_len(m) + 8;
+	size_t n = 0;
+	Orb_t* arr = Orb_gc_malloc(cap * sizeof(Orb_t));
+	table_t t = write_table(m);
+	size_t i;
+	for(i = 0; i < t->n; ++i) {
+		int frozen;
+		entry_t e = read_bucket(t, i, &frozen);
+		if(frozen) {
+			/*a resize started: start over in the new table*/
+			t = write_table(m);
+			n = 0;
+			i = (size_t) -1;
+			continue;
+		}
+		for(; e; e = e->next) {
+			if(n == cap) {
+				Orb_t* narr = Orb_gc_malloc(2 * cap * sizeof(Orb_t));
+				memcpy(narr, arr, n * sizeof(Orb_t));
+				Orb_gc_free(arr);
+				arr = narr;
+				cap = 2 * cap;
+			}
+			Orb_t kv[2];
+			kv[0] = e->key;
+			kv[1] = e->value;
+			arr[n++] = Orb_seq(kv, 2);
+		}
+	}
+	Orb_t rv = Orb_seq(arr, n);
+	Orb_gc_free(arr);
+	return rv;
+}
+
+void Orb_hash_map_init(void) {
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&hash_map_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("get",
+			Orb_method(Orb_t_from_cfunc(&get_cfunc))
+		);
+		Orb_B_FIELD_cc("put",
+			Orb_method(Orb_t_from_cfunc(&put_cfunc))
+		);
+		Orb_B_FIELD_cc("update",
+			Orb_method(Orb_t_from_cfunc(&update_cfunc))
+		);
+		Orb_B_FIELD_cc("remove",
+			Orb_method(Orb_t_from_cfunc(&remove_cfunc))
+		);
+		Orb_B_FIELD_cc("len",
+			Orb_method(Orb_t_from_cfunc(&len_cfunc))
+		);
+		Orb_B_FIELD_cc("snapshot",
+			Orb_method(Orb_t_from_cfunc(&snapshot_cfunc))
+		);
+	} hash_map_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_new_hash_map(Orb_t hash, Orb_t eq) {
+	if((hash == Orb_NIL) != (eq == Orb_NIL)) {
+		Orb_THROW_cc("apply",
+			"Hash maps need both a hash and an equality function, or neither"
+		);
+	}
+	hash_map_t m = Orb_gc_malloc(sizeof(hash_map));
+	m->current = Orb_cell_init(Orb_t_from_pointer(
+		table_new(INITIAL_BUCKETS, Orb_NIL)
+	));
+	m->counters = Orb_cell_array_init(N_COUNTERS, Orb_t_from_integer(0));
+	m->hash = hash;
+	m->eq = eq;
+
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(hash_map_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(m));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
@@ -25,6 +25,13 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 #include"c-functions.h"
 #include"bool.h"
 #include"defer.h"
+#include"atom.h"
+#include"stm.h"
+#include"channel.h"
+#include"sync.h"
+#include"versioned.h"
+#include"hash-map.h"
+#include"timer.h"
 #include"seq.h"
 
 void Orb_post_gc_init(int argc, char* argv[]) {
@@ -35,8 +42,16 @@ void Orb_post_gc_init(int argc, char* argv[]) {
 	Orb_object_init_after_symbol();
 	Orb_c_functions_init();
 	Orb_bool_init();
+	Orb_thread_objects_init();
 	Orb_thread_pool_init();
 	Orb_defer_init();
+	Orb_atom_init();
+	Orb_stm_init();
+	Orb_channel_init();
+	Orb_sync_init();
+	Orb_versioned_init();
+	Orb_hash_map_init();
+	Orb_timer_init();
 	Orb_seq_init();
 }
 
@@ -56,19 +56,20 @@ static Orb_t map_arr_core(Orb_t narr[],
 	size_t i;
 	/*prepare base*/
 	Orb_t base;
+	/*no point starting more work for a cancelled map*/
+	Orb_check_cancelled();
 	Orb_BUILDER {
 		Orb_B_PARENT(o_apply_fi);
 		Orb_B_FIELD(hfield1, f);
 	} base = Orb_ENDBUILDER;
 	/*perform deferrals in forward order*/
 	for(i = 0; i < sz; ++i) {
-		Orb_t f0;
 		Orb_BUILDER {
 			Orb_B_PARENT(base);
 			Orb_B_FIELD(hfield2, arr[start + i]);
-		} f0 = Orb_ENDBUILDER;
-		narr[i] = Orb_defer(f0);
+		} narr[i] = Orb_ENDBUILDER;
 	}
+	Orb_defer_n(narr, narr, sz);
 	/*now commit defers in reverse order*/
 	for(i = sz; i != 0; --i) {
 		narr[i - 1] = Orb_call0(narr[i - 1]);
@@ -131,6 +132,7 @@ static Orb_t map_core(Orb_t s, Orb_t f) {
 
 	while(flag) {
 		Orb_t const* arr; size_t start, sz;
+		Orb_check_cancelled();
 		if(Orb_array_backed(s, &arr, &start, &sz)) {
 			finalresult = map_arr(arr, start, sz, f);
 			flag = 0;
@@ -205,7 +207,16 @@ Orb_t Orb_map_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
 	Orb_t s = argv[1];
 	Orb_t f = argv[2];
 
-	return map_core(s, f);
+	/*map in a defer@ scope, so that if mapping one element
+	throws, the defers for the other elements are cancelled
+	*/
+	Orb_t sf;
+	Orb_BUILDER {
+		Orb_B_PARENT(o_map_core_sf);
+		Orb_B_FIELD(hfield1, f);
+		Orb_B_FIELD(hfield2, s);
+	} sf = Orb_ENDBUILDER;
+	return Orb_defer_at(sf);
 }
 
 void Orb_map_init(void) {
@@ -0,0 +1,467 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"stm.h"
+
+#include<stdlib.h>
+#include<string.h>
+
+/*
+Transactions keep a read set (the stripes of the cells read)
+and a write set (each cell written, and the value to be
+written).  Nothing is written to the cells until the
+transaction commits.
+
+Cells are hashed onto a fixed array of stripes, each with a
+versioned lock: a ticket that is even while the stripe is
+unlocked, and one more than that while a commit holds it.
+A global clock, also a ticket, gives each commit its write
+version, and each transaction records the clock when it
+starts (its read version).
+
+Reads check the stripe version, then read the cell, then
+check the version again.  If the stripe was unlocked and
+unchanged, and is no newer than the read version, the value
+is consistent with every earlier read.  Otherwise the read
+version moves up to the current clock, provided no stripe
+already read has changed, so that a transaction never sees
+an inconsistent view (which could make the transaction
+function loop or throw before it can be retried).
+
+Commits lock the stripes of the write set in stripe order,
+so that commits cannot deadlock, take a write version from
+the clock, check that no stripe read has changed since the
+read version, perform the writes, and then release the
+stripes with the write version.  Disjoint commits only
+share the clock.
+*/
+
+#define N_STRIPES 1024
+#define STRIPE_WORDS (N_STRIPES / 64)
+static Orb_cell_t stripes;
+
+static Orb_cell_t commit_clock;
+
+static Orb_tls_t current_tx;
+
+static Orb_t retry_type;
+
+struct entry_s {
+	Orb_cell_t cell;
+	Orb_t value;
+};
+typedef struct entry_s entry;
+
+/*entries in the order they were added, with an open
+addressing table of their indices plus one, keyed by cell
+*/
+struct entries_s {
+	entry* arr;
+	size_t size;
+	size_t capacity;
+	size_t* index;
+	size_t mask;
+};
+typedef struct entries_s entries;
+
+struct Orb_stm_s {
+	/*bitmap of the stripes read*/
+	uint64_t reads[STRIPE_WORDS];
+	size_t num_reads;
+	entries writes;
+	/*clock value the reads are known to be consistent
+	with
+	*/
+	Orb_ticket_t version;
+	/*0 once the transaction is over*/
+	int active;
+};
+
+static size_t hash_cell(Orb_cell_t c) {
+	size_t i = (size_t) c;
+	i = i >> 4;
+	return i * 2654435761u;
+}
+
+static void entries_init(entries* es) {
+	es->arr = 0;
+	es->size = 0;
+	es->capacity = 0;
+	es->index = 0;
+	es->mask = 0;
+}
+static entry* entries_find(entries* es, Orb_cell_t c) {
+	if(es->size == 0) return 0;
+	size_t i = hash_cell(c);
+	for(;; ++i) {
+		size_t k = es->index[i & es->mask];
+		if(k == 0) return 0;
+		if(es->arr[k - 1].cell == c) return &es->arr[k - 1];
+	}
+}
+static void entries_reindex(entries* es, size_t n) {
+	Orb_gc_free(es->index);
+	es->index = Orb_gc_malloc_pointerfree(n * sizeof(size_t));
+	memset(es->index, 0, n * sizeof(size_t));
+	es->mask = n - 1;
+	size_t k;
+	for(k = 0; k < es->size; ++k) {
+		size_t i = hash_cell(es->arr[k].cell);
+		while(es->index[i & es->mask] != 0) ++i;
+		es->index[i & es->mask] = k + 1;
+	}
+}
+/*c must not already be in es*/
+static void entries_add(entries* es, Orb_cell_t c, Orb_t v) {
+	if(es->size == es->capacity) {
+		size_t nc = es->capacity + es->capacity / 2;
+		if(nc < 4) nc = 4;
+		entry* narr = Orb_gc_malloc(nc * sizeof(entry));
+		memcpy(narr, es->arr, es->size * sizeof(entry));
+		Orb_gc_free(es->arr);
+		es->arr = narr;
+		es->capacity = nc;
+	}
+	es->arr[es->size].cell = c;
+	es->arr[es->size].value = v;
+	++es->size;
+	/*keep the table at most half full*/
+	if(es->size * 2 > es->mask) {
+		size_t n = es->mask ? (es->mask + 1) * 2 : 8;
+		entries_reindex(es, n);
+	} else {
+		size_t i = hash_cell(c);
+		while(es->index[i & es->mask] != 0) ++i;
+		es->index[i & es->mask] = es->size;
+	}
+}
+
+static size_t stripe_of(Orb_cell_t c) {
+	size_t i = (size_t) c;
+	i = i >> 4;
+	return i % N_STRIPES;
+}
+static Orb_ticket_t stripe_version(size_t s) {
+	return Orb_ticket_from_t(
+		Orb_cell_get(Orb_cell_array_ref(stripes, s))
+	);
+}
+static int is_locked(Orb_ticket_t v) {
+	return v & 1;
+}
+static int in_set(uint64_t const* set, size_t s) {
+	return (set[s / 64] >> (s % 64)) & 1;
+}
+static void add_to_set(uint64_t* set, size_t s) {
+	set[s / 64] |= ((uint64_t) 1) << (s % 64);
+}
+
+/*throws to the retry loop in Orb_stm_atomically()*/
+static void retry(void) {
+	Orb_THROW(retry_type, Orb_NIL);
+}
+
+/*returns non-0 if no stripe in the read set has changed
+since the read version, skipping the stripes in skip
+*/
+static int reads_valid(Orb_stm_t tx, uint64_t const* skip) {
+	if(tx->num_reads == 0) return 1;
+	size_t w, b;
+	for(w = 0; w < STRIPE_WORDS; ++w) {
+		uint64_t word = tx->reads[w];
+		if(skip) word &= ~skip[w];
+		for(b = 0; word != 0; ++b, word >>= 1) {
+			if(!(word & 1)) continue;
+			Orb_ticket_t v = stripe_version(w * 64 + b);
+			if(is_locked(v) || Orb_ticket_diff(v, tx->version) > 0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+Orb_t Orb_stm_read(Orb_stm_t tx, Orb_cell_t c) {
+	if(!tx->active) {
+		Orb_THROW_cc("stm", "Transaction is no longer active");
+	}
+	entry* e = entries_find(&tx->writes, c);
+	if(e) return e->value;
+
+	size_t s = stripe_of(c);
+	Orb_backoff b;
+	Orb_backoff_init(&b);
+	for(;;) {
+		Orb_ticket_t before = stripe_version(s);
+		if(is_locked(before)) {
+			/*a commit is writing this stripe*/
+			Orb_backoff_wait(&b);
+			continue;
+		}
+		Orb_t v = Orb_cell_get(c);
+		if(stripe_version(s) != before) continue;
+		if(Orb_ticket_diff(before, tx->version) > 0) {
+			/*the stripe changed after our earlier reads:
+			move them forward to now, if they are
+			still current
+			*/
+			Orb_ticket_t now = Orb_ticket_from_t(
+				Orb_cell_get(commit_clock)
+			);
+			if(!reads_valid(tx, 0)) retry();
+			tx->version = now;
+			continue;
+		}
+		if(!in_set(tx->reads, s)) {
+			add_to_set(tx->reads, s);
+			++tx->num_reads;
+		}
+		return v;
+	}
+}
+
+void Orb_stm_write(Orb_stm_t tx, Orb_cell_t c, Orb_t v) {
+	if(!tx->active) {
+		Orb_THROW_cc("stm", "Transaction is no longer active");
+	}
+	entry* e = entries_find(&tx->writes, c);
+	if(e) {
+		e->value = v;
+	} else {
+		entries_add(&tx->writes, c, v);
+	}
+}
+
+/*releases the locked stripes in locks, setting them to the
+given version, or back to their old version if v is 0
+*/
+static void release(uint64_t const* locks, Orb_ticket_t v) {
+	size_t w, b;
+	for(w = 0; w < STRIPE_WORDS; ++w) {
+		uint64_t word = locks[w];
+		for(b = 0; word != 0; ++b, word >>= 1) {
+			if(!(word & 1)) continue;
+			Orb_cell_t sc = Orb_cell_array_ref(stripes, w * 64 + b);
+			Orb_ticket_t nv = v ? v : stripe_version(w * 64 + b) - 1;
+			Orb_cell_set(sc, Orb_t_from_ticket(nv));
+		}
+	}
+}
+
+/*returns non-0 if the commit succeeded*/
+static int commit(Orb_stm_t tx) {
+	/*read-only transactions were validated at each read*/
+	if(tx->writes.size == 0) return 1;
+
+	uint64_t want[STRIPE_WORDS];
+	uint64_t locks[STRIPE_WORDS];
+	memset(want, 0, sizeof(want));
+	memset(locks, 0, sizeof(locks));
+	size_t i;
+	for(i = 0; i < tx->writes.size; ++i) {
+		add_to_set(want, stripe_of(tx->writes.arr[i].cell));
+	}
+
+	/*lock in stripe order*/
+	size_t s;
+	for(s = 0; s < N_STRIPES; ++s) {
+		if(!in_set(want, s)) continue;
+		Orb_cell_t sc = Orb_cell_array_ref(stripes, s);
+		Orb_backoff b;
+		Orb_backoff_init(&b);
+		for(;;) {
+			Orb_ticket_t v = stripe_version(s);
+			if(!is_locked(v) && Orb_cell_cas(sc,
+					Orb_t_from_ticket(v),
+					Orb_t_from_ticket(v + 1))) {
+				add_to_set(locks, s);
+				if(in_set(tx->reads, s) &&
+						Orb_ticket_diff(v, tx->version) > 0) {
+					/*changed since we read it*/
+					release(locks, 0);
+					return 0;
+				}
+				break;
+			}
+			Orb_backoff_wait(&b);
+		}
+	}
+
+	Orb_ticket_t wv = Orb_cell_ticket_add(commit_clock, 2);
+	/*if no commit came between, nothing we read changed*/
+	if(wv != tx->version + 2 && !reads_valid(tx, locks)) {
+		release(locks, 0);
+		return 0;
+	}
+	for(i = 0; i < tx->writes.size; ++i) {
+		entry* e = &tx->writes.arr[i];
+		Orb_cell_set(e->cell, e->value);
+	}
+	release(locks, wv);
+	return 1;
+}
+
+Orb_t Orb_stm_atomically(Orb_stm_f* f, void* clos) {
+	Orb_stm_t outer = Orb_tls_get(current_tx);
+	if(outer) {
+		/*nested transactions are part of the outer one*/
+		return f(outer, clos);
+	}
+
+	Orb_backoff b;
+	Orb_backoff_init(&b);
+	for(;;) {
+		Orb_stm_t tx = Orb_gc_malloc(sizeof(struct Orb_stm_s));
+		memset(tx->reads, 0, sizeof(tx->reads));
+		tx->num_reads = 0;
+		entries_init(&tx->writes);
+		tx->version = Orb_ticket_from_t(Orb_cell_get(commit_clock));
+		tx->active = 1;
+
+		Orb_t volatile rv;
+		int volatile done = 0;
+		Orb_tls_set(current_tx, tx);
+		Orb_TRY {
+			rv = f(tx, clos);
+			done = commit(tx);
+			tx->active = 0;
+			Orb_tls_set(current_tx, 0);
+		} Orb_CATCH(E) {
+			tx->active = 0;
+			Orb_tls_set(current_tx, 0);
+			if(Orb_E_TYPE(E) != retry_type) {
+				Orb_E_RETHROW(E);
+			}
+		} Orb_ENDTRY;
+		if(done) return rv;
+		Orb_backoff_wait(&b);
+	}
+}
+
+/*
+ * Orb-level interface
+ */
+/*
+(def tvar-base
+  (obj!extend
+    'get (method:fn (self) value-outside-transaction)))
+(def tx-base
+  (obj!extend
+    'read (method:fn (self tvar) value-in-transaction)
+    'write (method:fn (self tvar v) (set value-in-transaction v))))
+(atomically (fn (tx) ...))
+*/
+static Orb_t hfield1;
+static Orb_t tvar_base;
+static Orb_t tx_base;
+
+static Orb_cell_t get_tvar(Orb_t tvar) {
+	Orb_t oc = Orb_deref(tvar, hfield1);
+	if(!Orb_t_is_pointer(oc) || Orb_ref_cc(tvar, "**is-tvar**") != Orb_TRUE) {
+		Orb_THROW_cc("stm", "Expected a tvar");
+	}
+	return Orb_t_as_pointer(oc);
+}
+
+/*method function for tvar get*/
+static Orb_t tvar_get_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to get"
+		);
+	}
+	return Orb_cell_get(get_tvar(argv[1]));
+}
+/*method function for tx read*/
+static Orb_t tx_read_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to read"
+		);
+	}
+	Orb_stm_t tx = Orb_t_as_pointer(Orb_deref(argv[1], hfield1));
+	return Orb_stm_read(tx, get_tvar(argv[2]));
+}
+/*method function for tx write*/
+static Orb_t tx_write_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to write"
+		);
+	}
+	Orb_stm_t tx = Orb_t_as_pointer(Orb_deref(argv[1], hfield1));
+	Orb_stm_write(tx, get_tvar(argv[2]), argv[3]);
+	return argv[3];
+}
+
+static Orb_t call_with_tx(Orb_stm_t tx, void* vpf) {
+	Orb_t otx;
+	Orb_BUILDER {
+		Orb_B_PARENT(tx_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(tx));
+	} otx = Orb_ENDBUILDER;
+	return Orb_call1(*(Orb_t*) vpf, otx);
+}
+
+Orb_t Orb_atomically(Orb_t f) {
+	return Orb_stm_atomically(&call_with_tx, &f);
+}
+
+Orb_t Orb_new_tvar(Orb_t init) {
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(tvar_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(Orb_cell_init(init)));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+
+void Orb_stm_init(void) {
+	Orb_gc_defglobal((Orb_t*) &stripes);
+	Orb_gc_defglobal((Orb_t*) &commit_clock);
+	Orb_gc_defglobal(&retry_type);
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&tvar_base);
+	Orb_gc_defglobal(&tx_base);
+
+	stripes = Orb_cell_array_init(N_STRIPES, Orb_t_from_ticket(0));
+	commit_clock = Orb_cell_init(Orb_t_from_ticket(0));
+	current_tx = Orb_tls_init();
+	retry_type = Orb_symbol_cc("**stm-retry**");
+	hfield1 = Orb_t_from_pointer(&hfield1);
+
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("**is-tvar**", Orb_TRUE);
+		Orb_B_FIELD_cc("get",
+			Orb_method(Orb_t_from_cfunc(&tvar_get_cfunc))
+		);
+	} tvar_base = Orb_ENDBUILDER;
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("read",
+			Orb_method(Orb_t_from_cfunc(&tx_read_cfunc))
+		);
+		Orb_B_FIELD_cc("write",
+			Orb_method(Orb_t_from_cfunc(&tx_write_cfunc))
+		);
+	} tx_base = Orb_ENDBUILDER;
+}
@@ -0,0 +1,375 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"thread-pool.h"
+#include"sync.h"
+
+/*
+(def latch-base
+  (obj!extend
+    'count-down (method:fn (self) ...)
+    'wait (method:fn (self) ...)
+    'count (method:fn (self) ...)))
+(def barrier-base
+  (obj!extend
+    'wait (method:fn (self) cycle-completed)))
+(def phaser-base
+  (obj!extend
+    'register (method:fn (self) phase)
+    'arrive (method:fn (self) phase)
+    'arrive-and-deregister (method:fn (self) phase)
+    'arrive-and-wait (method:fn (self) phase)
+    'wait-advance (method:fn (self phase) new-phase)
+    'phase (method:fn (self) phase)))
+*/
+
+/*
+ * Phase state
+ */
+/*Latches, barriers and phasers are all built on a cell
+holding an immutable phase state.  When the last party
+arrives, the phase advances and waiters are woken up.  A
+latch is a phaser with no registered parties, whose initial
+number of unarrived parties is its count; once it advances
+there is nobody left to arrive.
+*/
+struct sync_state_s {
+	size_t phase;
+	size_t parties;
+	size_t unarrived;
+	/*threads sleeping on sema until the phase advances*/
+	size_t waiters;
+	Orb_sema_t sema;
+};
+typedef struct sync_state_s sync_state;
+typedef sync_state const* sync_state_t;
+
+static Orb_cell_t sync_cell_init(size_t phase, size_t parties, size_t unarrived) {
+	sync_state* st = Orb_gc_malloc(sizeof(sync_state));
+	st->phase = phase;
+	st->parties = parties;
+	st->unarrived = unarrived;
+	st->waiters = 0;
+	st->sema = 0;
+	return Orb_cell_init(Orb_t_from_pointer(st));
+}
+static sync_state_t sync_get(Orb_cell_t c) {
+	return Orb_t_as_pointer(Orb_cell_get(c));
+}
+
+/*arrive at the current phase, optionally deregistering.
+Returns the phase arrived at.  If there is nobody left to
+arrive, does nothing if ok_if_none, or throws otherwise.
+*/
+static size_t sync_arrive(Orb_cell_t c, int deregister, int ok_if_none) {
+	sync_state* nv = Orb_gc_malloc(sizeof(sync_state));
+	Orb_t ostate = Orb_cell_get(c);
+	sync_state_t st;
+	for(;;) {
+		st = Orb_t_as_pointer(ostate);
+		if(st->unarrived == 0) {
+			if(ok_if_none) return st->phase;
+			Orb_THROW_cc("sync", "No unarrived parties");
+		}
+		*nv = *st;
+		--nv->unarrived;
+		if(deregister) --nv->parties;
+		if(nv->unarrived == 0) {
+			++nv->phase;
+			nv->unarrived = nv->parties;
+			nv->waiters = 0;
+			nv->sema = 0;
+		}
+		Orb_t read = Orb_cell_cas_get(c, ostate, Orb_t_from_pointer(nv));
+		if(read == ostate) break;
+		ostate = read;
+	}
+	/*wake up waiters if we advanced*/
+	if(nv->phase != st->phase) {
+		size_t i;
+		for(i = 0; i < st->waiters; ++i) {
+			Orb_sema_post(st->sema);
+		}
+	}
+	return st->phase;
+}
+static size_t sync_register(Orb_cell_t c) {
+	sync_state* nv = Orb_gc_malloc(sizeof(sync_state));
+	Orb_t ostate = Orb_cell_get(c);
+	for(;;) {
+		sync_state_t st = Orb_t_as_pointer(ostate);
+		*nv = *st;
+		++nv->parties;
+		++nv->unarrived;
+		Orb_t read = Orb_cell_cas_get(c, ostate, Orb_t_from_pointer(nv));
+		if(read == ostate) return st->phase;
+		ostate = read;
+	}
+}
+/*waits until the phase is no longer the given phase.  If
+help is non-0, runs pool tasks in the meantime.
+
+Only latches help.  A barrier or phaser waiter that helps
+could run a task which is another party of the same barrier:
+the task would arrive, complete the phase, and then wait in
+the next phase for the arrival of the very thread it is
+running on.
+*/
+static size_t sync_wait(Orb_cell_t c, size_t phase, int help) {
+	sync_state* nv = 0;
+	Orb_t ostate = Orb_cell_get(c);
+	for(;;) {
+		sync_state_t st = Orb_t_as_pointer(ostate);
+		if(st->phase != phase) return st->phase;
+		if(help && Orb_thread_pool_help()) {
+			ostate = Orb_cell_get(c);
+			continue;
+		}
+		/*nothing to help with: sleep*/
+		if(nv == 0) nv = Orb_gc_malloc(sizeof(sync_state));
+		*nv = *st;
+		++nv->waiters;
+		if(nv->sema == 0) nv->sema = Orb_sema_init(0);
+		Orb_t read = Orb_cell_cas_get(c, ostate, Orb_t_from_pointer(nv));
+		if(read == ostate) {
+			Orb_sema_wait(nv->sema);
+			nv = 0;
+			ostate = Orb_cell_get(c);
+		} else ostate = read;
+	}
+}
+
+/*
+ * C interface
+ */
+struct Orb_latch_s {
+	Orb_cell_t state;
+};
+struct Orb_barrier_s {
+	Orb_cell_t state;
+};
+struct Orb_phaser_s {
+	Orb_cell_t state;
+};
+
+Orb_latch_t Orb_latch_init(size_t count) {
+	Orb_latch_t rv = Orb_gc_malloc(sizeof(struct Orb_latch_s));
+	/*a latch with a count of 0 starts out open*/
+	rv->state = sync_cell_init(count == 0 ? 1 : 0, 0, count);
+	return rv;
+}
+void Orb_latch_count_down(Orb_latch_t l) {
+	sync_arrive(l->state, 0, 1);
+}
+void Orb_latch_wait(Orb_latch_t l) {
+	sync_wait(l->state, 0, 1);
+}
+size_t Orb_latch_count(Orb_latch_t l) {
+	return sync_get(l->state)->unarrived;
+}
+
+Orb_barrier_t Orb_barrier_init(size_t parties) {
+	if(parties == 0) {
+		Orb_THROW_cc("sync", "Barrier must have at least one party");
+	}
+	Orb_barrier_t rv = Orb_gc_malloc(sizeof(struct Orb_barrier_s));
+	rv->state = sync_cell_init(0, parties, parties);
+	return rv;
+}
+size_t Orb_barrier_wait(Orb_barrier_t b) {
+	size_t phase = sync_arrive(b->state, 0, 0);
+	sync_wait(b->state, phase, 0);
+	return phase;
+}
+
+Orb_phaser_t Orb_phaser_init(size_t parties) {
+	Orb_phaser_t rv = Orb_gc_malloc(sizeof(struct Orb_phaser_s));
+	rv->state = sync_cell_init(0, parties, parties);
+	return rv;
+}
+size_t Orb_phaser_register(Orb_phaser_t p) {
+	return sync_register(p->state);
+}
+size_t Orb_phaser_arrive(Orb_phaser_t p) {
+	return sync_arrive(p->state, 0, 0);
+}
+size_t Orb_phaser_arrive_and_deregister(Orb_phaser_t p) {
+	return sync_arrive(p->state, 1, 0);
+}
+size_t Orb_phaser_arrive_and_wait(Orb_phaser_t p) {
+	size_t phase = sync_arrive(p->state, 0, 0);
+	return sync_wait(p->state, phase, 0);
+}
+size_t Orb_phaser_wait_advance(Orb_phaser_t p, size_t phase) {
+	return sync_wait(p->state, phase, 0);
+}
+size_t Orb_phaser_phase(Orb_phaser_t p) {
+	return sync_get(p->state)->phase;
+}
+
+/*
+ * Orb interface
+ */
+static Orb_t hfield1;
+static Orb_t latch_base;
+static Orb_t barrier_base;
+static Orb_t phaser_base;
+
+static void* get_this(Orb_t this) {
+	return Orb_t_as_pointer(Orb_deref(this, hfield1));
+}
+static void check_argc(size_t* pargc, size_t n, char const* msg) {
+	if(*pargc != n) {
+		Orb_THROW_cc("apply", msg);
+	}
+}
+
+/*method function for latch count-down*/
+static Orb_t count_down_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to count-down");
+	Orb_latch_count_down(get_this(argv[1]));
+	return Orb_NIL;
+}
+/*method function for latch wait*/
+static Orb_t latch_wait_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to wait");
+	Orb_latch_wait(get_this(argv[1]));
+	return Orb_NIL;
+}
+/*method function for latch count*/
+static Orb_t count_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to count");
+	return Orb_t_from_integer(Orb_latch_count(get_this(argv[1])));
+}
+/*method function for barrier wait*/
+static Orb_t barrier_wait_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to wait");
+	return Orb_t_from_integer(Orb_barrier_wait(get_this(argv[1])));
+}
+/*method function for phaser register*/
+static Orb_t register_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to register");
+	return Orb_t_from_integer(Orb_phaser_register(get_this(argv[1])));
+}
+/*method function for phaser arrive*/
+static Orb_t arrive_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to arrive");
+	return Orb_t_from_integer(Orb_phaser_arrive(get_this(argv[1])));
+}
+/*method function for phaser arrive-and-deregister*/
+static Orb_t arrive_and_deregister_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2,
+		"Incorrect number of arguments to arrive-and-deregister"
+	);
+	return Orb_t_from_integer(
+		Orb_phaser_arrive_and_deregister(get_this(argv[1]))
+	);
+}
+/*method function for phaser arrive-and-wait*/
+static Orb_t arrive_and_wait_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2,
+		"Incorrect number of arguments to arrive-and-wait"
+	);
+	return Orb_t_from_integer(
+		Orb_phaser_arrive_and_wait(get_this(argv[1]))
+	);
+}
+/*method function for phaser wait-advance*/
+static Orb_t wait_advance_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 3, "Incorrect number of arguments to wait-advance");
+	if(!Orb_t_is_integer(argv[2])) {
+		Orb_THROW_cc("type", "Expected an integer phase");
+	}
+	return Orb_t_from_integer(Orb_phaser_wait_advance(
+		get_this(argv[1]), Orb_t_as_integer(argv[2])
+	));
+}
+/*method function for phaser phase*/
+static Orb_t phase_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	check_argc(pargc, 2, "Incorrect number of arguments to phase");
+	return Orb_t_from_integer(Orb_phaser_phase(get_this(argv[1])));
+}
+
+static Orb_t wrap(Orb_t base, void* p) {
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(p));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+Orb_t Orb_new_latch(size_t count) {
+	return wrap(latch_base, Orb_latch_init(count));
+}
+Orb_t Orb_new_barrier(size_t parties) {
+	return wrap(barrier_base, Orb_barrier_init(parties));
+}
+Orb_t Orb_new_phaser(size_t parties) {
+	return wrap(phaser_base, Orb_phaser_init(parties));
+}
+
+void Orb_sync_init(void) {
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&latch_base);
+	Orb_gc_defglobal(&barrier_base);
+	Orb_gc_defglobal(&phaser_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("count-down",
+			Orb_method(Orb_t_from_cfunc(&count_down_cfunc))
+		);
+		Orb_B_FIELD_cc("wait",
+			Orb_method(Orb_t_from_cfunc(&latch_wait_cfunc))
+		);
+		Orb_B_FIELD_cc("count",
+			Orb_method(Orb_t_from_cfunc(&count_cfunc))
+		);
+	} latch_base = Orb_ENDBUILDER;
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("wait",
+			Orb_method(Orb_t_from_cfunc(&barrier_wait_cfunc))
+		);
+	} barrier_base = Orb_ENDBUILDER;
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("register",
+			Orb_method(Orb_t_from_cfunc(&register_cfunc))
+		);
+		Orb_B_FIELD_cc("arrive",
+			Orb_method(Orb_t_from_cfunc(&arrive_cfunc))
+		);
+		Orb_B_FIELD_cc("arrive-and-deregister",
+			Orb_method(Orb_t_from_cfunc(&arrive_and_deregister_cfunc))
+		);
+		Orb_B_FIELD_cc("arrive-and-wait",
+			Orb_method(Orb_t_from_cfunc(&arrive_and_wait_cfunc))
+		);
+		Orb_B_FIELD_cc("wait-advance",
+			Orb_method(Orb_t_from_cfunc(&wait_advance_cfunc))
+		);
+		Orb_B_FIELD_cc("phase",
+			Orb_method(Orb_t_from_cfunc(&phase_cfunc))
+		);
+	} phaser_base = Orb_ENDBUILDER;
+}
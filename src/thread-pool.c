@@ -19,142 +19,1309 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 #include"liborb.h"
 #include"thread-pool.h"
 #include"thread-support.h"
+#include"timer.h"
 
-static Orb_cell_t state;
-static Orb_sema_t wait_sema;
+#include<limits.h>
+#include<string.h>
 
 /*
- * Immutable queue
+ * Executors
  */
-struct list_s {
-	Orb_t val;
-	struct list_s const* next;
+/*An executor is a pool of workers with its own queues.  The
+pool itself is only started when the first task is queued,
+and can be shut down and started again, so the executor
+keeps the settings for the next pool.
+*/
+struct executor_s {
+	Orb_t name;
+	/*Orb_NOTFOUND until the pool is started, then a pool_t*/
+	Orb_cell_t pool;
+	/*stack size for new workers, see Orb_priv_new_thread_ex()*/
+	size_t stack_size;
+	/*Orb_POOL_* flags for new workers*/
+	int placement;
+	/*requested number of workers, 0 if not specified*/
+	size_t requested_size;
+	/*capacity of each injection queue*/
+	size_t inject_capacity;
+	/*Orb_POOL_BLOCK, Orb_POOL_RUN_INLINE or Orb_POOL_REJECT*/
+	int overflow_policy;
+	/*most times an idle worker polls for tasks before it
+	parks, or SPIN_AUTO
+	*/
+	size_t max_spin;
 };
-typedef struct list_s list;
-typedef list const* list_t;
+typedef struct executor_s executor;
+typedef executor* executor_t;
 
-struct queue_s {
-	list_t insert_to;
-	list_t remove_from;
+/*the executor behind the Orb_thread_pool_* functions*/
+static executor_t default_executor;
+static Orb_t odefault_executor;
+/*immutable list of executors, for the fork hooks*/
+struct executors_s {
+	size_t n;
+	executor_t e[1];
 };
-typedef struct queue_s queue;
-typedef queue const* queue_t;
+typedef struct executors_s executors;
+typedef executors const* executors_t;
+/*the executors whose pools are running.  Executors are only
+listed while running, so that the list does not keep ones
+that were shut down alive.
+*/
+static Orb_cell_t running_executors;
+/*the executors that were running when the process forked*/
+static Orb_t forked_executors;
 
-static queue_t queue_init(void) {
-	queue* rv = Orb_gc_malloc(sizeof(queue));
-	rv->insert_to = 0;
-	rv->remove_from = 0;
-	return rv;
+/*most workers we will start beyond the target number, to
+compensate for blocked workers
+*/
+#define MAX_SPARE_WORKERS 256
+/*how long a retired worker stays parked, to be reused the
+next time a worker blocks, before its thread exits
+*/
+#define SPARE_GRACE_NS 1000000000
+/*Idle workers poll the queues for a while before they park,
+so that a burst of tasks does not cost a wakeup each.  Each
+worker adapts how long it polls: the budget doubles when
+polling finds a task and halves when it does not, so
+workers only keep spinning while tasks arrive often.
+*/
+#define MIN_SPIN 16
+#define MAX_SPIN 4096
+#define SPIN_AUTO ((size_t) -1)
+/*the worker_t of the current thread, if it is a worker*/
+static Orb_tls_t current_worker;
+/*non-0 to measure task run times and idle times*/
+static int measure_time = 0;
+/*see Orb_thread_pool_task_hooks()*/
+static void* (*task_enter)(void) = 0;
+static void (*task_leave)(void*) = 0;
+/*every AGING_INTERVAL searches for a task, a worker starts
+looking from a different priority class in turn, so that a
+steady stream of high priority tasks cannot starve the
+lower classes forever.
+*/
+#define AGING_INTERVAL 16
+
+/*
+ * Work-stealing deques
+ */
+/*Each worker has a Chase-Lev deque.  The worker pushes and
+pops tasks at the bottom, so that it runs the tasks it
+spawned most recently first, while their data is still in
+its cache.  Other workers steal from the top, taking the
+oldest (and usually largest) tasks.  Only steals and the pop
+of the last task need a CAS.
+*/
+struct darray_s {
+	size_t mask;
+	Orb_cell_t slots;
+};
+typedef struct darray_s darray;
+typedef darray* darray_t;
+
+struct deque_s {
+	Orb_cell_t top; /*ticket*/
+	Orb_cell_t bottom; /*ticket*/
+	Orb_cell_t array; /*darray_t*/
+	/*slots below this ticket no longer hold tasks that were
+	taken; only used by the owner
+	*/
+	Orb_ticket_t cleared;
+};
+typedef struct deque_s deque;
+typedef deque* deque_t;
+
+#define INITIAL_DEQUE_SIZE 64
+
+static darray_t darray_new(size_t size) {
+	darray_t a = Orb_gc_malloc(sizeof(darray));
+	a->mask = size - 1;
+	a->slots = Orb_cell_array_init(size, Orb_NIL);
+	return a;
 }
-static inline int queue_empty(queue_t q) {
-	return q->insert_to == 0 && q->remove_from == 0;
-}
-static queue_t queue_pop(queue_t q, Orb_t* prv) {
-	queue* rv = Orb_gc_malloc(sizeof(queue));
-	if(q->remove_from == 0) {
-		/*reverse insert_to and make it into new remove_from*/
-		list_t to_reverse = q->insert_to;
-		list* building = 0;
-		while(to_reverse) {
-			list* nn = Orb_gc_malloc(sizeof(list));
-			nn->val = to_reverse->val;
-			nn->next = building;
-			building = nn;
-			to_reverse = to_reverse->next;
-		}
-		rv->insert_to = 0;
-		rv->remove_from = building->next;
-		*prv = building->val;
-		return rv;
-	} else {
-		rv->insert_to = q->insert_to;
-		rv->remove_from = q->remove_from->next;
-		*prv = q->remove_from->val;
-		return rv;
-	}
-}
-static queue_t queue_push(queue_t q, Orb_t val) {
-	queue* rv = Orb_gc_malloc(sizeof(queue));
-	rv->remove_from = q->remove_from;
-	list* nn = Orb_gc_malloc(sizeof(list));
-	nn->val = val;
-	nn->next = q->insert_to;
-	rv->insert_to = nn;
-	return rv;
+static inline Orb_cell_t darray_slot(darray_t a, Orb_ticket_t i) {
+	return Orb_cell_array_ref(a->slots, i & a->mask);
+}
+
+static void deque_init(deque_t d) {
+	d->top = Orb_cell_init(Orb_t_from_ticket(0));
+	d->bottom = Orb_cell_init(Orb_t_from_ticket(0));
+	d->array = Orb_cell_init(Orb_t_from_pointer(
+		darray_new(INITIAL_DEQUE_SIZE)
+	));
+	d->cleared = 0;
+}
+/*only called by the owner, before it pushes.  Slots that
+thieves took still hold their tasks, which would keep them
+reachable until the slot is reused, so clear them.  A thief
+still reading one of them has seen an older top, so its CAS
+fails anyway.  Pushes never reach past the top read here, so
+the slots cleared cannot hold newer tasks.
+*/
+static void deque_clear_taken(deque_t d, darray_t a, Orb_ticket_t t) {
+	for(; Orb_ticket_diff(t, d->cleared) > 0; ++d->cleared) {
+		Orb_cell_set(darray_slot(a, d->cleared), Orb_NIL);
+	}
+}
+/*only called by the owner*/
+static void deque_push(deque_t d, Orb_t f) {
+	Orb_ticket_t b = Orb_ticket_from_t(Orb_cell_get(d->bottom));
+	Orb_ticket_t t = Orb_ticket_from_t(Orb_cell_get(d->top));
+	darray_t a = Orb_t_as_pointer(Orb_cell_get(d->array));
+	if(Orb_ticket_diff(b, t) > (intptr_t) a->mask) {
+		/*full: grow.  Thieves may still read the old array,
+		which keeps its contents.
+		*/
+		darray_t na = darray_new(2 * (a->mask + 1));
+		Orb_ticket_t i;
+		for(i = t; i != b; ++i) {
+			Orb_cell_set(darray_slot(na, i),
+				Orb_cell_get(darray_slot(a, i))
+			);
+		}
+		Orb_cell_set(d->array, Orb_t_from_pointer(na));
+		a = na;
+		d->cleared = t;
+	}
+	deque_clear_taken(d, a, t);
+	Orb_cell_set(darray_slot(a, b), f);
+	Orb_cell_set(d->bottom, Orb_t_from_ticket(b + 1));
+}
+/*only called by the owner.  Thieves see all n tasks at
+once.
+*/
+static void deque_push_n(deque_t d, Orb_t const* fs, size_t n) {
+	Orb_ticket_t b = Orb_ticket_from_t(Orb_cell_get(d->bottom));
+	Orb_ticket_t t = Orb_ticket_from_t(Orb_cell_get(d->top));
+	darray_t a = Orb_t_as_pointer(Orb_cell_get(d->array));
+	if(Orb_ticket_diff(b, t) + (intptr_t) n > (intptr_t) a->mask + 1) {
+		size_t size = 2 * (a->mask + 1);
+		while(Orb_ticket_diff(b, t) + (intptr_t) n > (intptr_t) size) {
+			size = 2 * size;
+		}
+		darray_t na = darray_new(size);
+		Orb_ticket_t i;
+		for(i = t; i != b; ++i) {
+			Orb_cell_set(darray_slot(na, i),
+				Orb_cell_get(darray_slot(a, i))
+			);
+		}
+		Orb_cell_set(d->array, Orb_t_from_pointer(na));
+		a = na;
+		d->cleared = t;
+	}
+	deque_clear_taken(d, a, t);
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		Orb_cell_set(darray_slot(a, b + i), fs[i]);
+	}
+	Orb_cell_set(d->bottom, Orb_t_from_ticket(b + n));
+}
+/*only called by the owner.  Returns 0 if empty, and -1 if
+a thief took the last task first.
+*/
+static int deque_pop(deque_t d, Orb_t* ptodo) {
+	Orb_ticket_t b = Orb_ticket_from_t(Orb_cell_get(d->bottom)) - 1;
+	darray_t a = Orb_t_as_pointer(Orb_cell_get(d->array));
+	Orb_cell_set(d->bottom, Orb_t_from_ticket(b));
+	Orb_ticket_t t = Orb_ticket_from_t(Orb_cell_get(d->top));
+	intptr_t size = Orb_ticket_diff(b, t);
+	if(size < 0) {
+		/*empty*/
+		Orb_cell_set(d->bottom, Orb_t_from_ticket(t));
+		return 0;
+	}
+	Orb_cell_t slot = darray_slot(a, b);
+	*ptodo = Orb_cell_get(slot);
+	if(size > 0) {
+		/*thieves never get this far down*/
+		Orb_cell_set(slot, Orb_NIL);
+		return 1;
+	}
+	/*last task: race against thieves for it*/
+	int won = Orb_cell_cas(d->top,
+		Orb_t_from_ticket(t), Orb_t_from_ticket(t + 1)
+	);
+	Orb_cell_set(d->bottom, Orb_t_from_ticket(t + 1));
+	if(!won) return -1;
+	Orb_cell_set(slot, Orb_NIL);
+	return 1;
+}
+/*called by thieves.  Returns 0 if empty, and -1 if another
+thread took the task first.  The owner clears the slot later,
+see deque_clear_taken().
+*/
+static int deque_steal(deque_t d, Orb_t* ptodo) {
+	Orb_ticket_t t = Orb_ticket_from_t(Orb_cell_get(d->top));
+	Orb_ticket_t b = Orb_ticket_from_t(Orb_cell_get(d->bottom));
+	if(Orb_ticket_diff(b, t) <= 0) return 0;
+	darray_t a = Orb_t_as_pointer(Orb_cell_get(d->array));
+	*ptodo = Orb_cell_get(darray_slot(a, t));
+	return Orb_cell_cas(d->top,
+		Orb_t_from_ticket(t), Orb_t_from_ticket(t + 1)
+	) ? 1 : -1;
+}
+static int deque_empty(deque_t d) {
+	Orb_ticket_t t = Orb_ticket_from_t(Orb_cell_get(d->top));
+	Orb_ticket_t b = Orb_ticket_from_t(Orb_cell_get(d->bottom));
+	return Orb_ticket_diff(b, t) <= 0;
 }
 
 /*predeclare*/
 static Orb_t core_cfunc(Orb_t argv[], size_t* pargc, size_t argl);
 
 /*
- * current thread-pool state
+ * The pool keeps one injection queue per NUMA node (just one
+ * unless Orb_POOL_NUMA is in effect) and priority class, for
+ * tasks submitted from outside the pool.  Injection queues
+ * are fixed-size rings, so that submitting does not
+ * allocate, and so that producers cannot queue unbounded
+ * amounts of work.  Workers also have one deque per class.
+ * Within a class, workers prefer tasks from their own deque,
+ * then from their own node's injection queue, then from
+ * other nodes, and only then steal from other workers; a
+ * task of a higher class is always preferred over one of a
+ * lower class, except when aging.
  */
-struct tp_state_s {
-	size_t waiters; /*number of worker threads waiting for work to do*/
-	queue_t tasks; /*queue of tasks*/
+struct node_s {
+	Orb_ring_t inject[Orb_PRIO_CLASSES];
+	Orb_waitq_t idle; /*idle workers on this node*/
+	Orb_waitq_t space; /*submitters waiting for inject to have space*/
+	Orb_cell_t live; /*number of workers on this node*/
+};
+typedef struct node_s node;
+typedef node* node_t;
+
+/*
+ * Statistics
+ */
+/*Each worker counts what it does in a stats block that only
+it writes, so counting costs no more than an increment.
+Blocks are read without synchronization and summed when a
+snapshot is taken, so snapshots are approximate.  When a
+worker retires, its block is released for reuse by the next
+worker started, so that its counts are kept.
+*/
+struct stats_s {
+	Orb_cell_t taken; /*Orb_TRUE while a worker uses it*/
+	size_t spawned;
+	size_t run;
+	size_t stolen;
+	size_t cas_failures;
+	size_t parks;
+	size_t spin_hits;
+	uint64_t busy_ns;
+	uint64_t idle_ns;
+	size_t run_time[Orb_POOL_HISTOGRAM_BUCKETS];
+};
+typedef struct stats_s stats;
+typedef stats* stats_t;
+
+/*immutable list of stats blocks*/
+struct stats_list_s {
+	size_t n;
+	stats_t s[1];
+};
+typedef struct stats_list_s stats_list;
+typedef stats_list const* stats_list_t;
+
+struct pool_s;
+
+struct worker_s {
+	struct pool_s* pool;
+	deque tasks[Orb_PRIO_CLASSES];
+	stats_t stats;
+	size_t node_index;
+	unsigned int rng; /*for picking victims*/
+	unsigned int searches; /*for aging*/
+	int prio; /*class of the task being run*/
+	int parked; /*non-0 while idle*/
+	size_t spin_budget; /*polls before parking*/
+	size_t blocking; /*nesting depth of blocking sections*/
+};
+typedef struct worker_s worker;
+typedef worker* worker_t;
+
+/*immutable list of running workers*/
+struct workers_s {
+	size_t n;
+	worker_t w[1];
 };
-typedef struct tp_state_s tp_state;
-typedef tp_state const* tp_state_t;
+typedef struct workers_s workers;
+typedef workers const* workers_t;
+
+/*immutable list of worker threads that have not been
+joined yet
+*/
+struct threads_s {
+	size_t n;
+	Orb_thread_t t[1];
+};
+typedef struct threads_s threads;
+typedef threads const* threads_t;
+
+struct pool_s {
+	executor_t ex;
+	size_t num_nodes;
+	node* nodes;
+	/*map from NUMA node to index in nodes*/
+	size_t num_numa_nodes;
+	size_t* numa_to_node;
+	/*placement of workers*/
+	int placement;
+	size_t* cpus;
+	size_t ncpus;
+	/*number of workers, as Orb integers*/
+	Orb_cell_t target; /*number of workers we want*/
+	Orb_cell_t live; /*number of workers running*/
+	Orb_cell_t spawned; /*number of workers ever started*/
+	Orb_cell_t blocked; /*number of workers blocked in tasks*/
+	/*number of idle workers polling for tasks that no
+	submitter has counted on yet.  A submitter that finds it
+	non-0 takes one off instead of waking a parked worker.
+	*/
+	Orb_cell_t spinning;
+	size_t max_spin;
+	/*retired workers that have not exited yet*/
+	Orb_waitq_t spares;
+	Orb_cell_t workers; /*workers_t, for stealing*/
+	Orb_cell_t threads; /*threads_t, for joining*/
+	Orb_cell_t reaping; /*Orb_TRUE while someone joins threads*/
+	/*for draining: busy is the number of workers (and
+	outside helpers) that are not idle, and epoch (a ticket)
+	counts the times one went idle.  quiet is notified
+	whenever busy drops to 0.
+	*/
+	Orb_cell_t busy;
+	Orb_cell_t epoch;
+	Orb_waitq_t quiet;
+	Orb_cell_t stopping; /*Orb_TRUE while shutting down*/
+	/*statistics*/
+	Orb_cell_t stats; /*stats_list_t*/
+	/*tickets, since they count tasks*/
+	Orb_cell_t rejected;
+	Orb_cell_t ran_inline;
+	Orb_cell_t submit_waits;
+};
+typedef struct pool_s pool_s;
+typedef pool_s* pool_t;
+
+/*hidden fields of worker function objects*/
+static Orb_t hfield_pool;
+static Orb_t hfield_node;
+static Orb_t hfield_cpu;
+/*hidden field of executor objects*/
+static Orb_t hfield_executor;
+static Orb_t executor_base;
+
+static void blocking_begin(void);
+static void blocking_end(void);
+static executor_t new_executor(Orb_t name, size_t n);
+static void init_executor_base(void);
 
 void Orb_thread_pool_init(void) {
-	Orb_gc_defglobal(&state);
-	Orb_gc_defglobal(&wait_sema);
+	Orb_gc_defglobal(&odefault_executor);
+	Orb_gc_defglobal(&running_executors);
+	Orb_gc_defglobal(&forked_executors);
+	Orb_gc_defglobal(&hfield_pool);
+	Orb_gc_defglobal(&hfield_node);
+	Orb_gc_defglobal(&hfield_cpu);
+	Orb_gc_defglobal(&hfield_executor);
+	Orb_gc_defglobal(&executor_base);
+
+	hfield_pool = Orb_t_from_pointer(&hfield_pool);
+	hfield_node = Orb_t_from_pointer(&hfield_node);
+	hfield_cpu = Orb_t_from_pointer(&hfield_cpu);
+	hfield_executor = Orb_t_from_pointer(&hfield_executor);
+	current_worker = Orb_tls_init();
+	Orb_blocking_hooks(&blocking_begin, &blocking_end);
+
+	executors* es = Orb_gc_malloc(sizeof(executors));
+	es->n = 0;
+	running_executors = Orb_cell_init(Orb_t_from_pointer(es));
+	forked_executors = Orb_t_from_pointer(es);
+	init_executor_base();
+	odefault_executor = Orb_new_executor("default", 0);
+	default_executor = Orb_t_as_pointer(
+		Orb_deref(odefault_executor, hfield_executor)
+	);
+}
+
+void Orb_thread_pool_stack_size(size_t sz) {
+	default_executor->stack_size = sz;
+}
+void Orb_thread_pool_placement(int flags) {
+	default_executor->placement = flags;
+}
+
+void Orb_thread_pool_queue_capacity(size_t n) {
+	default_executor->inject_capacity = n;
+}
+void Orb_thread_pool_overflow(int policy) {
+	default_executor->overflow_policy = policy;
+}
+void Orb_thread_pool_spin(size_t n) {
+	default_executor->max_spin = n;
+}
+
+static void node_init(node_t n, size_t capacity) {
+	int prio;
+	for(prio = 0; prio < Orb_PRIO_CLASSES; ++prio) {
+		n->inject[prio] = Orb_ring_init(capacity);
+	}
+	n->idle = Orb_waitq_init();
+	n->space = Orb_waitq_init();
+	n->live = Orb_cell_init(Orb_t_from_integer(0));
+}
+/*pop a task off the node's injection queue for the given
+class.  Returns 0 if the queue is empty.
+*/
+static int node_pop(node_t n, int prio, Orb_t* ptodo) {
+	if(!Orb_ring_pop(n->inject[prio], ptodo)) return 0;
+	Orb_waitq_notify(n->space, 1);
+	return 1;
+}
+/*wake up an idle worker on the node, if any.  Returns
+non-0 if a worker was woken.
+*/
+static int node_wake(node_t n) {
+	return Orb_waitq_notify(n->idle, 1);
+}
+
+/*
+ * Worker registry
+ */
+static void add_worker(pool_t p, worker_t w) {
+	Orb_t ows = Orb_cell_get(p->workers);
+	for(;;) {
+		workers_t ws = Orb_t_as_pointer(ows);
+		workers* nws = Orb_gc_malloc(
+			sizeof(workers) + ws->n * sizeof(worker_t)
+		);
+		nws->n = ws->n + 1;
+		size_t i;
+		for(i = 0; i < ws->n; ++i) nws->w[i] = ws->w[i];
+		nws->w[ws->n] = w;
+		Orb_t read = Orb_cell_cas_get(p->workers, ows, Orb_t_from_pointer(nws));
+		if(read == ows) return;
+		ows = read;
+	}
+}
+static void remove_worker(pool_t p, worker_t w) {
+	Orb_t ows = Orb_cell_get(p->workers);
+	for(;;) {
+		workers_t ws = Orb_t_as_pointer(ows);
+		workers* nws = Orb_gc_malloc(sizeof(workers) + ws->n * sizeof(worker_t));
+		size_t i;
+		nws->n = 0;
+		for(i = 0; i < ws->n; ++i) {
+			if(ws->w[i] != w) nws->w[nws->n++] = ws->w[i];
+		}
+		Orb_t read = Orb_cell_cas_get(p->workers, ows, Orb_t_from_pointer(nws));
+		if(read == ows) return;
+		ows = read;
+	}
+}
+
+/*get an unused stats block, or add a new one*/
+static stats_t claim_stats(pool_t p) {
+	Orb_t osl = Orb_cell_get(p->stats);
+	for(;;) {
+		stats_list_t sl = Orb_t_as_pointer(osl);
+		size_t i;
+		for(i = 0; i < sl->n; ++i) {
+			if(Orb_cell_cas(sl->s[i]->taken, Orb_NIL, Orb_TRUE)) {
+				return sl->s[i];
+			}
+		}
+		stats_t s = Orb_gc_malloc(sizeof(stats));
+		memset(s, 0, sizeof(stats));
+		s->taken = Orb_cell_init(Orb_TRUE);
+		stats_list* nsl = Orb_gc_malloc(
+			sizeof(stats_list) + sl->n * sizeof(stats_t)
+		);
+		nsl->n = sl->n + 1;
+		for(i = 0; i < sl->n; ++i) nsl->s[i] = sl->s[i];
+		nsl->s[sl->n] = s;
+		Orb_t read = Orb_cell_cas_get(p->stats, osl, Orb_t_from_pointer(nsl));
+		if(read == osl) return s;
+		osl = read;
+	}
+}
+static void release_stats(stats_t s) {
+	Orb_cell_set(s->taken, Orb_NIL);
+}
+/*histogram bucket for a run time*/
+static size_t run_time_bucket(uint64_t ns) {
+	size_t b = 0;
+	while(ns > 1 && b < Orb_POOL_HISTOGRAM_BUCKETS - 1) {
+		ns = ns >> 1;
+		++b;
+	}
+	return b;
+}
+
+/*
+ * Starting the pool
+ */
+static Orb_t new_worker(pool_t p, size_t node_index, Orb_t cpu) {
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_t_from_cfunc(&core_cfunc));
+		Orb_B_FIELD(hfield_pool, Orb_t_from_pointer(p));
+		Orb_B_FIELD(hfield_node, Orb_t_from_integer(node_index));
+		Orb_B_FIELD(hfield_cpu, cpu);
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+/*default number of workers: $ORB_THREAD_POOL_SIZE if set,
+otherwise the number of processors we may use.
+*/
+static size_t default_size(void) {
+	char const* env = getenv("ORB_THREAD_POOL_SIZE");
+	if(env) {
+		char* end;
+		unsigned long n = strtoul(env, &end, 10);
+		if(end != env && *end == 0 && n > 0) return n;
+	}
+	return Orb_num_processors();
+}
 
-	state = Orb_cell_init(Orb_NOTFOUND);
-	wait_sema = Orb_sema_init(0);
+static void add_thread(pool_t p, Orb_thread_t t) {
+	Orb_t ots = Orb_cell_get(p->threads);
+	for(;;) {
+		threads_t ts = Orb_t_as_pointer(ots);
+		threads* nts = Orb_gc_malloc(
+			sizeof(threads) + ts->n * sizeof(Orb_thread_t)
+		);
+		nts->n = ts->n + 1;
+		size_t i;
+		for(i = 0; i < ts->n; ++i) nts->t[i] = ts->t[i];
+		nts->t[ts->n] = t;
+		Orb_t read = Orb_cell_cas_get(p->threads, ots, Orb_t_from_pointer(nts));
+		if(read == ots) return;
+		ots = read;
+	}
+}
+/*join the worker threads that have exited, or with all
+non-0, every worker thread.  Only one thread joins at a
+time, so that no thread is joined twice.
+*/
+static void reap_threads(pool_t p, int all) {
+	while(!Orb_cell_cas(p->reaping, Orb_NIL, Orb_TRUE)) {
+		if(!all) return;
+		Orb_yield();
+	}
+	Orb_t ots = Orb_cell_get(p->threads);
+	for(;;) {
+		threads_t ts = Orb_t_as_pointer(ots);
+		size_t size = sizeof(threads) + ts->n * sizeof(Orb_thread_t);
+		threads* keep = Orb_gc_malloc(size);
+		threads* gone = Orb_gc_malloc(size);
+		keep->n = 0;
+		gone->n = 0;
+		size_t i;
+		for(i = 0; i < ts->n; ++i) {
+			if(all || Orb_priv_thread_finished(ts->t[i])) {
+				gone->t[gone->n++] = ts->t[i];
+			} else {
+				keep->t[keep->n++] = ts->t[i];
+			}
+		}
+		if(gone->n == 0) break;
+		Orb_t read = Orb_cell_cas_get(p->threads, ots, Orb_t_from_pointer(keep));
+		if(read == ots) {
+			for(i = 0; i < gone->n; ++i) Orb_priv_thread_join(gone->t[i]);
+			break;
+		}
+		ots = read;
+	}
+	Orb_cell_set(p->reaping, Orb_NIL);
 }
 
-void Orb_thread_pool_add(Orb_t f) {
-	size_t waiters;
-	tp_state_t curstate;
+static void spawn_worker(pool_t p) {
+	Orb_cell_add(p->busy, 1);
+	/*a retired worker that is still parked takes the place*/
+	if(Orb_waitq_notify(p->spares, 1)) return;
+	size_t i = Orb_cell_add(p->spawned, 1) - 1;
+	size_t cpu = p->cpus[i % p->ncpus];
+	size_t node_index = 0;
+	if(p->placement & Orb_POOL_NUMA) {
+		size_t numa = Orb_numa_node_of_cpu(cpu);
+		if(numa >= p->num_numa_nodes) numa = 0;
+		node_index = p->numa_to_node[numa];
+	}
+	Orb_t ocpu = (p->placement & Orb_POOL_PIN) ?
+		Orb_t_from_integer(cpu) : Orb_NOTFOUND;
+	Orb_cell_add(p->nodes[node_index].live, 1);
+	reap_threads(p, 0);
+	add_thread(p, Orb_priv_new_joinable_thread(
+		new_worker(p, node_index, ocpu),
+		p->ex->stack_size
+	));
+}
+/*number of workers that are not blocked*/
+static int active_workers(pool_t p, Orb_t olive) {
+	return Orb_t_as_integer(olive) -
+		Orb_t_as_integer(Orb_cell_get(p->blocked));
+}
+/*start workers until we have the target number of workers
+that are not blocked
+*/
+static void grow(pool_t p) {
+	Orb_t olive = Orb_cell_get(p->live);
+	for(;;) {
+		int target = Orb_t_as_integer(Orb_cell_get(p->target));
+		if(active_workers(p, olive) >= target) return;
+		if(Orb_t_as_integer(olive) >= target + MAX_SPARE_WORKERS) return;
+		Orb_t read = Orb_cell_cas_get(p->live, olive,
+			Orb_t_from_integer(Orb_t_as_integer(olive) + 1)
+		);
+		if(read == olive) {
+			spawn_worker(p);
+			olive = Orb_cell_get(p->live);
+		} else olive = read;
+	}
+}
+/*called by a worker to determine if it should exit because
+the pool has been shrunk, or because it was started to
+compensate for a blocked worker which has since unblocked.
+The last worker on a node never retires, so that each
+node's queue is always served, unless the pool is shutting
+down.
+*/
+static int should_retire(pool_t p, node_t n) {
+	int stopping = Orb_cell_get(p->stopping) != Orb_NIL;
+	Orb_t olive = Orb_cell_get(p->live);
+	for(;;) {
+		int target = Orb_t_as_integer(Orb_cell_get(p->target));
+		if(active_workers(p, olive) <= target) return 0;
+		Orb_t read = Orb_cell_cas_get(p->live, olive,
+			Orb_t_from_integer(Orb_t_as_integer(olive) - 1)
+		);
+		if(read == olive) break;
+		olive = read;
+	}
+	Orb_t onlive = Orb_cell_get(n->live);
+	for(;;) {
+		if(!stopping && Orb_t_as_integer(onlive) <= 1) {
+			/*undo*/
+			Orb_cell_add(p->live, 1);
+			return 0;
+		}
+		Orb_t read = Orb_cell_cas_get(n->live, onlive,
+			Orb_t_from_integer(Orb_t_as_integer(onlive) - 1)
+		);
+		if(read == onlive) return 1;
+		onlive = read;
+	}
+}
+
+/*
+ * Running executors
+ */
+static void add_running(executor_t ex) {
+	Orb_t oes = Orb_cell_get(running_executors);
+	for(;;) {
+		executors_t es = Orb_t_as_pointer(oes);
+		executors* nes = Orb_gc_malloc(
+			sizeof(executors) + es->n * sizeof(executor_t)
+		);
+		nes->n = es->n + 1;
+		memcpy(nes->e, es->e, es->n * sizeof(executor_t));
+		nes->e[es->n] = ex;
+		Orb_t read = Orb_cell_cas_get(running_executors,
+			oes, Orb_t_from_pointer(nes)
+		);
+		if(read == oes) return;
+		oes = read;
+	}
+}
+static void remove_running(executor_t ex) {
+	Orb_t oes = Orb_cell_get(running_executors);
+	for(;;) {
+		executors_t es = Orb_t_as_pointer(oes);
+		executors* nes = Orb_gc_malloc(sizeof(executors) +
+			(es->n ? es->n - 1 : 0) * sizeof(executor_t)
+		);
+		nes->n = 0;
+		size_t i;
+		for(i = 0; i < es->n; ++i) {
+			if(es->e[i] != ex) nes->e[nes->n++] = es->e[i];
+		}
+		if(nes->n == es->n) return;
+		Orb_t read = Orb_cell_cas_get(running_executors,
+			oes, Orb_t_from_pointer(nes)
+		);
+		if(read == oes) return;
+		oes = read;
+	}
+}
 
-	Orb_t readstate;
+/*the executor's pool, or 0 if it is not running*/
+static pool_t running_pool(executor_t ex) {
+	Orb_t opool = Orb_cell_get(ex->pool);
+	if(opool == Orb_NOTFOUND) return 0;
+	return Orb_t_as_pointer(opool);
+}
+/*the executor's pool, starting it if necessary*/
+static pool_t get_pool(executor_t ex) {
+	Orb_t opool = Orb_cell_get(ex->pool);
+	if(opool != Orb_NOTFOUND) return Orb_t_as_pointer(opool);
 
-	tp_state* nv = Orb_gc_malloc(sizeof(tp_state));
-	Orb_t nstate = Orb_t_from_pointer(nv);
-	Orb_t ostate = Orb_cell_get(state);
+	int placement = ex->placement;
+	size_t nworkers = ex->requested_size ? ex->requested_size : default_size();
+	size_t maxcpus = Orb_num_processors();
+	if(maxcpus < nworkers) maxcpus = nworkers;
+	size_t* cpus = Orb_gc_malloc_pointerfree(maxcpus * sizeof(size_t));
+	size_t ncpus = Orb_usable_cpus(cpus, maxcpus);
+	if(ncpus == 0) {
+		cpus[0] = 0; ncpus = 1;
+	}
 
-retry:
-	if(ostate == Orb_NOTFOUND) {
-		nv->waiters = 0;
-		nv->tasks = queue_init();
-		readstate = Orb_cell_cas_get(state, ostate, nstate);
-		if(readstate != ostate) {
-			ostate = readstate;
-			goto retry;
+	pool_t p = Orb_gc_malloc(sizeof(pool_s));
+	p->ex = ex;
+	p->placement = placement;
+	p->cpus = cpus;
+	p->ncpus = ncpus;
+	p->target = Orb_cell_init(Orb_t_from_integer(nworkers));
+	p->live = Orb_cell_init(Orb_t_from_integer(0));
+	p->spawned = Orb_cell_init(Orb_t_from_integer(0));
+	p->blocked = Orb_cell_init(Orb_t_from_integer(0));
+	p->spinning = Orb_cell_init(Orb_t_from_integer(0));
+	p->spares = Orb_waitq_init();
+	if(ex->max_spin != SPIN_AUTO) {
+		p->max_spin = ex->max_spin;
+	} else {
+		/*with a single processor, spinning only delays the
+		thread that would queue the task
+		*/
+		p->max_spin = ncpus > 1 ? MAX_SPIN : 0;
+	}
+	p->busy = Orb_cell_init(Orb_t_from_integer(0));
+	p->epoch = Orb_cell_init(Orb_t_from_ticket(0));
+	p->quiet = Orb_waitq_init();
+	p->stopping = Orb_cell_init(Orb_NIL);
+	stats_list* sl = Orb_gc_malloc(sizeof(stats_list));
+	sl->n = 0;
+	p->stats = Orb_cell_init(Orb_t_from_pointer(sl));
+	p->rejected = Orb_cell_init(Orb_t_from_ticket(0));
+	p->ran_inline = Orb_cell_init(Orb_t_from_ticket(0));
+	p->submit_waits = Orb_cell_init(Orb_t_from_ticket(0));
+	workers* ws = Orb_gc_malloc(sizeof(workers));
+	ws->n = 0;
+	p->workers = Orb_cell_init(Orb_t_from_pointer(ws));
+	threads* ts = Orb_gc_malloc(sizeof(threads));
+	ts->n = 0;
+	p->threads = Orb_cell_init(Orb_t_from_pointer(ts));
+	p->reaping = Orb_cell_init(Orb_NIL);
+	size_t i;
+	if(placement & Orb_POOL_NUMA) {
+		/*one queue for each NUMA node that we have CPUs on*/
+		p->num_numa_nodes = Orb_numa_num_nodes();
+		p->numa_to_node = Orb_gc_malloc_pointerfree(
+			p->num_numa_nodes * sizeof(size_t)
+		);
+		for(i = 0; i < p->num_numa_nodes; ++i) {
+			p->numa_to_node[i] = p->num_numa_nodes;
 		}
-		/*succeeded CAS, now start each thread in pool*/
-		size_t i; Orb_t f = Orb_t_from_cfunc(&core_cfunc);
-		for(i = Orb_num_processors(); i; --i) {
-			Orb_priv_new_thread(f);
+		p->num_nodes = 0;
+		for(i = 0; i < nworkers; ++i) {
+			size_t numa = Orb_numa_node_of_cpu(cpus[i % ncpus]);
+			if(numa >= p->num_numa_nodes) numa = 0;
+			if(p->numa_to_node[numa] == p->num_numa_nodes) {
+				p->numa_to_node[numa] = p->num_nodes++;
+			}
+		}
+		/*nodes we have no workers on submit to the first node*/
+		for(i = 0; i < p->num_numa_nodes; ++i) {
+			if(p->numa_to_node[i] == p->num_numa_nodes) {
+				p->numa_to_node[i] = 0;
+			}
 		}
-		/*set up the variables for the rest of the code*/
-		ostate = nstate;
-		nv = Orb_gc_malloc(sizeof(tp_state));
-		nstate = Orb_t_from_pointer(nv);
+	} else {
+		p->num_numa_nodes = 1;
+		p->numa_to_node = Orb_gc_malloc_pointerfree(sizeof(size_t));
+		p->numa_to_node[0] = 0;
+		p->num_nodes = 1;
+	}
+	p->nodes = Orb_gc_malloc(p->num_nodes * sizeof(node));
+	for(i = 0; i < p->num_nodes; ++i) {
+		node_init(&p->nodes[i], ex->inject_capacity);
 	}
 
-	curstate = Orb_t_as_pointer(ostate);
-	waiters = curstate->waiters;
-	if(waiters > 0) {
-		nv->waiters = waiters - 1;
+	Orb_t readpool = Orb_cell_cas_get(ex->pool, Orb_NOTFOUND, Orb_t_from_pointer(p));
+	if(readpool != Orb_NOTFOUND) {
+		/*someone else started the pool*/
+		return Orb_t_as_pointer(readpool);
+	}
+
+	/*succeeded CAS, now start each thread in pool*/
+	add_running(ex);
+	grow(p);
+	return p;
+}
+
+static void resize(executor_t ex, size_t n) {
+	if(n == 0) n = default_size();
+	Orb_t opool = Orb_cell_get(ex->pool);
+	if(opool == Orb_NOTFOUND) {
+		/*not started yet: takes effect once started*/
+		ex->requested_size = n;
+		opool = Orb_cell_get(ex->pool);
+		if(opool == Orb_NOTFOUND) return;
+	}
+	pool_t p = Orb_t_as_pointer(opool);
+	Orb_t oold = Orb_cell_get(p->target);
+	Orb_cell_set(p->target, Orb_t_from_integer(n));
+	size_t old = Orb_t_as_integer(oold);
+	if(n > old) {
+		grow(p);
 	} else {
-		nv->waiters = 0;
+		/*wake up idle workers so that the excess can retire*/
+		size_t excess = old - n;
+		size_t i;
+		for(i = 0; excess > 0 && i < p->num_nodes; ++i) {
+			while(excess > 0 && node_wake(&p->nodes[i])) {
+				--excess;
+			}
+		}
+	}
+}
+static size_t size(executor_t ex) {
+	pool_t p = running_pool(ex);
+	if(!p) {
+		return ex->requested_size ? ex->requested_size : default_size();
+	}
+	return Orb_t_as_integer(Orb_cell_get(p->target));
+}
+void Orb_thread_pool_resize(size_t n) {
+	resize(default_executor, n);
+}
+size_t Orb_thread_pool_size(void) {
+	return size(default_executor);
+}
+
+/*the node that the calling thread should submit to*/
+static size_t home_node(pool_t p) {
+	size_t home = 0;
+	if(p->num_nodes > 1) {
+		size_t numa = Orb_numa_node_of_cpu(Orb_current_cpu());
+		if(numa < p->num_numa_nodes) home = p->numa_to_node[numa];
+	}
+	return home;
+}
+/*find a task of the given class for the worker w (0 if not
+a worker) on node me to run.  Returns 0 if there are none.
+*/
+static int find_task_in(pool_t p, worker_t w, size_t me, int prio,
+		Orb_t* ptodo) {
+	if(w) {
+		int rv = deque_pop(&w->tasks[prio], ptodo);
+		if(rv > 0) return 1;
+		if(rv < 0) ++w->stats->cas_failures;
+	}
+	if(node_pop(&p->nodes[me], prio, ptodo)) return 1;
+	size_t i;
+	for(i = 1; i < p->num_nodes; ++i) {
+		if(node_pop(&p->nodes[(me + i) % p->num_nodes], prio, ptodo)) {
+			return 1;
+		}
+	}
+	/*steal, starting from a random victim*/
+	workers_t ws = Orb_t_as_pointer(Orb_cell_get(p->workers));
+	if(ws->n == 0) return 0;
+	size_t start;
+	if(w) {
+		w->rng = w->rng * 1103515245 + 12345;
+		start = (w->rng >> 16) % ws->n;
+	} else {
+		start = 0;
+	}
+	for(i = 0; i < ws->n; ++i) {
+		worker_t victim = ws->w[(start + i) % ws->n];
+		if(victim == w) continue;
+		int rv = deque_steal(&victim->tasks[prio], ptodo);
+		if(rv > 0) {
+			if(w) ++w->stats->stolen;
+			return 1;
+		}
+		if(rv < 0 && w) ++w->stats->cas_failures;
+	}
+	return 0;
+}
+/*find a task for the worker w (0 if not a worker) on node
+me to run, highest class first.  Returns 0 if there are
+none, otherwise stores the task's class in *pprio.
+*/
+static int find_task(pool_t p, worker_t w, size_t me, Orb_t* ptodo,
+		int* pprio) {
+	int first = Orb_PRIO_HIGH;
+	if(w && ++w->searches % AGING_INTERVAL == 0) {
+		first = (w->searches / AGING_INTERVAL) % Orb_PRIO_CLASSES;
+	}
+	int i;
+	for(i = 0; i < Orb_PRIO_CLASSES; ++i) {
+		int prio = (first + i) % Orb_PRIO_CLASSES;
+		if(find_task_in(p, w, me, prio, ptodo)) {
+			*pprio = prio;
+			return 1;
+		}
+	}
+	return 0;
+}
+/*returns non-0 if there might be tasks to find*/
+static int has_work(pool_t p) {
+	size_t i;
+	int prio;
+	workers_t ws = Orb_t_as_pointer(Orb_cell_get(p->workers));
+	for(prio = 0; prio < Orb_PRIO_CLASSES; ++prio) {
+		for(i = 0; i < p->num_nodes; ++i) {
+			if(Orb_ring_size(p->nodes[i].inject[prio]) != 0) return 1;
+		}
+		for(i = 0; i < ws->n; ++i) {
+			if(!deque_empty(&ws->w[i]->tasks[prio])) return 1;
+		}
+	}
+	return 0;
+}
+/*run a task of the given class.  Tasks it queues inherit
+the class.
+*/
+static void run_task(worker_t w, Orb_t todo, int prio) {
+	volatile int oprio = 0;
+	volatile uint64_t start = 0;
+	void* volatile context = task_enter ? task_enter() : 0;
+	if(w) {
+		oprio = w->prio;
+		w->prio = prio;
+		if(measure_time) start = Orb_monotonic_ns();
+	}
+	Orb_TRY {
+		Orb_call0(todo);
+	} Orb_CATCH(E) { /*do nothing*/ }
+	Orb_ENDTRY;
+	if(task_leave) task_leave(context);
+	if(w) {
+		w->prio = oprio;
+		stats_t s = w->stats;
+		++s->run;
+		if(start != 0) {
+			/*includes any tasks it helped run*/
+			uint64_t ns = Orb_monotonic_ns() - start;
+			s->busy_ns += ns;
+			++s->run_time[run_time_bucket(ns)];
+		}
+	}
+}
+/*count on up to n polling workers to find newly queued
+tasks, returning how many were counted on
+*/
+static size_t claim_spinners(pool_t p, size_t n) {
+	Orb_t ospinning = Orb_cell_get(p->spinning);
+	for(;;) {
+		size_t spinning = Orb_t_as_integer(ospinning);
+		if(spinning == 0) return 0;
+		size_t k = spinning < n ? spinning : n;
+		Orb_t read = Orb_cell_cas_get(p->spinning,
+			ospinning, Orb_t_from_integer(spinning - k)
+		);
+		if(read == ospinning) return k;
+		ospinning = read;
+	}
+}
+/*wake an idle worker, preferring the given node, unless a
+polling worker can be counted on to find the task
+*/
+static void wake_one(pool_t p, size_t home) {
+	if(claim_spinners(p, 1)) return;
+	size_t i;
+	for(i = 0; i < p->num_nodes; ++i) {
+		if(node_wake(&p->nodes[(home + i) % p->num_nodes])) return;
+	}
+}
+
+/*wake up to n idle workers, preferring the given node*/
+static void wake_n(pool_t p, size_t home, size_t n) {
+	n -= claim_spinners(p, n);
+	size_t i;
+	for(i = 0; n > 0 && i < p->num_nodes; ++i) {
+		n -= Orb_waitq_notify(p->nodes[(home + i) % p->num_nodes].idle, n);
+	}
+}
+
+/*push onto an injection queue of the given class,
+preferring the given node.  Returns 0 if all are full.
+*/
+static int inject(pool_t p, size_t home, int prio, Orb_t f) {
+	size_t i;
+	for(i = 0; i < p->num_nodes; ++i) {
+		size_t n = (home + i) % p->num_nodes;
+		if(Orb_ring_push(p->nodes[n].inject[prio], f)) {
+			wake_one(p, n);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*the current thread's worker_t, if it is a worker of the
+given pool
+*/
+static worker_t own_worker(pool_t p) {
+	worker_t w = Orb_tls_get(current_worker);
+	if(w && w->pool != p) return 0;
+	return w;
+}
+/*the priority class of tasks queued without one*/
+static int inherited_prio(void) {
+	worker_t w = Orb_tls_get(current_worker);
+	return w ? w->prio : Orb_PRIO_NORMAL;
+}
+
+static int add_prio(executor_t ex, Orb_t f, int prio) {
+	if(prio < Orb_PRIO_HIGH) prio = Orb_PRIO_HIGH;
+	if(prio > Orb_PRIO_LOW) prio = Orb_PRIO_LOW;
+	pool_t p = get_pool(ex);
+	worker_t w = own_worker(p);
+	if(w) {
+		/*tasks spawned by pool tasks go to the worker's own
+		deque, which is not bounded: blocking or rejecting
+		would break fork-join code.
+		*/
+		deque_push(&w->tasks[prio], f);
+		++w->stats->spawned;
+		wake_one(p, w->node_index);
+		return 1;
+	}
+	size_t home = home_node(p);
+	if(inject(p, home, prio, f)) return 1;
+	switch(ex->overflow_policy) {
+	case Orb_POOL_RUN_INLINE:
+		Orb_cell_ticket_add(p->ran_inline, 1);
+		run_task(w, f, prio);
+		return 1;
+	case Orb_POOL_REJECT:
+		Orb_cell_ticket_add(p->rejected, 1);
+		return 0;
+	default:
+		Orb_cell_ticket_add(p->submit_waits, 1);
+		for(;;) {
+			Orb_waitq_t space = p->nodes[home].space;
+			Orb_waitq_prepare(space);
+			if(inject(p, home, prio, f)) {
+				Orb_waitq_cancel(space);
+				return 1;
+			}
+			Orb_waitq_wait(space);
+		}
+	}
+}
+int Orb_thread_pool_add_prio(Orb_t f, int prio) {
+	return add_prio(default_executor, f, prio);
+}
+int Orb_thread_pool_add(Orb_t f) {
+	return add_prio(default_executor, f, inherited_prio());
+}
+
+/*push as many of the tasks as fit onto the injection queues
+of the given class, preferring the given node, and wake
+workers for them.  Returns the number pushed.
+*/
+static size_t inject_n(pool_t p, size_t home, int prio,
+		Orb_t const* fs, size_t n) {
+	size_t done = 0;
+	size_t i;
+	for(i = 0; done < n && i < p->num_nodes; ++i) {
+		size_t node = (home + i) % p->num_nodes;
+		size_t k = Orb_ring_push_n(p->nodes[node].inject[prio],
+			fs + done, n - done
+		);
+		if(k != 0) wake_n(p, node, k);
+		done += k;
+	}
+	return done;
+}
+static size_t add_prio_n(executor_t ex, Orb_t const* fs, size_t n,
+		int prio) {
+	if(n == 0) return 0;
+	if(prio < Orb_PRIO_HIGH) prio = Orb_PRIO_HIGH;
+	if(prio > Orb_PRIO_LOW) prio = Orb_PRIO_LOW;
+	pool_t p = get_pool(ex);
+	worker_t w = own_worker(p);
+	if(w) {
+		deque_push_n(&w->tasks[prio], fs, n);
+		w->stats->spawned += n;
+		wake_n(p, w->node_index, n);
+		return n;
+	}
+	size_t home = home_node(p);
+	size_t done = inject_n(p, home, prio, fs, n);
+	if(done == n) return n;
+	switch(ex->overflow_policy) {
+	case Orb_POOL_RUN_INLINE:
+		Orb_cell_ticket_add(p->ran_inline, n - done);
+		for(; done < n; ++done) run_task(w, fs[done], prio);
+		return n;
+	case Orb_POOL_REJECT:
+		Orb_cell_ticket_add(p->rejected, n - done);
+		return done;
+	default:
+		Orb_cell_ticket_add(p->submit_waits, 1);
+		while(done < n) {
+			Orb_waitq_t space = p->nodes[home].space;
+			Orb_waitq_prepare(space);
+			size_t k = inject_n(p, home, prio, fs + done, n - done);
+			if(k != 0) {
+				Orb_waitq_cancel(space);
+				done += k;
+			} else {
+				Orb_waitq_wait(space);
+			}
+		}
+		return n;
+	}
+}
+size_t Orb_thread_pool_add_prio_n(Orb_t const* fs, size_t n, int prio) {
+	return add_prio_n(default_executor, fs, n, prio);
+}
+size_t Orb_thread_pool_add_n(Orb_t const* fs, size_t n) {
+	return add_prio_n(default_executor, fs, n, inherited_prio());
+}
+
+static size_t queue_depth(pool_t p) {
+	size_t rv = 0;
+	size_t i;
+	int prio;
+	workers_t ws = Orb_t_as_pointer(Orb_cell_get(p->workers));
+	for(prio = 0; prio < Orb_PRIO_CLASSES; ++prio) {
+		for(i = 0; i < p->num_nodes; ++i) {
+			rv += Orb_ring_size(p->nodes[i].inject[prio]);
+		}
+		for(i = 0; i < ws->n; ++i) {
+			deque_t d = &ws->w[i]->tasks[prio];
+			intptr_t size = Orb_ticket_diff(
+				Orb_ticket_from_t(Orb_cell_get(d->bottom)),
+				Orb_ticket_from_t(Orb_cell_get(d->top))
+			);
+			if(size > 0) rv += size;
+		}
 	}
+	return rv;
+}
+size_t Orb_thread_pool_queue_depth(void) {
+	pool_t p = running_pool(default_executor);
+	return p ? queue_depth(p) : 0;
+}
 
-	nv->tasks = queue_push(curstate->tasks, f);
+/*
+ * Granularity control
+ */
+/*A worker keeps queuing tasks while it has fewer than this
+many in its deque of the current class, so that thieves
+always find something (lazy binary splitting).
+*/
+#define LAZY_DEQUE_THRESHOLD 2
 
-	readstate = Orb_cell_cas_get(state, ostate, nstate);
-	if(readstate != ostate) {
-		ostate = readstate;
-		goto retry;
+static int idle_workers(pool_t p) {
+	if(Orb_cell_get(p->spinning) != Orb_t_from_integer(0)) return 1;
+	size_t i;
+	for(i = 0; i < p->num_nodes; ++i) {
+		if(Orb_waitq_waiters(p->nodes[i].idle) != 0) return 1;
 	}
+	return 0;
+}
+int Orb_thread_pool_hungry(void) {
+	/*outside threads may depend on their tasks running
+	concurrently with them, and the overflow policy already
+	deals with a saturated pool
+	*/
+	worker_t w = Orb_tls_get(current_worker);
+	if(!w) return 1;
+	if(idle_workers(w->pool)) return 1;
+	deque_t d = &w->tasks[w->prio];
+	intptr_t size = Orb_ticket_diff(
+		Orb_ticket_from_t(Orb_cell_get(d->bottom)),
+		Orb_ticket_from_t(Orb_cell_get(d->top))
+	);
+	return size < LAZY_DEQUE_THRESHOLD;
+}
+int Orb_thread_pool_add_local(Orb_t f) {
+	worker_t w = Orb_tls_get(current_worker);
+	if(!w || w->pool != running_pool(default_executor)) return 0;
+	deque_push(&w->tasks[w->prio], f);
+	++w->stats->spawned;
+	return 1;
+}
 
-	/*succeeded CAS, now check if need to wake up thread*/
-	if(waiters > 0) {
-		Orb_sema_post(wait_sema);
+/*called when a worker (or outside helper) goes idle*/
+static void went_idle(pool_t p) {
+	Orb_cell_ticket_add(p->epoch, 1);
+	if(Orb_cell_add(p->busy, -1) == 0) {
+		Orb_waitq_notify_all(p->quiet);
 	}
+}
+/*returns non-0 if no tasks are queued or running*/
+static int quiescent(pool_t p) {
+	Orb_t oepoch = Orb_cell_get(p->epoch);
+	if(Orb_cell_get(p->busy) != Orb_t_from_integer(0)) return 0;
+	if(has_work(p)) return 0;
+	/*if nobody went idle meanwhile, nobody was busy while we
+	looked at the queues
+	*/
+	return Orb_cell_get(p->epoch) == oepoch &&
+		Orb_cell_get(p->busy) == Orb_t_from_integer(0);
+}
 
+/*poll for a task before parking.  Returns non-0 if one was
+found.
+*/
+static int spin_for_task(pool_t p, worker_t w, size_t me,
+		Orb_t* ptodo, int* pprio) {
+	if(p->max_spin == 0) return 0;
+	if(w->spin_budget > p->max_spin) w->spin_budget = p->max_spin;
+	Orb_cell_add(p->spinning, 1);
+	size_t i;
+	for(i = 0; i < w->spin_budget; ++i) {
+		if(has_work(p) && find_task(p, w, me, ptodo, pprio)) {
+			/*if a submitter counted on us, we took a task in
+			its place
+			*/
+			claim_spinners(p, 1);
+			++w->stats->spin_hits;
+			w->spin_budget *= 2;
+			return 1;
+		}
+		if(Orb_cell_get(p->stopping) != Orb_NIL) break;
+		Orb_cpu_relax();
+	}
+	/*anything queued from now on is seen by the check
+	before parking.  If a submitter counted on us, its task
+	is seen by that check too.
+	*/
+	claim_spinners(p, 1);
+	if(w->spin_budget > MIN_SPIN) w->spin_budget /= 2;
+	return 0;
+}
+
+/*park a retired worker for a while, in case a blocked
+worker needs a replacement soon.  Returns non-0 if it was
+given the place of a new worker.
+*/
+static int park_spare(pool_t p) {
+	if(Orb_cell_get(p->stopping) != Orb_NIL) return 0;
+	Orb_waitq_prepare(p->spares);
+	if(Orb_cell_get(p->stopping) != Orb_NIL) {
+		Orb_waitq_cancel(p->spares);
+		return 0;
+	}
+	if(!Orb_waitq_wait_until(p->spares,
+			Orb_monotonic_ns() + SPARE_GRACE_NS)) {
+		return 0;
+	}
+	/*shutting down wakes spares so that they exit*/
+	return Orb_cell_get(p->stopping) == Orb_NIL;
 }
 
 /*
@@ -162,40 +1329,506 @@ retry:
  */
 static Orb_t core_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
 	/*ignore all arguments*/
+	Orb_t self = argv[0];
+	size_t me = Orb_t_as_integer(Orb_deref(self, hfield_node));
+	Orb_t ocpu = Orb_deref(self, hfield_cpu);
+	if(Orb_t_is_integer(ocpu)) {
+		Orb_pin_thread_to_cpu(Orb_t_as_integer(ocpu));
+	}
+
+	pool_t p = Orb_t_as_pointer(Orb_deref(self, hfield_pool));
+	node_t mynode = &p->nodes[me];
+
+	worker_t w = Orb_gc_malloc(sizeof(worker));
+	w->pool = p;
+	int prio;
+	for(prio = 0; prio < Orb_PRIO_CLASSES; ++prio) {
+		deque_init(&w->tasks[prio]);
+	}
+	w->node_index = me;
+	w->rng = (unsigned int) (size_t) w;
+	w->searches = 0;
+	w->prio = Orb_PRIO_NORMAL;
+	w->stats = claim_stats(p);
+	w->parked = 0;
+	w->spin_budget = MIN_SPIN;
+	w->blocking = 0;
+	add_worker(p, w);
+	Orb_tls_set(current_worker, w);
+
 	for(;;) {
-		tp_state* nv = Orb_gc_malloc(sizeof(tp_state));
-		Orb_t ostate = Orb_cell_get(state);
-		for(;;) {
-			tp_state_t curstate = Orb_t_as_pointer(ostate);
-			if(queue_empty(curstate->tasks)) {
-				/*attempt to increment waiters*/
-				nv->tasks = curstate->tasks;
-				nv->waiters = curstate->waiters + 1;
-				Orb_t readstate = Orb_cell_cas_get(state, ostate, Orb_t_from_pointer(nv));
-				if(readstate == ostate) {
-					/*update successful*/
-					Orb_sema_wait(wait_sema);
-					break;
-				} else ostate = readstate;
-			} else {
-				/*attempt to pop off*/
-				Orb_t todo;
-				queue_t nq = queue_pop(curstate->tasks, &todo);
-				/*now try to update state*/
-				nv->tasks = nq;
-				nv->waiters = curstate->waiters;
-				Orb_t readstate = Orb_cell_cas_get(state, ostate, Orb_t_from_pointer(nv));
-				if(readstate == ostate) {
-					/*update successful*/
-					Orb_TRY {
-						Orb_call0(todo);
-					} Orb_CATCH(E) { /*do nothing*/ }
-					Orb_ENDTRY;
-					break;
-				} else ostate = readstate;
-			}
+		Orb_t todo;
+		if(find_task(p, w, me, &todo, &prio)) {
+			run_task(w, todo, prio);
+			continue;
+		}
+		/*our deque is empty, so we can retire without
+		leaving tasks behind
+		*/
+		if(should_retire(p, mynode)) {
+			remove_worker(p, w);
+			release_stats(w->stats);
+			Orb_tls_set(current_worker, 0);
+			went_idle(p);
+			if(!park_spare(p)) return Orb_NIL;
+			/*spawn_worker() counted us as live and busy*/
+			Orb_cell_add(mynode->live, 1);
+			w->stats = claim_stats(p);
+			add_worker(p, w);
+			Orb_tls_set(current_worker, w);
+			continue;
+		}
+		if(spin_for_task(p, w, me, &todo, &prio)) {
+			run_task(w, todo, prio);
+			continue;
+		}
+		w->parked = 1;
+		went_idle(p);
+		Orb_waitq_prepare(mynode->idle);
+		if(has_work(p) || Orb_cell_get(p->stopping) != Orb_NIL) {
+			Orb_waitq_cancel(mynode->idle);
+		} else {
+			++w->stats->parks;
+			uint64_t start = measure_time ? Orb_monotonic_ns() : 0;
+			Orb_waitq_wait(mynode->idle);
+			if(start != 0) w->stats->idle_ns += Orb_monotonic_ns() - start;
+		}
+		Orb_cell_add(p->busy, 1);
+		w->parked = 0;
+	}
+}
+
+/*workers of other executors help like outside threads*/
+static int help(pool_t p) {
+	if(!p) return 0;
+	worker_t w = own_worker(p);
+	size_t me = w ? w->node_index : home_node(p);
+	Orb_t todo;
+	int prio;
+	/*workers are already busy; outside helpers become busy
+	while they look for and run a task, so that draining
+	waits for them
+	*/
+	if(!w) Orb_cell_add(p->busy, 1);
+	int found = find_task(p, w, me, &todo, &prio);
+	if(found) run_task(w, todo, prio);
+	if(!w) went_idle(p);
+	return found;
+}
+int Orb_thread_pool_help(void) {
+	worker_t w = Orb_tls_get(current_worker);
+	return help(w ? w->pool : running_pool(default_executor));
+}
+
+/*
+ * Lifecycle
+ */
+static void drain(executor_t ex) {
+	pool_t p = running_pool(ex);
+	if(!p) return;
+
+	if(own_worker(p)) {
+		/*we cannot wait for our own task to finish*/
+		while(help(p)) { }
+		return;
+	}
+	for(;;) {
+		if(help(p)) continue;
+		Orb_waitq_prepare(p->quiet);
+		if(quiescent(p)) {
+			Orb_waitq_cancel(p->quiet);
+			return;
 		}
+		Orb_waitq_wait(p->quiet);
 	}
 }
 
+void Orb_thread_pool_drain(void) {
+	drain(default_executor);
+}
+
+static void shutdown(executor_t ex) {
+	pool_t p = running_pool(ex);
+	if(!p) return;
+	if(own_worker(p)) {
+		Orb_THROW_cc("thread-pool",
+			"Cannot shut down the thread pool from a pool task"
+		);
+	}
+	drain(ex);
+
+	/*keep the size for when the pool is restarted*/
+	ex->requested_size = Orb_t_as_integer(Orb_cell_get(p->target));
+	Orb_cell_set(p->target, Orb_t_from_integer(0));
+	Orb_cell_set(p->stopping, Orb_TRUE);
+	size_t i;
+	for(i = 0; i < p->num_nodes; ++i) {
+		Orb_waitq_notify_all(p->nodes[i].idle);
+	}
+	Orb_waitq_notify_all(p->spares);
+	for(;;) {
+		Orb_waitq_prepare(p->quiet);
+		if(Orb_cell_get(p->live) == Orb_t_from_integer(0) &&
+				Orb_cell_get(p->busy) == Orb_t_from_integer(0)) {
+			Orb_waitq_cancel(p->quiet);
+			break;
+		}
+		Orb_waitq_wait(p->quiet);
+	}
+	/*workers are not done once they go idle: threadlets
+	still release their stacks, and the threads still have
+	to exit.  Wait for that, so that none of them holds a
+	lock across a fork.
+	*/
+	reap_threads(p, 1);
+	/*the next task queued starts a new pool*/
+	Orb_cell_set(ex->pool, Orb_NOTFOUND);
+	remove_running(ex);
+}
+void Orb_thread_pool_shutdown(void) {
+	shutdown(default_executor);
+}
+
+/*
+ * Statistics snapshots
+ */
+void Orb_thread_pool_measure_time(int on) {
+	measure_time = on;
+}
+void Orb_thread_pool_task_hooks(void* (*enter)(void),
+		void (*leave)(void*)) {
+	task_enter = enter;
+	task_leave = leave;
+}
+
+static void add_stats(Orb_pool_stats* out, stats_t s) {
+	out->spawned += s->spawned;
+	out->run += s->run;
+	out->stolen += s->stolen;
+	out->cas_failures += s->cas_failures;
+	out->parks += s->parks;
+	out->spin_hits += s->spin_hits;
+	out->busy_ns += s->busy_ns;
+	out->idle_ns += s->idle_ns;
+	size_t i;
+	for(i = 0; i < Orb_POOL_HISTOGRAM_BUCKETS; ++i) {
+		out->run_time[i] += s->run_time[i];
+	}
+}
+
+static void collect_stats(executor_t ex, Orb_pool_stats* out) {
+	memset(out, 0, sizeof(Orb_pool_stats));
+	pool_t p = running_pool(ex);
+	if(!p) return;
+
+	size_t i;
+	int prio;
+	out->workers = Orb_t_as_integer(Orb_cell_get(p->live));
+	out->blocked = Orb_t_as_integer(Orb_cell_get(p->blocked));
+	workers_t ws = Orb_t_as_pointer(Orb_cell_get(p->workers));
+	for(i = 0; i < ws->n; ++i) {
+		if(ws->w[i]->parked) ++out->idle;
+	}
+	out->queued = queue_depth(p);
+	for(i = 0; i < p->num_nodes; ++i) {
+		node_t n = &p->nodes[i];
+		out->submit_waiters += Orb_waitq_waiters(n->space);
+		for(prio = 0; prio < Orb_PRIO_CLASSES; ++prio) {
+			out->submitted += Orb_ring_pushed(n->inject[prio]);
+		}
+	}
+	out->rejected = Orb_ticket_from_t(Orb_cell_get(p->rejected));
+	out->ran_inline = Orb_ticket_from_t(Orb_cell_get(p->ran_inline));
+	out->submit_waits = Orb_ticket_from_t(Orb_cell_get(p->submit_waits));
+
+	stats_list_t sl = Orb_t_as_pointer(Orb_cell_get(p->stats));
+	for(i = 0; i < sl->n; ++i) add_stats(out, sl->s[i]);
+}
+void Orb_thread_pool_stats(Orb_pool_stats* out) {
+	collect_stats(default_executor, out);
+}
+
+size_t Orb_thread_pool_worker_stats(Orb_pool_stats* out, size_t max) {
+	pool_t p = running_pool(default_executor);
+	if(!p) return 0;
+
+	stats_list_t sl = Orb_t_as_pointer(Orb_cell_get(p->stats));
+	size_t i;
+	for(i = 0; i < sl->n && i < max; ++i) {
+		memset(&out[i], 0, sizeof(Orb_pool_stats));
+		add_stats(&out[i], sl->s[i]);
+	}
+	return i;
+}
+
+/*Orb integers are ints, so large counts saturate*/
+static Orb_t count_to_t(uint64_t x) {
+	return Orb_t_from_integer(x > INT_MAX / 4 ? INT_MAX / 4 : (int) x);
+}
+/*fields common to the whole-pool and per-worker snapshots*/
+static Orb_t stats_object(Orb_pool_stats const* st, Orb_t per_worker) {
+	Orb_t hist[Orb_POOL_HISTOGRAM_BUCKETS];
+	size_t i;
+	for(i = 0; i < Orb_POOL_HISTOGRAM_BUCKETS; ++i) {
+		hist[i] = count_to_t(st->run_time[i]);
+	}
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		if(per_worker != Orb_NOTFOUND) {
+			Orb_B_FIELD_cc("workers", count_to_t(st->workers));
+			Orb_B_FIELD_cc("idle", count_to_t(st->idle));
+			Orb_B_FIELD_cc("blocked", count_to_t(st->blocked));
+			Orb_B_FIELD_cc("queued", count_to_t(st->queued));
+			Orb_B_FIELD_cc("submit-waiters", count_to_t(st->submit_waiters));
+			Orb_B_FIELD_cc("submitted", count_to_t(st->submitted));
+			Orb_B_FIELD_cc("rejected", count_to_t(st->rejected));
+			Orb_B_FIELD_cc("ran-inline", count_to_t(st->ran_inline));
+			Orb_B_FIELD_cc("submit-waits", count_to_t(st->submit_waits));
+			Orb_B_FIELD_cc("per-worker", per_worker);
+		}
+		Orb_B_FIELD_cc("spawned", count_to_t(st->spawned));
+		Orb_B_FIELD_cc("run", count_to_t(st->run));
+		Orb_B_FIELD_cc("stolen", count_to_t(st->stolen));
+		Orb_B_FIELD_cc("cas-failures", count_to_t(st->cas_failures));
+		Orb_B_FIELD_cc("parks", count_to_t(st->parks));
+		Orb_B_FIELD_cc("spin-hits", count_to_t(st->spin_hits));
+		Orb_B_FIELD_cc("busy-us", count_to_t(st->busy_ns / 1000));
+		Orb_B_FIELD_cc("idle-us", count_to_t(st->idle_ns / 1000));
+		Orb_B_FIELD_cc("run-time",
+			Orb_seq(hist, Orb_POOL_HISTOGRAM_BUCKETS)
+		);
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+Orb_t Orb_thread_pool_snapshot(void) {
+	Orb_pool_stats st;
+	Orb_thread_pool_stats(&st);
+
+	pool_t p = running_pool(default_executor);
+	size_t n = 0;
+	if(p) {
+		stats_list_t sl = Orb_t_as_pointer(Orb_cell_get(p->stats));
+		n = sl->n;
+	}
+	Orb_pool_stats* ws = Orb_gc_malloc_pointerfree(
+		(n ? n : 1) * sizeof(Orb_pool_stats)
+	);
+	n = Orb_thread_pool_worker_stats(ws, n);
+	Orb_t* objs = Orb_gc_malloc((n ? n : 1) * sizeof(Orb_t));
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		objs[i] = stats_object(&ws[i], Orb_NOTFOUND);
+	}
+	Orb_t per_worker = Orb_seq(objs, n);
+	Orb_gc_free(objs);
+	Orb_gc_free(ws);
+	return stats_object(&st, per_worker);
+}
+
+static void restart_executors(void) {
+	executors_t es = Orb_t_as_pointer(forked_executors);
+	size_t i;
+	for(i = 0; i < es->n; ++i) get_pool(es->e[i]);
+	executors* nes = Orb_gc_malloc(sizeof(executors));
+	nes->n = 0;
+	forked_executors = Orb_t_from_pointer(nes);
+}
+void Orb_thread_pool_fork_prepare(void) {
+	/*the timer thread submits to the pools*/
+	Orb_timer_fork_prepare();
+	Orb_t oes = Orb_cell_get(running_executors);
+	forked_executors = oes;
+	executors_t es = Orb_t_as_pointer(oes);
+	size_t i;
+	for(i = 0; i < es->n; ++i) shutdown(es->e[i]);
+}
+void Orb_thread_pool_fork_parent(void) {
+	restart_executors();
+	Orb_timer_fork_parent();
+}
+void Orb_thread_pool_fork_child(void) {
+	Orb_thread_support_fork_child();
+	restart_executors();
+	Orb_timer_fork_child();
+}
 
+/*
+ * Managed blocking
+ */
+/*When a worker blocks, the pool starts a spare worker so
+that the target number of workers is still running tasks.
+Spares retire once they are idle and the blocked workers
+have resumed, but stay parked for SPARE_GRACE_NS, so that
+workers that block again and again reuse them instead of
+starting a thread each time.
+*/
+static void blocking_begin(void) {
+	worker_t w = Orb_tls_get(current_worker);
+	if(w == 0 || w->parked) return;
+	if(w->blocking++ > 0) return;
+	pool_t p = w->pool;
+	Orb_cell_add(p->blocked, 1);
+	grow(p);
+}
+static void blocking_end(void) {
+	worker_t w = Orb_tls_get(current_worker);
+	if(w == 0 || w->parked) return;
+	if(--w->blocking > 0) return;
+	pool_t p = w->pool;
+	Orb_cell_add(p->blocked, -1);
+}
+void Orb_thread_pool_blocking_begin(void) {
+	blocking_begin();
+}
+void Orb_thread_pool_blocking_end(void) {
+	blocking_end();
+}
+
+/*
+ * Executor objects
+ */
+static executor_t new_executor(Orb_t name, size_t n) {
+	executor_t ex = Orb_gc_malloc(sizeof(executor));
+	ex->name = name;
+	ex->pool = Orb_cell_init(Orb_NOTFOUND);
+	ex->stack_size = 0;
+	ex->placement = 0;
+	ex->requested_size = n;
+	ex->inject_capacity = Orb_POOL_DEFAULT_QUEUE_CAPACITY;
+	ex->overflow_policy = Orb_POOL_BLOCK;
+	ex->max_spin = SPIN_AUTO;
+	return ex;
+}
+
+static executor_t as_executor(Orb_t o) {
+	return Orb_t_as_pointer(Orb_deref(o, hfield_executor));
+}
+
+static Orb_t add_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to add"
+		);
+	}
+	return Orb_executor_add(argv[1], argv[2]) ? Orb_TRUE : Orb_NIL;
+}
+static Orb_t defer_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to defer"
+		);
+	}
+	return Orb_defer_on(argv[1], argv[2]);
+}
+static Orb_t resize_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to resize"
+		);
+	}
+	Orb_executor_resize(argv[1], Orb_t_as_integer(argv[2]));
+	return Orb_NIL;
+}
+static Orb_t size_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to size"
+		);
+	}
+	return Orb_t_from_integer(Orb_executor_size(argv[1]));
+}
+static Orb_t drain_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to drain"
+		);
+	}
+	Orb_executor_drain(argv[1]);
+	return Orb_NIL;
+}
+static Orb_t shutdown_method(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to shutdown"
+		);
+	}
+	Orb_executor_shutdown(argv[1]);
+	return Orb_NIL;
+}
+
+static void init_executor_base(void) {
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("add",
+			Orb_method(Orb_t_from_cfunc(&add_method))
+		);
+		Orb_B_FIELD_cc("defer",
+			Orb_method(Orb_t_from_cfunc(&defer_method))
+		);
+		Orb_B_FIELD_cc("resize",
+			Orb_method(Orb_t_from_cfunc(&resize_method))
+		);
+		Orb_B_FIELD_cc("size",
+			Orb_method(Orb_t_from_cfunc(&size_method))
+		);
+		Orb_B_FIELD_cc("drain",
+			Orb_method(Orb_t_from_cfunc(&drain_method))
+		);
+		Orb_B_FIELD_cc("shutdown",
+			Orb_method(Orb_t_from_cfunc(&shutdown_method))
+		);
+	} executor_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_new_executor(char const* name, size_t n) {
+	Orb_t oname = Orb_symbol_cc(name);
+	executor_t ex = new_executor(oname, n);
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(executor_base);
+		Orb_B_FIELD(hfield_executor, Orb_t_from_pointer(ex));
+		Orb_B_FIELD_cc("name", oname);
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+Orb_t Orb_default_executor(void) {
+	return odefault_executor;
+}
+
+int Orb_executor_add(Orb_t ex, Orb_t f) {
+	return add_prio(as_executor(ex), f, inherited_prio());
+}
+int Orb_executor_add_prio(Orb_t ex, Orb_t f, int prio) {
+	return add_prio(as_executor(ex), f, prio);
+}
+void Orb_executor_resize(Orb_t ex, size_t n) {
+	resize(as_executor(ex), n);
+}
+size_t Orb_executor_size(Orb_t ex) {
+	return size(as_executor(ex));
+}
+void Orb_executor_drain(Orb_t ex) {
+	drain(as_executor(ex));
+}
+void Orb_executor_shutdown(Orb_t ex) {
+	shutdown(as_executor(ex));
+}
+void Orb_executor_stats(Orb_t ex, Orb_pool_stats* out) {
+	collect_stats(as_executor(ex), out);
+}
+void Orb_executor_stack_size(Orb_t ex, size_t sz) {
+	as_executor(ex)->stack_size = sz;
+}
+void Orb_executor_placement(Orb_t ex, int flags) {
+	as_executor(ex)->placement = flags;
+}
+void Orb_executor_queue_capacity(Orb_t ex, size_t n) {
+	as_executor(ex)->inject_capacity = n;
+}
+void Orb_executor_overflow(Orb_t ex, int policy) {
+	as_executor(ex)->overflow_policy = policy;
+}
+void Orb_executor_spin(Orb_t ex, size_t n) {
+	as_executor(ex)->max_spin = n;
+}
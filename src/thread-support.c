@@ -17,6 +17,9 @@ You should have received a copy of the GNU General Public License
 along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/*for sched_getcpu() and CPU affinity*/
+#define _GNU_SOURCE
+
 #include"liborb.h"
 #include"thread-support.h"
 
@@ -29,8 +32,13 @@ along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
 #include<semaphore.h>
 #include<errno.h>
 #include<unistd.h>
+#include<sys/mman.h>
+#include<limits.h>
+#include<sched.h>
+#include<dirent.h>
 
 #include<string.h>
+#include<time.h>
 
 #include<assert.h>
 
@@ -338,18 +346,76 @@ static void wrap_sem_wait(sem_t* sp) {
 		rv = sem_wait(sp);
 	} while(rv != 0 && errno == EINTR);
 }
+static void (*blocking_begin)(void) = 0;
+static void (*blocking_end)(void) = 0;
+void Orb_blocking_hooks(void (*begin)(void), void (*end)(void)) {
+	blocking_begin = begin;
+	blocking_end = end;
+}
 void Orb_sema_wait(Orb_sema_t sema) {
 	do {
 		if(0 == wrap_sem_trywait(&sema->core)) {
 			return;
 		}
 	} while(GC_collect_a_little());
+	if(blocking_begin) blocking_begin();
 	wrap_sem_wait(&sema->core);
+	if(blocking_end) blocking_end();
+}
+/*returns 0 if timed out*/
+static int wrap_sem_timedwait(sem_t* sp, uint64_t deadline) {
+	for(;;) {
+		/*sem_timedwait() takes a CLOCK_REALTIME deadline*/
+		uint64_t now = Orb_monotonic_ns();
+		if(now >= deadline) return 0 == wrap_sem_trywait(sp);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t real = (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec
+			+ (deadline - now);
+		ts.tv_sec = real / 1000000000u;
+		ts.tv_nsec = real % 1000000000u;
+		errno = 0;
+		if(sem_timedwait(sp, &ts) == 0) return 1;
+		if(errno != EINTR && errno != ETIMEDOUT) return 0;
+	}
+}
+int Orb_sema_wait_until(Orb_sema_t sema, uint64_t deadline) {
+	do {
+		if(0 == wrap_sem_trywait(&sema->core)) {
+			return 1;
+		}
+	} while(GC_collect_a_little());
+	if(blocking_begin) blocking_begin();
+	int rv = wrap_sem_timedwait(&sema->core, deadline);
+	if(blocking_end) blocking_end();
+	return rv;
+}
+int Orb_sema_wait_for(Orb_sema_t sema, uint64_t ns) {
+	return Orb_sema_wait_until(sema, Orb_monotonic_ns() + ns);
 }
 void Orb_sema_post(Orb_sema_t sema) {
 	sem_post(&sema->core);
 }
 
+#if !defined(HAVE_SOME_CAS) && defined(__GNUC__) &&\
+		(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+	#define HAVE_SOME_CAS
+
+	/*GCC atomic builtins*/
+	#define cas_init()
+
+	static inline Orb_t cas(Orb_t* loc, Orb_t old, Orb_t newval) {
+		/*on failure, old is overwritten with the current value*/
+		__atomic_compare_exchange_n(loc, &old, newval, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST
+		);
+		return old;
+	}
+	static inline Orb_t safe_read(Orb_t* loc) {
+		return __atomic_load_n(loc, __ATOMIC_ACQUIRE);
+	}
+#endif /*GCC atomic builtins*/
+
 #ifndef HAVE_SOME_CAS
 
 	/*default implementation if no CAS available*/
@@ -434,6 +500,269 @@ void Orb_cell_set(Orb_cell_t c, Orb_t val) {
 Orb_t Orb_cell_cas_get(Orb_cell_t c, Orb_t old, Orb_t newv) {
 	return cas(&c->core, old, newv);
 }
+int Orb_cell_add(Orb_cell_t c, int delta) {
+	Orb_t curv, oldv;
+	int nv;
+	oldv = safe_read(&c->core);
+	do {
+		curv = oldv;
+		nv = Orb_t_as_integer(curv) + delta;
+	} while(curv != (oldv = cas(&c->core, oldv, Orb_t_from_integer(nv))));
+	return nv;
+}
+Orb_ticket_t Orb_cell_ticket_add(Orb_cell_t c, Orb_ticket_t delta) {
+	Orb_t curv, oldv;
+	Orb_ticket_t nv;
+	oldv = safe_read(&c->core);
+	do {
+		curv = oldv;
+		nv = Orb_ticket_from_t(curv) + delta;
+	} while(curv != (oldv = cas(&c->core, oldv, Orb_t_from_ticket(nv))));
+	return nv;
+}
+Orb_cell_t Orb_cell_array_init(size_t n, Orb_t init) {
+	Orb_cell_t rv = Orb_gc_malloc(n * sizeof(struct Orb_cell_s));
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		Orb_cell_set(&rv[i], init);
+	}
+	return rv;
+}
+Orb_cell_t Orb_cell_array_ref(Orb_cell_t arr, size_t i) {
+	return &arr[i];
+}
+
+/*
+ * Exponential backoff
+ */
+/*beyond this many spins, give up the time slice instead*/
+#define BACKOFF_MAX_SPINS 1024
+
+void Orb_backoff_wait(Orb_backoff* b) {
+	if(b->spins > BACKOFF_MAX_SPINS) {
+		Orb_yield();
+		return;
+	}
+	size_t i;
+	for(i = 0; i < b->spins; ++i) {
+		Orb_cpu_relax();
+	}
+	b->spins *= 2;
+}
+
+/*
+ * Wait queues
+ */
+struct Orb_waitq_s {
+	Orb_cell_t waiters;
+	Orb_sema_t sema;
+};
+
+Orb_waitq_t Orb_waitq_init(void) {
+	Orb_waitq_t q = Orb_gc_malloc(sizeof(struct Orb_waitq_s));
+	q->waiters = Orb_cell_init(Orb_t_from_integer(0));
+	q->sema = Orb_sema_init(0);
+	return q;
+}
+void Orb_waitq_prepare(Orb_waitq_t q) {
+	Orb_cell_add(q->waiters, 1);
+}
+void Orb_waitq_wait(Orb_waitq_t q) {
+	Orb_sema_wait(q->sema);
+}
+/*remove a registered waiter.  Returns non-0 if a notifier
+had already removed it, in which case its post is consumed.
+*/
+static int waitq_unregister(Orb_waitq_t q) {
+	Orb_t ow = Orb_cell_get(q->waiters);
+	for(;;) {
+		if(ow == Orb_t_from_integer(0)) {
+			/*a notifier has already removed us, so
+			consume the post it will make
+			*/
+			Orb_sema_wait(q->sema);
+			return 1;
+		}
+		Orb_t nw = Orb_t_from_integer(Orb_t_as_integer(ow) - 1);
+		Orb_t read = Orb_cell_cas_get(q->waiters, ow, nw);
+		if(read == ow) return 0;
+		ow = read;
+	}
+}
+int Orb_waitq_wait_until(Orb_waitq_t q, uint64_t deadline) {
+	if(Orb_sema_wait_until(q->sema, deadline)) return 1;
+	/*a notify that raced with the timeout still counts*/
+	return waitq_unregister(q);
+}
+void Orb_waitq_cancel(Orb_waitq_t q) {
+	waitq_unregister(q);
+}
+size_t Orb_waitq_notify(Orb_waitq_t q, size_t n) {
+	Orb_t ow = Orb_cell_get(q->waiters);
+	for(;;) {
+		size_t w = Orb_t_as_integer(ow);
+		if(w == 0 || n == 0) return 0;
+		if(n > w) n = w;
+		Orb_t nw = Orb_t_from_integer(w - n);
+		Orb_t read = Orb_cell_cas_get(q->waiters, ow, nw);
+		if(read == ow) break;
+		ow = read;
+	}
+	size_t i;
+	for(i = 0; i < n; ++i) {
+		Orb_sema_post(q->sema);
+	}
+	return n;
+}
+size_t Orb_waitq_waiters(Orb_waitq_t q) {
+	return Orb_t_as_integer(Orb_cell_get(q->waiters));
+}
+/*
+ * Rings
+ */
+/*Each slot of a ring has a sequence number which tells
+whether it is ready to be written or read for a particular
+ticket.
+*/
+struct Orb_ring_s {
+	size_t mask;
+	Orb_cell_t seqs;
+	Orb_cell_t values;
+	Orb_cell_t enq;
+	Orb_cell_t deq;
+};
+Orb_ring_t Orb_ring_init(size_t capacity) {
+	Orb_ring_t r = Orb_gc_malloc(sizeof(struct Orb_ring_s));
+	/*a ring of 1 slot cannot tell a full slot from an empty
+	one, since both have the next ticket as sequence number
+	*/
+	size_t size = 2;
+	while(size < capacity) size = size << 1;
+	r->mask = size - 1;
+	r->seqs = Orb_cell_array_init(size, Orb_NIL);
+	r->values = Orb_cell_array_init(size, Orb_NIL);
+	size_t i;
+	for(i = 0; i < size; ++i) {
+		Orb_cell_set(Orb_cell_array_ref(r->seqs, i),
+			Orb_t_from_ticket(i)
+		);
+	}
+	r->enq = Orb_cell_init(Orb_t_from_ticket(0));
+	r->deq = Orb_cell_init(Orb_t_from_ticket(0));
+	return r;
+}
+int Orb_ring_push(Orb_ring_t r, Orb_t v) {
+	Orb_ticket_t pos = Orb_ticket_from_t(Orb_cell_get(r->enq));
+	for(;;) {
+		size_t i = pos & r->mask;
+		Orb_cell_t seq = Orb_cell_array_ref(r->seqs, i);
+		intptr_t dif = Orb_ticket_diff(
+			Orb_ticket_from_t(Orb_cell_get(seq)), pos
+		);
+		if(dif == 0) {
+			Orb_t read = Orb_cell_cas_get(r->enq,
+				Orb_t_from_ticket(pos), Orb_t_from_ticket(pos + 1)
+			);
+			if(read == Orb_t_from_ticket(pos)) {
+				Orb_cell_set(Orb_cell_array_ref(r->values, i), v);
+				Orb_cell_set(seq, Orb_t_from_ticket(pos + 1));
+				return 1;
+			}
+			pos = Orb_ticket_from_t(read);
+		} else if(dif < 0) {
+			return 0;
+		} else {
+			pos = Orb_ticket_from_t(Orb_cell_get(r->enq));
+		}
+	}
+}
+size_t Orb_ring_push_n(Orb_ring_t r, Orb_t const* vs, size_t n) {
+	size_t done = 0;
+	Orb_ticket_t pos = Orb_ticket_from_t(Orb_cell_get(r->enq));
+	while(done < n) {
+		/*count the free slots from pos on*/
+		size_t k;
+		for(k = 0; done + k < n && k <= r->mask; ++k) {
+			Orb_cell_t seq = Orb_cell_array_ref(r->seqs,
+				(pos + k) & r->mask
+			);
+			if(Orb_ticket_from_t(Orb_cell_get(seq)) != pos + k) break;
+		}
+		if(k == 0) {
+			intptr_t dif = Orb_ticket_diff(
+				Orb_ticket_from_t(Orb_cell_get(
+					Orb_cell_array_ref(r->seqs, pos & r->mask)
+				)),
+				pos
+			);
+			if(dif < 0) return done; /*full*/
+			pos = Orb_ticket_from_t(Orb_cell_get(r->enq));
+			continue;
+		}
+		Orb_t read = Orb_cell_cas_get(r->enq,
+			Orb_t_from_ticket(pos), Orb_t_from_ticket(pos + k)
+		);
+		if(read != Orb_t_from_ticket(pos)) {
+			pos = Orb_ticket_from_t(read);
+			continue;
+		}
+		size_t j;
+		for(j = 0; j < k; ++j) {
+			size_t i = (pos + j) & r->mask;
+			Orb_cell_set(Orb_cell_array_ref(r->values, i), vs[done + j]);
+			Orb_cell_set(Orb_cell_array_ref(r->seqs, i),
+				Orb_t_from_ticket(pos + j + 1)
+			);
+		}
+		done += k;
+		pos += k;
+	}
+	return done;
+}
+int Orb_ring_pop(Orb_ring_t r, Orb_t* pv) {
+	Orb_ticket_t pos = Orb_ticket_from_t(Orb_cell_get(r->deq));
+	for(;;) {
+		size_t i = pos & r->mask;
+		Orb_cell_t seq = Orb_cell_array_ref(r->seqs, i);
+		intptr_t dif = Orb_ticket_diff(
+			Orb_ticket_from_t(Orb_cell_get(seq)), pos + 1
+		);
+		if(dif == 0) {
+			Orb_t read = Orb_cell_cas_get(r->deq,
+				Orb_t_from_ticket(pos), Orb_t_from_ticket(pos + 1)
+			);
+			if(read == Orb_t_from_ticket(pos)) {
+				Orb_cell_t value = Orb_cell_array_ref(r->values, i);
+				*pv = Orb_cell_get(value);
+				/*let the GC have it*/
+				Orb_cell_set(value, Orb_NIL);
+				Orb_cell_set(seq,
+					Orb_t_from_ticket(pos + r->mask + 1)
+				);
+				return 1;
+			}
+			pos = Orb_ticket_from_t(read);
+		} else if(dif < 0) {
+			return 0;
+		} else {
+			pos = Orb_ticket_from_t(Orb_cell_get(r->deq));
+		}
+	}
+}
+size_t Orb_ring_size(Orb_ring_t r) {
+	Orb_ticket_t deq = Orb_ticket_from_t(Orb_cell_get(r->deq));
+	Orb_ticket_t enq = Orb_ticket_from_t(Orb_cell_get(r->enq));
+	intptr_t size = Orb_ticket_diff(enq, deq);
+	if(size < 0) return 0;
+	if(size > (intptr_t) (r->mask + 1)) return r->mask + 1;
+	return size;
+}
+size_t Orb_ring_capacity(Orb_ring_t r) {
+	return r->mask + 1;
+}
+size_t Orb_ring_pushed(Orb_ring_t r) {
+	return Orb_ticket_from_t(Orb_cell_get(r->enq));
+}
 
 /*
  * C Extension Lock
@@ -473,9 +802,471 @@ void Orb_thread_support_init(void) {
 /*
  * Number of processors
  */
+/*
+Containers usually restrict us to fewer processors than the
+machine has, either with an affinity mask or with a CPU
+bandwidth quota in our cgroup.  We honor both.
+*/
+#ifdef __linux__
+/*reads the first line of a file; returns 0 on failure*/
+static int read_line(char const* path, char* buf, size_t sz) {
+	FILE* fp = fopen(path, "r");
+	if(fp == 0) return 0;
+	char* rv = fgets(buf, sz, fp);
+	fclose(fp);
+	return rv != 0;
+}
+/*finds the path of our cgroup for the given controller, or
+of our cgroup v2 unified hierarchy if controller is 0.
+*/
+static int own_cgroup(char const* controller, char* buf, size_t sz) {
+	FILE* fp = fopen("/proc/self/cgroup", "r");
+	char line[512];
+	int found = 0;
+	if(fp == 0) return 0;
+	while(!found && fgets(line, sizeof(line), fp)) {
+		/*hierarchy-ID:controller-list:path*/
+		char* controllers = strchr(line, ':');
+		if(controllers == 0) continue;
+		++controllers;
+		char* path = strchr(controllers, ':');
+		if(path == 0) continue;
+		*path++ = 0;
+		if(controller == 0) {
+			if(*controllers != 0) continue;
+		} else {
+			/*look for controller in comma-separated list*/
+			size_t len = strlen(controller);
+			char* c = controllers;
+			int match = 0;
+			while(c && !match) {
+				match = strncmp(c, controller, len) == 0 &&
+					(c[len] == ',' || c[len] == 0);
+				c = strchr(c, ',');
+				if(c) ++c;
+			}
+			if(!match) continue;
+		}
+		path[strcspn(path, "\n")] = 0;
+		snprintf(buf, sz, "%s", path);
+		found = 1;
+	}
+	fclose(fp);
+	return found;
+}
+/*number of CPUs our quota allows (rounded up), or 0 if
+unlimited or unknown.
+*/
+static size_t quota_cpus(long quota, long period) {
+	if(quota <= 0 || period <= 0) return 0;
+	return (quota + period - 1) / period;
+}
+static size_t cgroup_v2_cpus(void) {
+	char cg[256], path[512], line[128];
+	long quota, period;
+	if(own_cgroup(0, cg, sizeof(cg))) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cg);
+		if(!read_line(path, line, sizeof(line))) {
+			cg[0] = 0;
+		}
+	} else cg[0] = 0;
+	if(cg[0] == 0 &&
+			!read_line("/sys/fs/cgroup/cpu.max", line, sizeof(line))) {
+		return 0;
+	}
+	/*"max 100000" means unlimited*/
+	if(sscanf(line, "%ld %ld", &quota, &period) != 2) return 0;
+	return quota_cpus(quota, period);
+}
+static size_t cgroup_v1_cpus(void) {
+	static char const* mounts[] = {
+		"/sys/fs/cgroup/cpu,cpuacct",
+		"/sys/fs/cgroup/cpu",
+		0
+	};
+	char cg[256], path[512], line[128];
+	long quota, period;
+	if(!own_cgroup("cpu", cg, sizeof(cg))) cg[0] = 0;
+	size_t i;
+	for(i = 0; mounts[i]; ++i) {
+		/*try our own cgroup first, then the root (which is
+		what we see if we have a cgroup namespace)
+		*/
+		int j;
+		for(j = 0; j < 2; ++j) {
+			char const* sub = j == 0 ? cg : "";
+			snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us",
+				mounts[i], sub
+			);
+			if(!read_line(path, line, sizeof(line))) continue;
+			quota = strtol(line, 0, 10);
+			snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us",
+				mounts[i], sub
+			);
+			if(!read_line(path, line, sizeof(line))) continue;
+			period = strtol(line, 0, 10);
+			return quota_cpus(quota, period);
+		}
+	}
+	return 0;
+}
+#endif
+
+uint64_t Orb_monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
 size_t Orb_num_processors(void) {
 	/*TODO: make more portable*/
-	return sysconf(_SC_NPROCESSORS_ONLN);
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t rv = online > 0 ? online : 1;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		size_t n = CPU_COUNT(&set);
+		if(n > 0 && n < rv) rv = n;
+	}
+	size_t quota = cgroup_v2_cpus();
+	if(quota == 0) quota = cgroup_v1_cpus();
+	if(quota > 0 && quota < rv) rv = quota;
+#endif
+	return rv;
+}
+
+/*
+ * CPU placement and NUMA topology
+ *
+ * On Linux the topology is read once from
+ * /sys/devices/system/node/node<N>/cpulist.  Elsewhere, or if
+ * sysfs is unavailable, everything is on a single node 0.
+ * Nodes are renumbered densely from 0.
+ */
+#define MAX_CPUS 1024
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static size_t numa_nodes = 1;
+static unsigned short cpu_node[MAX_CPUS];
+
+#ifdef __linux__
+/*parses a cpulist such as "0-3,8,10-11"*/
+static void parse_cpulist(char const* s, unsigned short node) {
+	while(*s) {
+		char* end;
+		unsigned long lo = strtoul(s, &end, 10);
+		unsigned long hi = lo;
+		if(end == s) return;
+		s = end;
+		if(*s == '-') {
+			++s;
+			hi = strtoul(s, &end, 10);
+			if(end == s) return;
+			s = end;
+		}
+		for(; lo <= hi && lo < MAX_CPUS; ++lo) {
+			cpu_node[lo] = node;
+		}
+		if(*s != ',') return;
+		++s;
+	}
+}
+#endif
+
+static void topology_init(void) {
+	memset(cpu_node, 0, sizeof(cpu_node));
+	numa_nodes = 1;
+#ifdef __linux__
+	DIR* dir = opendir("/sys/devices/system/node");
+	if(dir == 0) return;
+	size_t found = 0;
+	struct dirent* ent;
+	while((ent = readdir(dir)) != 0) {
+		char* end;
+		if(strncmp(ent->d_name, "node", 4) != 0) continue;
+		strtoul(&ent->d_name[4], &end, 10);
+		if(end == &ent->d_name[4] || *end != 0) continue;
+
+		char path[300];
+		char buf[4096];
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/node/%s/cpulist", ent->d_name
+		);
+		FILE* fp = fopen(path, "r");
+		if(fp == 0) continue;
+		size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+		fclose(fp);
+		buf[len] = 0;
+		/*skip memory-only nodes*/
+		if(len == 0 || buf[0] == '\n') continue;
+
+		parse_cpulist(buf, found);
+		++found;
+	}
+	closedir(dir);
+	if(found > 0) numa_nodes = found;
+#endif
+}
+
+size_t Orb_numa_num_nodes(void) {
+	pthread_once(&topology_once, &topology_init);
+	return numa_nodes;
+}
+size_t Orb_numa_node_of_cpu(size_t cpu) {
+	pthread_once(&topology_once, &topology_init);
+	if(cpu >= MAX_CPUS) return 0;
+	return cpu_node[cpu];
+}
+size_t Orb_current_cpu(void) {
+#ifdef __linux__
+	int rv = sched_getcpu();
+	if(rv >= 0) return rv;
+#endif
+	return 0;
+}
+size_t Orb_usable_cpus(size_t* cpus, size_t max) {
+	size_t n = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		size_t i;
+		for(i = 0; i < CPU_SETSIZE && n < max; ++i) {
+			if(CPU_ISSET(i, &set)) cpus[n++] = i;
+		}
+		if(n > 0) return n;
+	}
+#endif
+	size_t total = Orb_num_processors();
+	for(n = 0; n < total && n < max; ++n) {
+		cpus[n] = n;
+	}
+	return n;
+}
+int Orb_pin_thread_to_cpu(size_t cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	if(cpu >= CPU_SETSIZE) return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Threadlet stacks
+ *
+ * Threadlets run on small mmap()ed stacks with an inaccessible
+ * guard page below them, so that an overflow faults instead of
+ * silently corrupting memory.  Stacks are recycled: a finishing
+ * threadlet puts itself at the end of the zombie list, and later
+ * threadlet launches join the oldest zombie (so that nothing is
+ * still running on its stack) and reuse its stack.  The list is
+ * kept short: once it holds MAX_ZOMBIE_STACKS, each finishing
+ * threadlet joins the oldest zombie and frees its stack, so a
+ * burst of threadlets does not leave all of their stacks waiting
+ * to be joined.
+ */
+struct tstack_s {
+	void* base; /*start of the mapping, including guard page*/
+	struct tstack_s* next;
+	pthread_t tid; /*thread to join, while on the zombie list*/
+};
+typedef struct tstack_s* tstack_t;
+
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static tstack_t free_stacks = 0;
+static size_t num_free_stacks = 0;
+/*oldest first*/
+static tstack_t zombie_stacks = 0;
+static tstack_t zombie_stacks_tail = 0;
+static size_t num_zombie_stacks = 0;
+static size_t num_mapped_stacks = 0;
+static size_t threadlet_stack_size = Orb_THREADLET_DEFAULT_STACK_SIZE;
+static size_t threadlets_started = 0;
+
+/*don't keep more than this many unused stacks around*/
+#define MAX_FREE_STACKS 1024
+/*most finished threadlets left waiting to be joined*/
+#define MAX_ZOMBIE_STACKS 16
+
+static size_t page_size(void) {
+	long rv = sysconf(_SC_PAGESIZE);
+	return rv > 0 ? (size_t) rv : 4096;
+}
+static size_t round_to_page(size_t sz) {
+	size_t ps = page_size();
+	return ((sz + ps - 1) / ps) * ps;
+}
+static size_t stack_mapping_size(void) {
+	return threadlet_stack_size + page_size();
+}
+
+size_t Orb_threadlet_stack_size(size_t sz) {
+	BLOCK_SIGNALS_DECL;
+	size_t rv;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	/*pooled stacks all have the same size, so the size
+	can only be changed before the first threadlet.
+	*/
+	if(sz != 0 && threadlets_started == 0) {
+		if(sz < (size_t) PTHREAD_STACK_MIN) sz = PTHREAD_STACK_MIN;
+		threadlet_stack_size = round_to_page(sz);
+	}
+	rv = threadlet_stack_size;
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+
+	return rv;
+}
+
+/*put a stack that nothing runs on back in the pool*/
+static void stack_free(tstack_t s) {
+	BLOCK_SIGNALS_DECL;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	if(num_free_stacks < MAX_FREE_STACKS) {
+		s->next = free_stacks;
+		free_stacks = s;
+		++num_free_stacks;
+		s = 0;
+	}
+	if(s) --num_mapped_stacks;
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	if(s) {
+		munmap(s->base, stack_mapping_size());
+		free(s);
+	}
+}
+/*take the oldest zombie.  Call with stacks_lock held.*/
+static tstack_t take_zombie(void) {
+	tstack_t rv = zombie_stacks;
+	if(rv) {
+		zombie_stacks = rv->next;
+		if(!zombie_stacks) zombie_stacks_tail = 0;
+		--num_zombie_stacks;
+	}
+	return rv;
+}
+static tstack_t stack_alloc(void) {
+	BLOCK_SIGNALS_DECL;
+	tstack_t rv;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	++threadlets_started;
+	rv = take_zombie();
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	if(rv) {
+		/*join outside the lock.  The threadlet has already
+		finished running Orb code, so this does not block
+		for long.
+		*/
+		pthread_join(rv->tid, 0);
+		return rv;
+	}
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	if(free_stacks) {
+		rv = free_stacks;
+		free_stacks = rv->next;
+		--num_free_stacks;
+	}
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	if(rv) return rv;
+
+	/*need a fresh stack*/
+	rv = malloc(sizeof(struct tstack_s));
+	if(rv == 0) {
+		Orb_THROW_cc("thread", "Out of memory");
+	}
+	void* base = mmap(0, stack_mapping_size(),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if(base == MAP_FAILED) {
+		free(rv);
+		Orb_THROW_cc("thread", "Unable to allocate threadlet stack");
+	}
+	/*stacks grow downward on all the targets we care about*/
+	mprotect(base, page_size(), PROT_NONE);
+	rv->base = base;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	++num_mapped_stacks;
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	return rv;
+}
+/*called by a threadlet just before it exits*/
+static void stack_release(tstack_t s) {
+	BLOCK_SIGNALS_DECL;
+	tstack_t oldest = 0;
+	s->tid = pthread_self();
+	s->next = 0;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	if(zombie_stacks_tail) {
+		zombie_stacks_tail->next = s;
+	} else {
+		zombie_stacks = s;
+	}
+	zombie_stacks_tail = s;
+	++num_zombie_stacks;
+	if(num_zombie_stacks > MAX_ZOMBIE_STACKS) oldest = take_zombie();
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+
+	/*joins only ever wait for older zombies, so they cannot
+	wait for each other
+	*/
+	if(oldest) {
+		pthread_join(oldest->tid, 0);
+		stack_free(oldest);
+	}
+}
+/*undo stack_alloc() if the threadlet could not be started*/
+static void stack_unalloc(tstack_t s) {
+	BLOCK_SIGNALS_DECL;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	--num_mapped_stacks;
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	munmap(s->base, stack_mapping_size());
+	free(s);
+}
+size_t Orb_priv_threadlet_stacks(void) {
+	BLOCK_SIGNALS_DECL;
+	size_t rv;
+
+	BLOCK_SIGNALS;
+	pthread_mutex_lock(&stacks_lock);
+	rv = num_mapped_stacks;
+	pthread_mutex_unlock(&stacks_lock);
+	UNBLOCK_SIGNALS;
+	return rv;
+}
+void Orb_thread_support_fork_child(void) {
+	/*the threads of the parent do not exist here, so
+	nothing runs on the stacks of its zombies, and the lock
+	may have been held by one of them
+	*/
+	pthread_mutex_init(&stacks_lock, 0);
+	tstack_t s;
+	while((s = take_zombie())) stack_free(s);
 }
 
 /*
@@ -484,6 +1275,8 @@ size_t Orb_num_processors(void) {
 struct Orb_thread_s {
 	Orb_cell_t cstate;
 	pthread_t tid;
+	tstack_t stack; /*0 if not a threadlet*/
+	int joinable;
 };
 struct threadstate_s {
 	enum {
@@ -497,19 +1290,65 @@ typedef struct threadstate_s* threadstate_t;
 static void* new_thread(void*);
 
 Orb_thread_t Orb_priv_new_thread(Orb_t f) {
+	return Orb_priv_new_thread_ex(f, 0);
+}
+
+static Orb_thread_t launch(Orb_t f, size_t stacksize, int joinable) {
 	threadstate_t ts = Orb_gc_malloc(sizeof(struct threadstate_s));
 	ts->state = running;
 	ts->ob = f;
 	Orb_thread_t rv = Orb_gc_malloc(sizeof(struct Orb_thread_s));
 	rv->cstate = Orb_cell_init(Orb_t_from_pointer(ts));
+	rv->stack = 0;
+	rv->joinable = joinable;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if(stacksize == Orb_THREADLET_STACK) {
+		/*joined when its stack is recycled, unless someone
+		else joins it
+		*/
+		rv->stack = stack_alloc();
+		pthread_attr_setstack(&attr,
+			((char*) rv->stack->base) + page_size(),
+			threadlet_stack_size
+		);
+	} else {
+		/*nobody joins ordinary threads*/
+		if(!joinable) {
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		}
+		if(stacksize != 0) {
+			if(stacksize < (size_t) PTHREAD_STACK_MIN) {
+				stacksize = PTHREAD_STACK_MIN;
+			}
+			pthread_attr_setstacksize(&attr, round_to_page(stacksize));
+		}
+	}
 
-	int err = pthread_create(&rv->tid, 0, new_thread, rv);
+	int err = pthread_create(&rv->tid, &attr, new_thread, rv);
+	pthread_attr_destroy(&attr);
 	if(err != 0) {
+		if(rv->stack) stack_unalloc(rv->stack);
 		/*TODO get error message from system*/
 		Orb_THROW_cc("thread", "Error launching thread");
 	}
 	return rv;
 }
+Orb_thread_t Orb_priv_new_thread_ex(Orb_t f, size_t stacksize) {
+	return launch(f, stacksize, 0);
+}
+Orb_thread_t Orb_priv_new_joinable_thread(Orb_t f, size_t stacksize) {
+	return launch(f, stacksize, 1);
+}
+void Orb_priv_thread_join(Orb_thread_t t) {
+	pthread_join(t->tid, 0);
+	if(t->stack) stack_free(t->stack);
+}
+int Orb_priv_thread_finished(Orb_thread_t t) {
+	threadstate_t ts = Orb_t_as_pointer(Orb_cell_get(t->cstate));
+	return ts->state == finished;
+}
 
 static void* new_thread(void* vpt) {
 	Orb_thread_t pt = vpt;
@@ -527,9 +1366,77 @@ static void* new_thread(void* vpt) {
 
 	Orb_cell_set(pt->cstate, Orb_t_from_pointer(npts));
 
+	if(pt->stack && !pt->joinable) stack_release(pt->stack);
+
 	return 0;
 }
 
+/*
+thread objects have the following interface:
+(def thread-base
+  (obj!extend
+    ; t once the thread's function has returned
+    'finished (method:fn (self) ...)
+    ; the value the thread's function returned, or nil
+    ; while it is still running
+    'result (method:fn (self) ...)))
+*/
+static Orb_t hfield_thread;
+static Orb_t thread_base;
+
+static Orb_thread_t get_thread(Orb_t this) {
+	return Orb_t_as_pointer(Orb_deref(this, hfield_thread));
+}
+static Orb_t finished_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to finished"
+		);
+	}
+	return Orb_priv_thread_finished(get_thread(argv[1])) ?
+		Orb_TRUE : Orb_NIL;
+}
+static Orb_t result_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to result"
+		);
+	}
+	Orb_thread_t t = get_thread(argv[1]);
+	threadstate_t ts = Orb_t_as_pointer(Orb_cell_get(t->cstate));
+	return ts->state == finished ? ts->ob : Orb_NIL;
+}
+void Orb_thread_objects_init(void) {
+	Orb_gc_defglobal(&hfield_thread);
+	Orb_gc_defglobal(&thread_base);
+
+	hfield_thread = Orb_t_from_pointer(&hfield_thread);
+
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("finished",
+			Orb_method(Orb_t_from_cfunc(&finished_cfunc))
+		);
+		Orb_B_FIELD_cc("result",
+			Orb_method(Orb_t_from_cfunc(&result_cfunc))
+		);
+	} thread_base = Orb_ENDBUILDER;
+}
+static Orb_t thread_object(Orb_thread_t t) {
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(thread_base);
+		Orb_B_FIELD(hfield_thread, Orb_t_from_pointer(t));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+Orb_t Orb_new_thread(Orb_t f) {
+	return thread_object(Orb_priv_new_thread(f));
+}
+Orb_t Orb_new_threadlet(Orb_t f) {
+	return thread_object(Orb_priv_new_thread_ex(f, Orb_THREADLET_STACK));
+}
+
 /*
  *  Yield processor time
  */
@@ -0,0 +1,427 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include"liborb.h"
+#include"thread-support.h"
+#include"timer.h"
+
+/*
+timer objects have the following interface:
+(def timer-base
+  (obj!extend
+    ; stops the timer.  Returns t if a one-shot timer had
+    ; not fired yet, or a periodic timer had not already
+    ; been cancelled.
+    'cancel (method:fn (self) ...)))
+
+All timers live in a single hierarchical timing wheel with
+LEVELS levels of SLOTS slots each.  Level 0 has one slot per
+tick, and each slot of level n covers a whole turn of level
+n - 1.  Every time level n - 1 completes a turn, the timers
+in the next slot of level n are spread out over level n - 1
+("cascaded").  Adding, cancelling and firing a timer are
+thus all O(1).
+
+The wheel is only touched by the timer thread, which
+submits due timers to the thread pool.  Other threads hand
+new and cancelled timers to it through lock-free stacks,
+and only wake it up if a new timer is due before it would
+wake up anyway.
+*/
+
+#define TICK Orb_TIMER_TICK_NS
+#define LEVEL_BITS 6
+#define SLOTS (1 << LEVEL_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define LEVELS 4
+/*farthest ahead a timer can be placed, in ticks.  Timers
+due later are placed as far as possible, and placed again
+when they are cascaded.
+*/
+#define WHEEL_SPAN ((uint64_t) 1 << (LEVEL_BITS * LEVELS))
+/*tick at which a timer thread with nothing to do wakes*/
+#define NEVER (((uint64_t) -1) >> 2)
+/*number of due timers submitted to the pool at once*/
+#define FIRE_BATCH 64
+
+/*timer states*/
+#define PENDING Orb_t_from_integer(0)
+#define FIRED Orb_t_from_integer(1)
+#define CANCELLED Orb_t_from_integer(2)
+
+/*a timer*/
+struct entry_s {
+	/*slot list; only used by the timer thread*/
+	struct entry_s* next;
+	struct entry_s* prev;
+	int linked;
+	/*links in the added and cancelled stacks*/
+	struct entry_s* next_added;
+	struct entry_s* next_cancelled;
+	Orb_t f;
+	uint64_t due; /*tick*/
+	uint64_t period; /*ticks, 0 for one-shot timers*/
+	Orb_cell_t state;
+};
+typedef struct entry_s entry;
+typedef entry* entry_t;
+
+struct wheel_s {
+	/*heads of circular slot lists*/
+	entry slots[LEVELS][SLOTS];
+	uint64_t current; /*last tick processed*/
+	size_t count; /*number of timers in slots*/
+	Orb_t batch[FIRE_BATCH];
+	size_t batch_size;
+	/*shared with other threads*/
+	uint64_t epoch; /*Orb_monotonic_ns() at tick 0*/
+	Orb_cell_t added; /*entry_t stack, or Orb_NIL*/
+	Orb_cell_t cancelled; /*entry_t stack, or Orb_NIL*/
+	/*ticket: tick the timer thread sleeps until, 0 while
+	it is awake
+	*/
+	Orb_cell_t sleep_until;
+	Orb_sema_t wake;
+	Orb_cell_t started;
+	/*Orb_TRUE while the timer thread is asked to exit*/
+	Orb_cell_t stopping;
+	Orb_thread_t thread;
+	/*non-0 if the thread was running when the process forked*/
+	int restart_after_fork;
+};
+typedef struct wheel_s wheel;
+typedef wheel* wheel_t;
+
+static Orb_t owheel;
+static Orb_t hfield1;
+static Orb_t timer_base;
+
+static wheel_t get_wheel(void) {
+	return Orb_t_as_pointer(owheel);
+}
+
+/*
+ * Hand-off stacks
+ */
+static void push(Orb_cell_t stack, entry_t t, entry_t* pnext) {
+	Orb_t ohead = Orb_cell_get(stack);
+	for(;;) {
+		*pnext = (ohead == Orb_NIL) ? 0 : Orb_t_as_pointer(ohead);
+		Orb_t read = Orb_cell_cas_get(stack, ohead, Orb_t_from_pointer(t));
+		if(read == ohead) return;
+		ohead = read;
+	}
+}
+static entry_t take_all(Orb_cell_t stack) {
+	Orb_t ohead = Orb_cell_get(stack);
+	while(ohead != Orb_NIL) {
+		Orb_t read = Orb_cell_cas_get(stack, ohead, Orb_NIL);
+		if(read == ohead) return Orb_t_as_pointer(ohead);
+		ohead = read;
+	}
+	return 0;
+}
+
+/*
+ * The wheel, only used by the timer thread
+ */
+static void slot_init(entry_t head) {
+	head->next = head;
+	head->prev = head;
+}
+static void link_timer(entry_t head, entry_t t) {
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+	t->linked = 1;
+}
+static void unlink_timer(wheel_t wh, entry_t t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->linked = 0;
+	--wh->count;
+}
+
+static void flush_batch(wheel_t wh) {
+	if(wh->batch_size == 0) return;
+	Orb_thread_pool_add_n(wh->batch, wh->batch_size);
+	size_t i;
+	for(i = 0; i < wh->batch_size; ++i) wh->batch[i] = Orb_NIL;
+	wh->batch_size = 0;
+}
+
+static void place(wheel_t wh, entry_t t);
+
+/*submit a due timer, and place periodic timers again*/
+static void fire(wheel_t wh, entry_t t) {
+	if(t->period == 0) {
+		if(!Orb_cell_cas(t->state, PENDING, FIRED)) return;
+	} else {
+		if(Orb_cell_get(t->state) != PENDING) return;
+	}
+	if(wh->batch_size == FIRE_BATCH) flush_batch(wh);
+	wh->batch[wh->batch_size++] = t->f;
+	if(t->period != 0) {
+		t->due += t->period;
+		/*skip periods we have missed*/
+		if(t->due <= wh->current) t->due = wh->current + 1;
+		place(wh, t);
+	}
+}
+
+/*put the timer in the slot for its due tick, or fire it if
+it is already due
+*/
+static void place(wheel_t wh, entry_t t) {
+	if(t->due <= wh->current) {
+		fire(wh, t);
+		return;
+	}
+	uint64_t due = t->due;
+	if(due - wh->current >= WHEEL_SPAN) due = wh->current + WHEEL_SPAN - 1;
+	uint64_t delta = due - wh->current;
+	int level = 0;
+	while(level < LEVELS - 1 &&
+			delta >= ((uint64_t) 1 << (LEVEL_BITS * (level + 1)))) {
+		++level;
+	}
+	size_t slot = (due >> (LEVEL_BITS * level)) & SLOT_MASK;
+	link_timer(&wh->slots[level][slot], t);
+	++wh->count;
+}
+
+/*move every timer in the slot to where it belongs now*/
+static void cascade(wheel_t wh, int level) {
+	size_t slot = (wh->current >> (LEVEL_BITS * level)) & SLOT_MASK;
+	entry_t head = &wh->slots[level][slot];
+	if(head->next == head) return;
+	/*detach the list first, since timers may be placed back
+	in the same slot
+	*/
+	entry_t t = head->next;
+	head->prev->next = 0;
+	slot_init(head);
+	while(t) {
+		entry_t next = t->next;
+		t->linked = 0;
+		--wh->count;
+		place(wh, t);
+		t = next;
+	}
+}
+
+/*process every tick up to now*/
+static void advance(wheel_t wh, uint64_t now) {
+	if(wh->count == 0) {
+		if(now > wh->current) wh->current = now;
+		return;
+	}
+	while(wh->current < now) {
+		++wh->current;
+		/*levels whose lower level just completed a turn, from
+		the highest down
+		*/
+		int level = 0;
+		while(level < LEVELS - 1 &&
+				((wh->current >> (LEVEL_BITS * (level + 1))) <<
+					(LEVEL_BITS * (level + 1))) == wh->current) {
+			++level;
+		}
+		for(; level > 0; --level) cascade(wh, level);
+
+		entry_t head = &wh->slots[0][wh->current & SLOT_MASK];
+		while(head->next != head) {
+			entry_t t = head->next;
+			unlink_timer(wh, t);
+			fire(wh, t);
+		}
+	}
+}
+
+/*the tick at which something next needs to be done: the
+first non-empty level 0 slot is due, or the first non-empty
+slot of a higher level is cascaded
+*/
+static uint64_t next_wake(wheel_t wh) {
+	if(wh->count == 0) return NEVER;
+	uint64_t rv = NEVER;
+	int level;
+	for(level = 0; level < LEVELS; ++level) {
+		int shift = LEVEL_BITS * level;
+		uint64_t base = (wh->current >> shift) + 1;
+		uint64_t k;
+		for(k = 0; k < SLOTS; ++k) {
+			uint64_t t = (base + k) << shift;
+			if(t >= rv) break;
+			entry_t head = &wh->slots[level][(base + k) & SLOT_MASK];
+			if(head->next != head) {
+				rv = t;
+				break;
+			}
+		}
+	}
+	return rv;
+}
+
+static uint64_t now_tick(wheel_t wh) {
+	return (Orb_monotonic_ns() - wh->epoch) / TICK;
+}
+
+static Orb_t timer_thread_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	wheel_t wh = get_wheel();
+	for(;;) {
+		if(Orb_cell_get(wh->stopping) != Orb_NIL) return Orb_NIL;
+		entry_t t;
+		for(t = take_all(wh->cancelled); t; t = t->next_cancelled) {
+			if(t->linked) unlink_timer(wh, t);
+		}
+		advance(wh, now_tick(wh));
+		for(t = take_all(wh->added); t; t = t->next_added) {
+			if(Orb_cell_get(t->state) == PENDING) place(wh, t);
+		}
+		flush_batch(wh);
+
+		uint64_t wake = next_wake(wh);
+		Orb_cell_set(wh->sleep_until, Orb_t_from_ticket(wake));
+		/*recheck after publishing sleep_until, see add_timer()*/
+		if(Orb_cell_get(wh->added) == Orb_NIL) {
+			if(wake == NEVER) {
+				Orb_sema_wait(wh->wake);
+			} else {
+				Orb_sema_wait_until(wh->wake, wh->epoch + wake * TICK);
+			}
+		}
+		Orb_cell_set(wh->sleep_until, Orb_t_from_ticket(0));
+	}
+}
+static void start_thread(wheel_t wh) {
+	wh->thread = Orb_priv_new_joinable_thread(
+		Orb_t_from_cfunc(&timer_thread_cfunc), 0
+	);
+}
+
+/*
+ * Interface
+ */
+static entry_t get_entry(Orb_t this) {
+	return Orb_t_as_pointer(Orb_deref(this, hfield1));
+}
+
+static Orb_t cancel_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to cancel"
+		);
+	}
+	return Orb_timer_cancel(argv[1]) ? Orb_TRUE : Orb_NIL;
+}
+
+void Orb_timer_init(void) {
+	Orb_gc_defglobal(&owheel);
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&timer_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+
+	wheel_t wh = Orb_gc_malloc(sizeof(wheel));
+	size_t level, slot;
+	for(level = 0; level < LEVELS; ++level) {
+		for(slot = 0; slot < SLOTS; ++slot) {
+			slot_init(&wh->slots[level][slot]);
+		}
+	}
+	wh->current = 0;
+	wh->count = 0;
+	for(slot = 0; slot < FIRE_BATCH; ++slot) wh->batch[slot] = Orb_NIL;
+	wh->batch_size = 0;
+	wh->epoch = Orb_monotonic_ns();
+	wh->added = Orb_cell_init(Orb_NIL);
+	wh->cancelled = Orb_cell_init(Orb_NIL);
+	wh->sleep_until = Orb_cell_init(Orb_t_from_ticket(0));
+	wh->wake = Orb_sema_init(0);
+	wh->started = Orb_cell_init(Orb_NIL);
+	wh->stopping = Orb_cell_init(Orb_NIL);
+	wh->thread = 0;
+	wh->restart_after_fork = 0;
+	owheel = Orb_t_from_pointer(wh);
+
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("cancel",
+			Orb_method(Orb_t_from_cfunc(&cancel_cfunc))
+		);
+	} timer_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_timer_add(Orb_t f, uint64_t delay, uint64_t period) {
+	wheel_t wh = get_wheel();
+	entry_t t = Orb_gc_malloc(sizeof(entry));
+	t->linked = 0;
+	t->f = f;
+	t->due = (Orb_monotonic_ns() - wh->epoch + delay + TICK - 1) / TICK;
+	t->period = (period + TICK - 1) / TICK;
+	if(period != 0 && t->period == 0) t->period = 1;
+	t->state = Orb_cell_init(PENDING);
+
+	if(Orb_cell_get(wh->started) == Orb_NIL &&
+			Orb_cell_cas(wh->started, Orb_NIL, Orb_TRUE)) {
+		start_thread(wh);
+	}
+	push(wh->added, t, &t->next_added);
+	/*only wake the timer thread if it would oversleep*/
+	if(t->due < Orb_ticket_from_t(Orb_cell_get(wh->sleep_until))) {
+		Orb_sema_post(wh->wake);
+	}
+
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(timer_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(t));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}
+
+int Orb_timer_cancel(Orb_t this) {
+	entry_t t = get_entry(this);
+	if(!Orb_cell_cas(t->state, PENDING, CANCELLED)) return 0;
+	/*let the timer thread take it out of the wheel*/
+	push(get_wheel()->cancelled, t, &t->next_cancelled);
+	return 1;
+}
+
+/*
+ * Fork hooks
+ */
+/*timers stay in the wheel while the thread is stopped*/
+void Orb_timer_fork_prepare(void) {
+	wheel_t wh = get_wheel();
+	wh->restart_after_fork = Orb_cell_get(wh->started) != Orb_NIL;
+	if(!wh->restart_after_fork) return;
+	Orb_cell_set(wh->stopping, Orb_TRUE);
+	Orb_sema_post(wh->wake);
+	Orb_priv_thread_join(wh->thread);
+	Orb_cell_set(wh->stopping, Orb_NIL);
+}
+void Orb_timer_fork_parent(void) {
+	wheel_t wh = get_wheel();
+	if(wh->restart_after_fork) start_thread(wh);
+}
+void Orb_timer_fork_child(void) {
+	Orb_timer_fork_parent();
+}
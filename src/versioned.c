@@ -0,0 +1,223 @@
+/*
+Copyright 2010 Alan Manuel K. Gloria
+
+This file is part of Orb C Implementation
+
+Orb C Implementation is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orb C Implementation is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Orb C Implementation.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include"liborb.h"
+#include"thread-support.h"
+#include"versioned.h"
+
+#include<limits.h>
+
+/*
+versioned objects have the following interface:
+(def versioned-base
+  (obj!extend
+    'get (method:fn (self) current-value)
+    'version (method:fn (self) current-version)
+    ; returns (version value), read together
+    'snapshot (method:fn (self) ...)
+    'set (method:fn (self v) ...)
+    ; f is called exactly once, with other writers excluded
+    'update (method:fn (self f) (set current-value (f current-value)))
+    ; sets only if nobody has written since version was read
+    'set-if-version
+    (method:fn (self version v)
+      (if (is current-version version)
+          (do (set current-value v) t)
+          nil))))
+
+Versioned objects are meant for shared state that is read
+far more often than it is written.  The current version and
+value are published together as one immutable snapshot, so a
+reader needs a single atomic load and never writes to memory
+that other readers use.  Writers are serialized by a lock,
+so updates never retry and update functions may have side
+effects.
+*/
+
+/*versions wrap around within the range of Orb integers, so
+they can be compared as Orb_t's
+*/
+#define VERSION_MAX (INT_MAX >> 2)
+#define VERSION_MIN (-VERSION_MAX - 1)
+
+struct snapshot_s {
+	Orb_t version;
+	Orb_t value;
+};
+typedef struct snapshot_s snapshot;
+typedef snapshot const* snapshot_t;
+
+struct versioned_s {
+	Orb_cell_t current; /*snapshot_t*/
+	Orb_sema_t write_lock;
+};
+typedef struct versioned_s versioned;
+typedef versioned* versioned_t;
+
+static Orb_t hfield1;
+static Orb_t versioned_base;
+
+static versioned_t get_versioned(Orb_t this) {
+	Orb_t ov = Orb_deref(this, hfield1);
+	return Orb_t_as_pointer(ov);
+}
+static snapshot_t read_snapshot(versioned_t v) {
+	return Orb_t_as_pointer(Orb_cell_get(v->current));
+}
+/*must be called with the write lock held*/
+static void publish(versioned_t v, Orb_t value) {
+	snapshot* ns = Orb_gc_malloc(sizeof(snapshot));
+	int ov = Orb_t_as_integer(read_snapshot(v)->version);
+	ns->version = Orb_t_from_integer(
+		ov == VERSION_MAX ? VERSION_MIN : ov + 1
+	);
+	ns->value = value;
+	Orb_cell_set(v->current, Orb_t_from_pointer(ns));
+}
+
+/*method function for get*/
+static Orb_t get_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to get"
+		);
+	}
+	return read_snapshot(get_versioned(argv[1]))->value;
+}
+/*method function for version*/
+static Orb_t version_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to version"
+		);
+	}
+	return read_snapshot(get_versioned(argv[1]))->version;
+}
+/*method function for snapshot*/
+static Orb_t snapshot_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 2) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to snapshot"
+		);
+	}
+	snapshot_t s = read_snapshot(get_versioned(argv[1]));
+	Orb_t arr[2];
+	arr[0] = s->version;
+	arr[1] = s->value;
+	return Orb_seq(arr, 2);
+}
+/*method function for set*/
+static Orb_t set_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to set"
+		);
+	}
+	versioned_t v = get_versioned(argv[1]);
+	Orb_sema_wait(v->write_lock);
+	publish(v, argv[2]);
+	Orb_sema_post(v->write_lock);
+	return argv[2];
+}
+/*method function for update*/
+static Orb_t update_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 3) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to update"
+		);
+	}
+	versioned_t v = get_versioned(argv[1]);
+	Orb_t f = argv[2];
+	Orb_t volatile nv;
+	Orb_sema_wait(v->write_lock);
+	Orb_TRY {
+		nv = Orb_call1(f, read_snapshot(v)->value);
+		publish(v, nv);
+	} Orb_CATCH(E) {
+		Orb_sema_post(v->write_lock);
+		Orb_E_RETHROW(E);
+	} Orb_ENDTRY;
+	Orb_sema_post(v->write_lock);
+	return nv;
+}
+/*method function for set-if-version*/
+static Orb_t set_if_version_cfunc(Orb_t argv[], size_t* pargc, size_t argl) {
+	if(*pargc != 4) {
+		Orb_THROW_cc("apply",
+			"Incorrect number of arguments to set-if-version"
+		);
+	}
+	versioned_t v = get_versioned(argv[1]);
+	if(!Orb_t_is_integer(argv[2])) {
+		Orb_THROW_cc("type", "Expected an integer version");
+	}
+	Orb_t version = argv[2];
+	int ok = 0;
+	Orb_sema_wait(v->write_lock);
+	if(read_snapshot(v)->version == version) {
+		publish(v, argv[3]);
+		ok = 1;
+	}
+	Orb_sema_post(v->write_lock);
+	return ok ? Orb_TRUE : Orb_NIL;
+}
+
+void Orb_versioned_init(void) {
+	Orb_gc_defglobal(&hfield1);
+	Orb_gc_defglobal(&versioned_base);
+
+	hfield1 = Orb_t_from_pointer(&hfield1);
+	Orb_BUILDER {
+		Orb_B_PARENT(Orb_OBJECT);
+		Orb_B_FIELD_cc("get",
+			Orb_method(Orb_t_from_cfunc(&get_cfunc))
+		);
+		Orb_B_FIELD_cc("version",
+			Orb_method(Orb_t_from_cfunc(&version_cfunc))
+		);
+		Orb_B_FIELD_cc("snapshot",
+			Orb_method(Orb_t_from_cfunc(&snapshot_cfunc))
+		);
+		Orb_B_FIELD_cc("set",
+			Orb_method(Orb_t_from_cfunc(&set_cfunc))
+		);
+		Orb_B_FIELD_cc("update",
+			Orb_method(Orb_t_from_cfunc(&update_cfunc))
+		);
+		Orb_B_FIELD_cc("set-if-version",
+			Orb_method(Orb_t_from_cfunc(&set_if_version_cfunc))
+		);
+	} versioned_base = Orb_ENDBUILDER;
+}
+
+Orb_t Orb_new_versioned(Orb_t init) {
+	versioned_t v = Orb_gc_malloc(sizeof(versioned));
+	snapshot* s = Orb_gc_malloc(sizeof(snapshot));
+	s->version = Orb_t_from_integer(0);
+	s->value = init;
+	v->current = Orb_cell_init(Orb_t_from_pointer(s));
+	v->write_lock = Orb_sema_init(1);
+
+	Orb_t rv;
+	Orb_BUILDER {
+		Orb_B_PARENT(versioned_base);
+		Orb_B_FIELD(hfield1, Orb_t_from_pointer(v));
+	} rv = Orb_ENDBUILDER;
+	return rv;
+}